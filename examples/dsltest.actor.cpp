@@ -26,6 +26,11 @@
 #include "ActorFuzz.h"
 #include "flow/DeterministicRandom.h"
 #include "flow/ThreadHelper.actor.h"
+#include "flow/TaskQueue.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 #include "flow/actorcompiler.h"  // This must be the last #include.
 
 using std::cout;
@@ -33,8 +38,6 @@ using std::endl;
 
 using std::vector;
 
-void* allocateLargePages( int total );
-
 bool testFuzzActor( Future<int>(*actor)(FutureStream<int> const&, PromiseStream<int> const&, Future<Void> const&), const char* desc, vector<int> const& expectedOutput ) {
 	// Run the test 5 times with different "timing"
 	int i, outCount;
@@ -137,109 +140,160 @@ void memoryTest2() {
 }
 #endif
 
-enum {MaxTraversalsPerThread = 64};
-
-void showNumaStatus();
-void* numaAllocate(size_t size);
+enum {MaxTraversalsPerThread = 8};
 
-#if 0
-void memoryTest() {
-	//memoryTest2();
-	//return;
-
-	showNumaStatus();
+void showNumaStatus() {
+	printf("  %d NUMA node(s), main thread on node %d, %lld cross-node frees, %lld remote magazines\n",
+		getNumaNodeCount(), getCurrentNumaNode(),
+		FastAllocator<4096>::getCrossNodeFrees() + FastAllocator<8192>::getCrossNodeFrees(),
+		FastAllocator<4096>::getRemoteMagazines() + FastAllocator<8192>::getRemoteMagazines());
+}
 
-	const int N = 128<<20;	// 128 = 1GB
-	const int N2 = 8<<20;
-	cout << "Preparing memory test with " << N / 1e6 * sizeof(void*) << " MB" << endl;
-	void **x;
-	if (0) {
-		cout << "  NUMA large pages" << endl;
-		x = (void**)numaAllocate(size_t(N)*sizeof(void*));
-	} else if (1) {
-		cout << "  Normal pages" << endl;
-		x = new void*[ N ];
-		printf("  at %p\n", x);
-	} else {
-		cout << "  Large pages" << endl;
-		x = (void**)allocate(N*sizeof(void*), true);
+struct PointerChaser {
+	void*** starts;
+	int traversals, steps;
+	double end;
+
+	THREAD_FUNC run( void* arg ) {
+		PointerChaser* self = (PointerChaser*)arg;
+		void **p[MaxTraversalsPerThread];
+		for(int j=0; j<self->traversals; j++)
+			p[j] = self->starts[j];
+		for(int i=0; i<self->steps; i++)
+			for(int j=0; j<self->traversals; j++) {
+				p[j] = (void**)*p[j];
+				if (self->traversals > 1)
+					_mm_prefetch( (const char*)p[j], _MM_HINT_T0 );
+			}
+		for(int j=0; j<self->traversals; j++)
+			if (p[j] == p[(j+1)%self->traversals] && self->traversals > 1)
+				cout << "N";
+		self->end = timer();
+		THREAD_RETURN;
 	}
-	memset(x, 0, ((int64_t)N) * sizeof(void*));
+};
 
-	showNumaStatus();
+// Chases a random pointer cycle from several threads at once, first through memory placed by first touch from the main
+// thread and then through memory split across the NUMA nodes by numaAllocate()
+void memoryTest() {
+	const int N = 16<<20;	// 128MB
+	const int N2 = 1<<20;
+	const int MT = 8;
+
+	printf("Memory test with %d MB:\n", int(N / 1e6 * sizeof(void*)));
+	for(int numa = 0; numa < 2; numa++) {
+		void **x;
+		if (numa) {
+			printf("  Pages split across NUMA nodes\n");
+			x = (void**)numaAllocate(size_t(N)*sizeof(void*));
+		} else {
+			printf("  Pages on first touch\n");
+			x = new void*[ N ];
+		}
 
-	if (1) {
-		cout <<"  Random permutation" << endl;
-		// Random cyclic permutation
+		// Random cyclic permutation, by Sattolo's algorithm
 		for(int i=0; i<N; i++)
 			x[i] = &x[i];
-		// Sattolo's algorithm
 		for(int n = N-1; n >= 1; n--) {
-			int k = g_random->randomInt(0, n);  //random.IRandomX(0, n-1);
+			int k = g_random->randomInt(0, n);
 			std::swap( x[k], x[n] );
 		}
-	} else {
-		cout <<"  Sequential permutation" << endl;
-		// Sequential
-		for(int i=0; i<N-1; i++)
-			x[i] = &x[i+1];
-		x[N-1] = &x[0];
-	}
-	void **p = x;
-	for(int i=0; i<N; i++) {
-		p = (void**)*p;
-		if (p == x) {
-			cout << "Cycle " << i << endl;
-			if (i != N-1) terminate();
-		}
-	}
 
-	const int MT = 16;
-	for(int TraversalsPerThread = 1; TraversalsPerThread <= MaxTraversalsPerThread; TraversalsPerThread *= 2)
-	{
-		const int PseudoThreads = MT * TraversalsPerThread;
-		void **starts[MT*MaxTraversalsPerThread];
-		for(int t=0; t<PseudoThreads; t++) {
-			starts[t] = &x[ N/PseudoThreads * t ];
-			//starts[t] = &x[ g_random->randomInt(0,N) ];
-		}
-		for(int T=1; T<=MT; T+=T) {
-			double start = timer();
-			vector< Future<double> > done;
-			for(int t=0; t<T; t++) {
-				void*** start = starts + t*TraversalsPerThread;
-				done.push_back(
-					inThread<double>( [start,N2,TraversalsPerThread] () -> double {
-						void **p[MaxTraversalsPerThread];
-						for(int j=0; j<TraversalsPerThread; j++)
-							p[j] = start[j];
-						for(int i=0; i<N2; i++)
-							for(int j=0; j<TraversalsPerThread; j++) {
-								p[j] = (void**)*p[j];
-								if (TraversalsPerThread > 1)
-									_mm_prefetch( (const char*)p[j], _MM_HINT_T0 );
-							}
-						for(int j=0; j<TraversalsPerThread; j++)
-							if (p[j] == p[(j+1)%TraversalsPerThread])
-								cout << "N";
-						return timer();
-					}));
-			}
-			double firstEnd = 1e30;
-			for(int t=0; t<T; t++) {
-				done[t].getBlocking();
-				firstEnd = std::min(firstEnd, done[t].get());
+		for(int TraversalsPerThread = 1; TraversalsPerThread <= MaxTraversalsPerThread; TraversalsPerThread *= 8) {
+			const int PseudoThreads = MT * TraversalsPerThread;
+			void **starts[MT*MaxTraversalsPerThread];
+			for(int t=0; t<PseudoThreads; t++)
+				starts[t] = &x[ N/PseudoThreads * t ];
+			for(int T=1; T<=MT; T+=T) {
+				PointerChaser chasers[MT];
+				THREAD_HANDLE threads[MT];
+				double start = timer();
+				for(int t=0; t<T; t++) {
+					chasers[t].starts = starts + t*TraversalsPerThread;
+					chasers[t].traversals = TraversalsPerThread;
+					chasers[t].steps = N2;
+					threads[t] = startThread( &PointerChaser::run, &chasers[t] );
+				}
+				double firstEnd = 1e30;
+				for(int t=0; t<T; t++) {
+					waitThread( threads[t] );
+					firstEnd = std::min(firstEnd, chasers[t].end);
+				}
+				double end = timer();
+				printf("    %2dx%2d traversals: %5.3fs, %6.1f M/sec, %4.1f%%\n", T, TraversalsPerThread, end-start,
+					N2 / 1e6 * (T*TraversalsPerThread) / (end-start),
+					(firstEnd-start)/(end-start)*100.0);
 			}
-			double end = timer();
-			printf("  %2dx%2d traversals: %5.3fs, %6.1f M/sec, %4.1f%%\n", T, (int)TraversalsPerThread, end-start,
-				N2 / 1e6 * (T*TraversalsPerThread) / (end-start),
-				(firstEnd-start)/(end-start)*100.0);
 		}
-	}
 
-	//delete[] x;	// TODO: Free large pages
+		if (numa)
+			numaFree(x, size_t(N)*sizeof(void*));
+		else
+			delete[] x;
+	}
+	showNumaStatus();
 }
+
+// Counts the data TLB misses of the calling thread, where the kernel allows it
+struct TLBMissCounter {
+	int fd;
+	TLBMissCounter() : fd(-1) {
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.exclude_kernel = attr.exclude_hv = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
 #endif
+	}
+	~TLBMissCounter() { if (fd >= 0) close(fd); }
+	int64_t get() {
+		int64_t count = -1;
+		if (fd < 0 || ::read(fd, &count, sizeof(count)) != sizeof(count))
+			return -1;
+		return count;
+	}
+};
+
+// Chases a random pointer cycle through memory on normal pages and then on huge pages from allocateLargePages(), as
+// FastAllocator uses with the FAST_ALLOC_HUGE_PAGES knob
+void largePageTest() {
+	const int N = 16<<20;	// 128MB
+	const int N2 = 4<<20;
+
+	printf("Large page test with %d MB:\n", int(N / 1e6 * sizeof(void*)));
+	for(int large = 0; large < 2; large++) {
+		size_t bytes = size_t(N)*sizeof(void*);
+		void **x = large ? (void**)allocateLargePages(bytes) : new void*[ N ];
+		for(int i=0; i<N; i++)
+			x[i] = &x[i];
+		for(int n = N-1; n >= 1; n--)
+			std::swap( x[ g_random->randomInt(0, n) ], x[n] );
+
+		TLBMissCounter misses;
+		int64_t startMisses = misses.get();
+		double start = timer();
+		void **p = x;
+		for(int i=0; i<N2; i++)
+			p = (void**)*p;
+		double t = timer() - start;
+		int64_t endMisses = misses.get();
+		if (p == x) cout << "N";
+
+		printf("  %s: %5.1f ns/access, ", large ? "Large pages " : "Normal pages", t / N2 * 1e9);
+		if (startMisses >= 0 && endMisses >= 0)
+			printf("%4.2f dTLB misses/access\n", double(endMisses - startMisses) / N2);
+		else
+			printf("dTLB misses not available\n");
+
+		if (large)
+			freeLargePages(x, bytes);
+		else
+			delete[] x;
+	}
+}
 
 ACTOR template <int N, class X>
 Future<X> addN(Future<X> in) {
@@ -1132,7 +1186,123 @@ void asyncMapTest() {
 
 extern void net2_test();
 
-void dsltest() {
+struct BenchTask {
+	int64_t priority;
+	int taskID;
+	double at;
+	int* index;  // For TimerWheel
+	double deadline;  // For ReadyQueue::pushByDeadline()
+	BenchTask( int64_t priority, int taskID, double at, int* index = nullptr ) : priority(priority), taskID(taskID), at(at), index(index), deadline(0) {}
+	int* wheelIndex() const { return index; }
+	bool operator < (BenchTask const& rhs) const { return priority < rhs.priority; }
+};
+
+struct BenchTimerOrder {
+	bool operator()( BenchTask const& a, BenchTask const& b ) const { return a.at > b.at; }
+};
+
+template <class Q>
+double benchYields( Q& q, int n ) {
+	// Steady state of 64 runnable tasks at a few priorities, each of which yields and is requeued
+	static const int taskIDs[] = { TaskDefaultYield, TaskDefaultDelay, TaskDefaultOnMainThread, TaskLowPriority };
+	int64_t seq = 0;
+	for(int i=0; i<64; i++) {
+		int id = taskIDs[i&3];
+		q.push( BenchTask( (int64_t(id)<<32) - (++seq), id, 0 ) );
+	}
+	double start = timer();
+	for(int i=0; i<n; i++) {
+		int id = q.top().taskID;
+		q.pop();
+		q.push( BenchTask( (int64_t(id)<<32) - (++seq), id, 0 ) );
+	}
+	double t = timer() - start;
+	while (!q.empty()) q.pop();
+	return t;
+}
+
+template <class AddFn, class ExpireFn>
+double benchDelays( int n, AddFn add, ExpireFn expire ) {
+	// Timers are added with delays up to 1 second while virtual time advances 100us per step
+	DeterministicRandom rand(1);
+	double now = 1000;
+	int64_t fired = 0;
+	std::vector<int> indices( n );
+	double start = timer();
+	for(int i=0; i<n; i++) {
+		add( BenchTask( i, TaskDefaultDelay, now + rand.random01(), &indices[i] ) );
+		if ((i&15) == 15) {
+			now += 0.0016;
+			fired += expire( now );
+		}
+	}
+	fired += expire( now + 2 );
+	double t = timer() - start;
+	ASSERT( fired == n );
+	return t;
+}
+
+enum { FAR_TIMERS = 100000 };
+
+template <class AddFn, class RemoveFn, class NextFn>
+double benchNextExpiry( int n, AddFn add, RemoveFn remove, NextFn next ) {
+	// Many timeouts about 100 seconds out share one upper level wheel slot, while the run loop asks for the next
+	// expiry on every sleep, here around adding and cancelling one short timer
+	DeterministicRandom rand(1);
+	double now = 1010;  // After benchDelays()
+	std::vector<int> indices( FAR_TIMERS+1 );
+	std::vector<BenchTask> far;
+	for(int i=0; i<FAR_TIMERS; i++) {
+		far.push_back( BenchTask( i, TaskDefaultDelay, now + 100 + rand.random01(), &indices[i] ) );
+		add( far.back() );
+	}
+	double sum = 0;
+	double start = timer();
+	for(int i=0; i<n; i++) {
+		BenchTask t( FAR_TIMERS, TaskDefaultDelay, now + 0.01, &indices[FAR_TIMERS] );
+		add( t );
+		sum += next();
+		remove( t );
+		sum += next();
+	}
+	double elapsed = timer() - start;
+	ASSERT( sum > 0 );
+	for(auto& t : far)
+		remove( t );
+	return elapsed;
+}
+
+void taskQueueTest() {
+	const int N = 1000000;
+
+	std::priority_queue<BenchTask> readyHeap;
+	ReadyQueue<BenchTask> readyQueue;
+	double heapT = benchYields( readyHeap, N );
+	double queueT = benchYields( readyQueue, N );
+	printf("Ready queue (%dM yields): priority_queue %0.3f sec, ReadyQueue %0.3f sec\n", N/1000000, heapT, queueT);
+
+	std::priority_queue<BenchTask, std::vector<BenchTask>, BenchTimerOrder> timerHeap;
+	heapT = benchDelays( N,
+		[&](BenchTask const& t) { timerHeap.push(t); },
+		[&](double now) { int n = 0; while (!timerHeap.empty() && timerHeap.top().at < now) { timerHeap.pop(); n++; } return n; } );
+	TimerWheel<BenchTask> wheel;
+	double wheelT = benchDelays( N,
+		[&](BenchTask const& t) { wheel.add(t); },
+		[&](double now) { int n = 0; wheel.expire( now, [&n](BenchTask const&) { n++; } ); return n; } );
+	printf("Timers (%dM delays): priority_queue %0.3f sec, TimerWheel %0.3f sec\n", N/1000000, heapT, wheelT);
+
+	heapT = benchNextExpiry( N,
+		[&](BenchTask const& t) { timerHeap.push(t); },
+		[&](BenchTask const& t) { timerHeap.pop(); },
+		[&]() { return timerHeap.top().at; } );
+	wheelT = benchNextExpiry( N,
+		[&](BenchTask const& t) { wheel.add(t); },
+		[&](BenchTask const& t) { wheel.remove(t); },
+		[&]() { return wheel.nextExpiry(); } );
+	printf("Next expiry (%dM short timers, %d far timers): priority_queue %0.3f sec, TimerWheel %0.3f sec\n", N/1000000, FAR_TIMERS, heapT, wheelT);
+}
+
+void dsltest(bool memoryTests) {
 	double startt, endt;
 
 	g_random = new DeterministicRandom(40);
@@ -1141,6 +1311,11 @@ void dsltest() {
 
 	net2_test();
 	//sleeptest();
+	taskQueueTest();
+	if (memoryTests) {
+		memoryTest();
+		largePageTest();
+	}
 
 	Future<Void> ctf = cycleTime(1000,1000);
 	ctf.get();
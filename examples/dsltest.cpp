@@ -1,14 +1,27 @@
 #include <iostream>
 #include <string>
+#include <cstring>
 #include "flow/flow.h"
 #include "test.h"
 
 using namespace std;
 
-void dsltest();
+void dsltest(bool memoryTests);
+
+void usage(const char* program) {
+  cout << "Usage: " << program << " [memory]" << endl;
+  cout << "  memory also runs the NUMA and large page benchmarks, which chase pointers through 128MB arrays from up to 8 threads" << endl;
+}
 
 int main(int argc, char **argv) {
-  RUN_TEST(dsltest);
+  if (argc > 2 || (argc == 2 && strcmp(argv[1], "memory"))) {
+    usage(argv[0]);
+    return -1;
+  }
+  bool memoryTests = argc == 2;
+  cout << "Running dsltest...\n";
+  dsltest(memoryTests);
+  cout << endl;
 
   return 0;
 }
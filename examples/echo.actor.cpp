@@ -0,0 +1,170 @@
+#include <iostream>
+#include "flow/flow.h"
+#include "flow/network.h"
+#include "flow/Net2Packet.h"
+#include "flow/CoalescingWriter.h"
+#include "flow/Deque.h"
+#include "flow/genericactors.actor.h"
+#include "flow/actorcompiler.h"  // This must be the last #include
+
+using namespace std;
+
+// A loopback echo benchmark for the Net2 socket path.  Each client sends a message, waits for the server to echo it
+// back, and repeats, so the round trip rate mostly measures the reactor and system call overhead per message.
+// Large messages show the cost of copying them on the client side, unless they are sent with MSG_ZEROCOPY (which
+// the kernel turns back into a copy over loopback, so use a real network to see its benefit).  With coalesce, several
+// requesters share each connection, as RPCs do, and their messages go through a CoalescingWriter.
+
+ACTOR Future<Void> writeAll(Reference<IConnection> conn, uint8_t const* data, int size) {
+  state int sent = 0;
+  while (sent < size) {
+    SendBuffer buffer;
+    buffer.data = data + sent;
+    buffer.bytes_written = size - sent;
+    buffer.bytes_sent = 0;
+    buffer.next = 0;
+    int n = conn->write(&buffer);
+    sent += n;
+    if (!n) wait( conn->onWritable() );
+  }
+  return Void();
+}
+
+ACTOR Future<Void> echoConnection(Reference<IConnection> conn) {
+  state std::vector<uint8_t> buffer(64 << 10);
+  try {
+    loop {
+      wait( conn->onReadable() );
+      int n = conn->read(buffer.data(), buffer.data() + buffer.size());
+      if (n) wait( writeAll(conn, buffer.data(), n) );
+    }
+  } catch (Error& e) {
+    if (e.code() != error_code_connection_failed) throw;
+  }
+  conn->close();
+  return Void();
+}
+
+ACTOR Future<Void> echoServer(Reference<IListener> listener) {
+  state std::vector<Future<Void>> connections;
+  loop {
+    Reference<IConnection> conn = wait( listener->accept() );
+    connections.push_back(echoConnection(conn));
+  }
+}
+
+ACTOR Future<Void> sendPacket(Reference<IConnection> conn, UnsentPacketQueue* unsent) {
+  while (!unsent->empty()) {
+    int n = conn->write(unsent->getUnsent());
+    if (n)
+      unsent->sent(n);
+    else
+      wait( conn->onWritable() );
+  }
+  return Void();
+}
+
+ACTOR Future<Void> echoClient(NetworkAddress addr, int messages, int size, bool zeroCopy) {
+  state Reference<IConnection> conn = wait( INetworkConnections::net()->connect(addr) );
+  state Standalone<StringRef> message = makeString(size);
+  state std::vector<uint8_t> reply(size + sizeof(uint32_t));
+  state std::shared_ptr<UnsentPacketQueue> unsent = std::make_shared<UnsentPacketQueue>();
+  state int i;
+  state int received;
+  memset(mutateString(message), 'x', size);
+  for (i = 0; i < messages; i++) {
+    // Messages are length-prefixed, as a serialized StringRef is.  With zeroCopy the PacketWriter refers to the
+    // message's memory rather than copying it (if it is at least ZERO_COPY_MIN_BYTES).
+    PacketWriter writer(unsent->getWriteBuffer(), NULL, AssumeVersion(currentProtocolVersion));
+    if (zeroCopy)
+      SerializeSourceZeroCopy(message).serializePacketWriter(writer);
+    else
+      writer << (StringRef const&)message;
+    unsent->setWriteBuffer(writer.finish());
+    wait( sendPacket(conn, unsent.get()) );
+
+    received = 0;
+    while (received < reply.size()) {
+      wait( conn->onReadable() );
+      received += conn->read(reply.data() + received, reply.data() + reply.size());
+    }
+  }
+  conn->close();
+  return Void();
+}
+
+// The server echoes messages in order, so replies are matched to requests first in, first out
+ACTOR Future<Void> dispatchReplies(Reference<IConnection> conn, int size, std::shared_ptr<Deque<Promise<Void>>> waiting) {
+  state std::vector<uint8_t> buffer(64 << 10);
+  state int64_t received = 0;
+  state int64_t replyBytes = size + sizeof(uint32_t);
+  loop {
+    wait( conn->onReadable() );
+    received += conn->read(buffer.data(), buffer.data() + buffer.size());
+    for (; received >= replyBytes; received -= replyBytes) {
+      waiting->front().send(Void());
+      waiting->pop_front();
+    }
+  }
+}
+
+ACTOR Future<Void> requester(std::shared_ptr<CoalescingWriter> writer, std::shared_ptr<Deque<Promise<Void>>> waiting,
+                             Standalone<StringRef> message, int messages) {
+  state int i;
+  for (i = 0; i < messages; i++) {
+    PacketWriter packet(writer->unsent.getWriteBuffer(), NULL, AssumeVersion(currentProtocolVersion));
+    packet << (StringRef const&)message;
+    writer->unsent.setWriteBuffer(packet.finish());
+    writer->send();
+    Promise<Void> reply;
+    waiting->push_back(reply);
+    wait( reply.getFuture() );
+  }
+  return Void();
+}
+
+ACTOR Future<Void> coalescingClient(NetworkAddress addr, int messages, int size, int64_t* writes, int64_t* bytes) {
+  state Reference<IConnection> conn = wait( INetworkConnections::net()->connect(addr) );
+  state std::shared_ptr<CoalescingWriter> writer = std::make_shared<CoalescingWriter>(conn);
+  state std::shared_ptr<Deque<Promise<Void>>> waiting = std::make_shared<Deque<Promise<Void>>>();
+  state Standalone<StringRef> message = makeString(size);
+  memset(mutateString(message), 'x', size);
+  state Future<Void> replies = dispatchReplies(conn, size, waiting);
+  state std::vector<Future<Void>> requesters;
+  for (int r = 0; r < 16; r++)
+    requesters.push_back(requester(writer, waiting, message, messages / 16 + (r < messages % 16)));
+  wait( waitForAll(requesters) || writer->onError() || replies );
+  *writes += writer->getWrites();
+  *bytes += writer->getBytesWritten();
+  conn->close();
+  return Void();
+}
+
+ACTOR void echoTest(NetworkAddress addr, int connections, int messages, int size, bool zeroCopy, bool coalesce) {
+  state Reference<IListener> listener = INetworkConnections::net()->listen(addr);
+  state Future<Void> server = echoServer(listener);
+  wait( delay(0) );
+
+  state double start = timer();
+  state std::vector<Future<Void>> clients;
+  state int64_t writes = 0;
+  state int64_t bytes = 0;
+  for (int i = 0; i < connections; i++)
+    clients.push_back(coalesce ? coalescingClient(addr, messages, size, &writes, &bytes) : echoClient(addr, messages, size, zeroCopy));
+  wait( waitForAll(clients) );
+  double elapsed = timer() - start;
+
+  cout << connections << " connections x " << messages << " round trips of " << size + 4 << " bytes: " << elapsed << " sec, "
+       << connections * messages / elapsed << " round trips/sec\n";
+  if (coalesce)
+    cout << "Client writes: " << writes << ", " << (double)bytes / std::max<int64_t>(writes, 1) << " bytes per write\n";
+  NetworkMetrics const& m = g_network->networkMetrics;
+  if (m.countRingEnters) {
+    // Each eventfd read is a batch of completions that had to wake the reactor through epoll
+    cout << "io_uring: " << m.countRingEnters << " enters, " << m.countRingCompletions << " completions, "
+         << m.countRingEventFDReads << " eventfd reads (" << (double)m.countRingCompletions / std::max<uint64_t>(m.countRingEventFDReads, 1)
+         << " completions per read, " << (double)(m.countRingEnters + m.countRingEventFDReads) / (connections * messages)
+         << " ring system calls per round trip)\n";
+  }
+  g_network->stop();
+}
@@ -0,0 +1,38 @@
+#include <iostream>
+#include <string>
+#include "flow/DeterministicRandom.h"
+#include "flow/flow.h"
+#include "flow/network.h"
+
+using namespace std;
+
+void echoTest(NetworkAddress const& addr, int const& connections, int const& messages, int const& size, bool const& zeroCopy, bool const& coalesce);
+
+void usage(const char* program) {
+  cout << "Usage: " << program << " epoll|uring|zerocopy|coalesce|virtual [connections] [round trips] [message bytes] [port]" << endl;
+  cout << "  virtual echoes over in-memory loopback connections in virtual time" << endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 6 || (strcmp(argv[1], "epoll") && strcmp(argv[1], "uring") && strcmp(argv[1], "zerocopy") && strcmp(argv[1], "coalesce") && strcmp(argv[1], "virtual"))) {
+    usage(argv[0]);
+    return -1;
+  }
+  int connections = argc > 2 ? atoi(argv[2]) : 16;
+  int messages = argc > 3 ? atoi(argv[3]) : 20000;
+  int size = argc > 4 ? atoi(argv[4]) : 64;
+  int port = argc > 5 ? atoi(argv[5]) : 4599;
+
+  int randomSeed = platform::getRandomSeed();
+  g_random = new DeterministicRandom(randomSeed);
+  g_nondeterministic_random = new DeterministicRandom(platform::getRandomSeed());
+  // The knobs have to be set before the reactor is created
+  bool zeroCopy = !strcmp(argv[1], "zerocopy");
+  const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob("reactor_io_uring", strcmp(argv[1], "uring") ? "0" : "1");
+  const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob("send_zero_copy", zeroCopy ? "1" : "0");
+  g_network = strcmp(argv[1], "virtual") ? newNet2(false) : newVirtualNetwork(randomSeed);
+
+  echoTest(NetworkAddress::parse("127.0.0.1:" + std::to_string(port)), connections, messages, size, zeroCopy, !strcmp(argv[1], "coalesce"));
+  g_network->run();
+  return 0;
+}
@@ -0,0 +1,62 @@
+#include <iostream>
+#include "flow/flow.h"
+#include "flow/IAsyncFile.h"
+#include "flow/genericactors.actor.h"
+#include "flow/actorcompiler.h"  // This must be the last #include
+
+using namespace std;
+
+// Writes a file one page at a time with many operations outstanding, reads it back, and checks the contents.  With
+// OPEN_UNCACHED the pages go through io_uring or kernel AIO, in one batch per run loop iteration; without it they go
+// through the file I/O thread pool, unless the reactor uses io_uring.
+
+static const int PAGE_SIZE = 4096;
+
+ACTOR Future<double> writeAndVerify(std::string filename, int64_t flags, int pages) {
+  state Reference<IAsyncFile> f = wait( IAsyncFileSystem::filesystem()->open(
+    filename, flags | IAsyncFile::OPEN_READWRITE | IAsyncFile::OPEN_CREATE, 0600) );
+  state uint8_t* buf = (uint8_t*)aligned_alloc(PAGE_SIZE, (size_t)pages * PAGE_SIZE);
+  state double start = timer();
+
+  for (int i = 0; i < pages; i++)
+    memset(buf + (size_t)i * PAGE_SIZE, i & 0xff, PAGE_SIZE);
+  state std::vector<Future<Void>> writes;
+  for (int i = 0; i < pages; i++)
+    writes.push_back(f->write(buf + (size_t)i * PAGE_SIZE, PAGE_SIZE, (int64_t)i * PAGE_SIZE));
+  wait( waitForAll(writes) );
+  wait( f->sync() );
+
+  memset(buf, 0, (size_t)pages * PAGE_SIZE);
+  state std::vector<Future<int>> reads;
+  for (int i = 0; i < pages; i++)
+    reads.push_back(f->read(buf + (size_t)i * PAGE_SIZE, PAGE_SIZE, (int64_t)i * PAGE_SIZE));
+  wait( waitForAll(reads) );
+  state double elapsed = timer() - start;
+  for (int i = 0; i < pages; i++)
+    ASSERT( reads[i].get() == PAGE_SIZE && buf[(size_t)i * PAGE_SIZE] == (i & 0xff) && buf[(size_t)i * PAGE_SIZE + PAGE_SIZE - 1] == (i & 0xff) );
+
+  // A read past the end of the file is short
+  int n = wait( f->read(buf, PAGE_SIZE, (int64_t)pages * PAGE_SIZE) );
+  ASSERT( n == 0 );
+  wait( f->truncate(PAGE_SIZE) );
+  int64_t size = wait( f->size() );
+  ASSERT( size == PAGE_SIZE );
+
+  aligned_free(buf);
+  f = Reference<IAsyncFile>();
+  wait( IAsyncFileSystem::filesystem()->deleteFile(filename, true) );
+  return elapsed;
+}
+
+ACTOR void fileTest() {
+  state int pages = 4096;
+  try {
+    double cached = wait( writeAndVerify("flow_file_test.dat", 0, pages) );
+    cout << "Cached: " << pages << " page writes and reads in " << cached << " sec\n";
+    double uncached = wait( writeAndVerify("flow_file_test.dat", IAsyncFile::OPEN_UNCACHED, pages) );
+    cout << "Uncached: " << pages << " page writes and reads in " << uncached << " sec\n";
+  } catch (Error& e) {
+    cout << "File test failed: " << e.what() << "\n";
+  }
+  g_network->stop();
+}
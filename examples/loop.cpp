@@ -11,21 +11,42 @@ void loopTest();
 void delayTest();
 void brokenTest();
 void exceptTest();
+void parallelTest();
+void fileTest();
+void tasksTest();
 
 void usage(const char* program) {
-  cout << "Usage: " << program << " loop|delay|broken|except" << endl;
+  cout << "Usage: " << program << " <test> [virtual]" << endl;
+  cout << "Tests:" << endl;
+  cout << "  loop" << endl;
+  cout << "  delay" << endl;
+  cout << "  broken" << endl;
+  cout << "  except" << endl;
+  cout << "  parallel [run loops]" << endl;
+  cout << "  file" << endl;
+  cout << "  tasks [tsc clock 0|1]" << endl;
+  cout << "virtual runs the test in virtual time, e.g. without waiting for its delays (not file)" << endl;
 }
 
 int main(int argc, char **argv) {
+  bool virtualTime = argc > 2 && !strcmp(argv[argc-1], "virtual");
+  if (virtualTime) argc--;
   int randomSeed = platform::getRandomSeed();
   g_random = new DeterministicRandom(randomSeed);
   g_nondeterministic_random = new DeterministicRandom(platform::getRandomSeed());
-  g_network = newNet2(false);
+  if (argc == 3 && !strcmp(argv[1], "tasks"))
+    const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob("tsc_clock", argv[2]);
+  g_network = virtualTime ? newVirtualNetwork(randomSeed) : newNet2(false);
+  if (virtualTime) cout << "Virtual time, random seed " << randomSeed << endl;
 
-  if (argc != 2) {
+  if (argc != 2 && !(argc == 3 && (!strcmp(argv[1], "parallel") || !strcmp(argv[1], "tasks")))) {
     usage(argv[0]);
     return 0;
   }
+  if (virtualTime && !strcmp(argv[1], "file")) {
+    cout << "The file test can't run in virtual time, which has no file system" << endl;
+    return -1;
+  }
 
   if (!strcmp(argv[1], "loop")) {
     RUN_TEST(loopTest);
@@ -39,6 +60,16 @@ int main(int argc, char **argv) {
   } else if (!strcmp(argv[1], "except")) {
     RUN_TEST(exceptTest);
     cout << argv[1] << "Test running... (expecting no exceptions being caught)\n";
+  } else if (!strcmp(argv[1], "parallel")) {
+    const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob("run_loops", argc == 3 ? argv[2] : "4");
+    RUN_TEST(parallelTest);
+    cout << argv[1] << "Test running... (expecting " << FLOW_KNOBS->RUN_LOOPS << " run loops)\n";
+  } else if (!strcmp(argv[1], "file")) {
+    RUN_TEST(fileTest);
+    cout << argv[1] << "Test running... (expecting file writes and reads)\n";
+  } else if (!strcmp(argv[1], "tasks")) {
+    RUN_TEST(tasksTest);
+    cout << argv[1] << "Test running... (expecting per-task overheads)\n";
   } else {
     usage(argv[0]);
     return -1;
@@ -0,0 +1,42 @@
+#include <iostream>
+#include "flow/flow.h"
+#include "flow/genericactors.actor.h"
+#include "flow/ThreadHelper.actor.h"
+#include "flow/actorcompiler.h"  // This must be the last #include
+
+using namespace std;
+
+// Spreads CPU-bound work across the run loops started with the RUN_LOOPS knob.  Each worker hops onto whichever
+// loop is free with onAnyRunLoop(), burns some CPU there, and then returns its result on run loop 0.  onAnyRunLoop()
+// starts waiting for both hops before posting the first, since the other loop may send a posted Promise at once.
+
+static volatile int32_t tasksPerLoop[64];
+
+ACTOR Future<int64_t> spinWorker(int64_t iterations) {
+  // iterations is a member of the actor's state, so the lambda captures a copy of it
+  int64_t n = iterations;
+  int64_t x = wait( onAnyRunLoop( [n]() -> Future<int64_t> {
+    interlockedIncrement(&tasksPerLoop[std::min(g_network->getCurrentRunLoop(), 63)]);
+    int64_t r = 0;
+    for (int64_t i = 0; i < n; i++)
+      r = r * 6364136223846793005LL + 1442695040888963407LL;
+    return r;
+  }, TaskDefaultYield ) );
+  return x;
+}
+
+ACTOR void parallelTest() {
+  // The additional run loops are started by g_network->run()
+  wait( delay(0) );
+
+  state double start = timer();
+  state std::vector<Future<int64_t>> workers;
+  for (int i = 0; i < 64; i++)
+    workers.push_back(spinWorker(20000000));
+  wait( waitForAll(workers) );
+
+  cout << "64 workers on " << g_network->getRunLoopCount() << " run loops: " << timer() - start << " sec\n";
+  for (int i = 0; i < g_network->getRunLoopCount() && i < 64; i++)
+    cout << "  run loop " << i << ": " << tasksPerLoop[i] << " workers\n";
+  g_network->stop();
+}
@@ -0,0 +1,43 @@
+#include <iostream>
+#include "flow/flow.h"
+#include "flow/actorcompiler.h"  // This must be the last #include
+
+using namespace std;
+
+// Measures the run loop's bookkeeping for each task, with tasks that do nothing but queue the next one, and for each
+// yield() call that does not yield.  Run it with the TSC_CLOCK knob off and on to compare timing tasks with
+// timer_monotonic() against timing them with the TSC.
+
+static const int TASKS = 2000000;
+static const int YIELD_CHECKS = 20000000;
+
+ACTOR Future<double> queueTasks() {
+  state double start = timer_monotonic();
+  state int i;
+  for (i = 0; i < TASKS; i++)
+    wait( delay(0) );
+  return (timer_monotonic() - start) / TASKS;
+}
+
+ACTOR Future<double> checkYields() {
+  state double start = timer_monotonic();
+  state int i;
+  state int yields = 0;
+  for (i = 0; i < YIELD_CHECKS; i++) {
+    Future<Void> y = yield();
+    if (!y.isReady()) {
+      yields++;
+      wait( y );
+    }
+  }
+  return (timer_monotonic() - start) / (YIELD_CHECKS + yields);
+}
+
+ACTOR void tasksTest() {
+  wait( delay(0) );
+  double perTask = wait( queueTasks() );
+  cout << "TSC clock " << (FLOW_KNOBS->TSC_CLOCK ? "on" : "off") << ": " << perTask * 1e9 << " ns per task, ";
+  double perYield = wait( checkYields() );
+  cout << perYield * 1e9 << " ns per yield() check\n";
+  g_network->stop();
+}
@@ -0,0 +1,222 @@
+/*
+ * Arena.actor.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/Arena.h"
+#include "flow/flow.h"
+#include "flow/UnitTest.h"
+#include "flow/actorcompiler.h"  // This must be the last #include.
+
+#ifndef FLOW_SCRATCH_ARENA_POISON
+#ifdef NDEBUG
+#define FLOW_SCRATCH_ARENA_POISON 0
+#else
+#define FLOW_SCRATCH_ARENA_POISON 1
+#endif
+#endif
+
+thread_local bool g_arenaFreeIncrementally = false;
+std::atomic<int64_t> g_arenaFreePendingBytes( 0 );
+
+ACTOR static void freeArenaBlocks( std::vector<ArenaBlock*> blocks ) {
+	// Blocks are freed depth first, as in ArenaBlock::destroy(), ARENA_FREE_BYTES_PER_TASK at a time.  Each block
+	// counts towards g_arenaFreePendingBytes from when it is left without references until it is freed.
+	while (!blocks.empty()) {
+		wait( delay( 0, TaskDefaultYield ) );
+
+		std::vector<ArenaBlock*>& stack = blocks;
+		int64_t freed = 0;
+		while (!stack.empty() && freed < FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK) {
+			ArenaBlock* b = stack.back();
+			stack.pop_back();
+			b->releaseDependencies( [&stack](ArenaBlock* next) {
+				stack.push_back( next );
+				g_arenaFreePendingBytes.fetch_add( next->size(), std::memory_order_relaxed );
+			} );
+			freed += b->size();
+			g_arenaFreePendingBytes.fetch_sub( b->size(), std::memory_order_relaxed );
+			b->destroyLeaf();
+		}
+	}
+}
+
+void freeArenaBlocksLater( std::vector<ArenaBlock*> blocks ) {
+	for(auto b : blocks)
+		g_arenaFreePendingBytes.fetch_add( b->size(), std::memory_order_relaxed );
+	freeArenaBlocks( std::move(blocks) );
+}
+
+struct ScratchArena {
+	Arena arena;  // What scratchArena() hands out; allocations past the end of block move it to an overflow block
+	Reference<ArenaBlock> block;
+	int64_t bytes;
+
+	// At least LARGE, so that block is never tiny
+	ScratchArena() : bytes( FLOW_KNOBS->SCRATCH_ARENA_BYTES > 0 ? std::max<int64_t>( FLOW_KNOBS->SCRATCH_ARENA_BYTES, ArenaBlock::LARGE ) : 0 ) {
+#if !FLOW_ARENA_THREAD_SAFE
+		// Made once per run loop, before it runs anything.  Neither the scratch arena nor incremental freeing is
+		// supported with non-atomic reference counts.
+		ASSERT( FLOW_KNOBS->SCRATCH_ARENA_BYTES == 0 && FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK == 0 );
+#endif
+	}
+};
+static thread_local ScratchArena* scratch = NULL;
+
+Arena& scratchArena() {
+	// Only a run loop resets it, so on any other thread it would grow without bound
+	ASSERT( scratch );
+	return scratch->arena;
+}
+
+void resetScratchArena() {
+	if (!scratch) scratch = new ScratchArena;
+	ScratchArena& s = *scratch;
+	ArenaBlock* b = s.block.getPtr();
+	// Allocations that did not fit went to blocks that either come before block in the arena, or are referenced from it
+	// (see ArenaBlock::create())
+	bool overflowed = s.arena.impl.getPtr() != b || (b && b->nextBlockOffset);
+	if (b && !overflowed && b->used() == sizeof(ArenaBlock)) return;
+
+	s.arena = Arena();  // Frees any overflow blocks, which depend on block
+	if (b) {
+		if (!b->isSoleOwnerUnsafe()) {
+			// Leave block to whoever kept it, and start again with a new one
+			TraceEvent(SevWarnAlways, "ScratchArenaEscaped").detail("Bytes", b->used()).detail("References", b->debugGetReferenceCount() - 1);
+			s.block = Reference<ArenaBlock>();
+		} else {
+			// Blocks made in the arena while block still had room for the reference (see ArenaBlock::create())
+			b->releaseDependencies( [](ArenaBlock* next) { next->destroy(); } );
+			b->nextBlockOffset = 0;
+#if FLOW_SCRATCH_ARENA_POISON
+			memset( (uint8_t*)b + sizeof(ArenaBlock), 0xcd, b->used() - sizeof(ArenaBlock) );
+#endif
+			b->bigUsed = sizeof(ArenaBlock);
+		}
+		if (overflowed && s.bytes < FLOW_KNOBS->SCRATCH_ARENA_MAX_BYTES) {
+			s.bytes = std::min( s.bytes * 2, FLOW_KNOBS->SCRATCH_ARENA_MAX_BYTES );
+			s.block = Reference<ArenaBlock>();
+			TraceEvent("ScratchArenaGrown").detail("Bytes", s.bytes);
+		}
+	}
+	if (!s.block && s.bytes > 0) {
+		s.block = Arena( s.bytes ).impl;
+		ASSERT( !s.block->isTiny() );
+	}
+	s.arena.impl = s.block;
+}
+
+TEST_CASE("/flow/Arena/scratch") {
+	if (FLOW_KNOBS->SCRATCH_ARENA_BYTES <= 0) return Void();
+
+	// Data left in the scratch arena by earlier tasks is already dead, so the test can reset it in the middle of one
+	resetScratchArena();
+	StringRef s( scratchArena(), LiteralStringRef("transient") );
+	ASSERT( s == LiteralStringRef("transient") );
+	const uint8_t* p = s.begin();
+	resetScratchArena();
+	StringRef t( scratchArena(), LiteralStringRef("transient") );
+	ASSERT( t.begin() == p );
+
+	// An overflowing batch grows the arena for the next one
+	size_t size = scratchArena().getSize();
+	VectorRef<uint8_t> v;
+	v.resize( scratchArena(), size );
+	ASSERT( scratchArena().getSize() > size );
+	resetScratchArena();
+	ASSERT( scratchArena().getSize() > size || size >= FLOW_KNOBS->SCRATCH_ARENA_MAX_BYTES );
+	return Void();
+}
+
+TEST_CASE("/flow/Arena/crossThread") {
+	// Nothing else references its blocks, so it moves
+	Standalone<StringRef> a = LiteralStringRef("handed to another thread");
+	ArenaBlock* b = a.arena().impl.getPtr();
+	const uint8_t* p = a.begin();
+	Standalone<StringRef> r = crossThread( a );
+	ASSERT( r == LiteralStringRef("handed to another thread") && r.begin() == p && r.arena().impl.getPtr() == b );
+	ASSERT( a.size() == 0 && !a.arena().impl );
+
+	// Another arena shares its block, which only an atomic reference count allows to move
+	Arena shared = r.arena();
+	Standalone<StringRef> s = crossThread( r );
+	ASSERT( s == LiteralStringRef("handed to another thread") );
+	ASSERT( r.size() == 0 && !r.arena().impl );
+	ASSERT( (s.arena().impl.getPtr() == b) == FLOW_ARENA_THREAD_SAFE );
+	ASSERT( (s.begin() == p) == FLOW_ARENA_THREAD_SAFE );
+	return Void();
+}
+
+TEST_CASE("/flow/Arena/freeIncrementally") {
+	if (FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK <= 0) return Void();
+
+	state bool incrementally = g_arenaFreeIncrementally;
+	state int64_t pending = g_arenaFreePendingBytes;
+	g_arenaFreeIncrementally = true;
+	{
+		// Dependent arenas of 64KB blocks, so that freeing the last one takes several tasks
+		Arena arena;
+		for(int64_t i = 0; i < 4*FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK; i += 60000) {
+			Arena a;
+			new (a) uint8_t[60000];
+			arena.dependsOn( a );
+		}
+	}
+	g_arenaFreeIncrementally = incrementally;
+	ASSERT( g_arenaFreePendingBytes > pending );
+	loop {
+		wait( delay( 0, TaskLowPriority ) );
+		if (g_arenaFreePendingBytes == pending) break;
+	}
+	return Void();
+}
+
+TEST_CASE("/flow/Arena/VectorRef/growInPlace") {
+	int64_t abandoned, grown, abandonedBefore, grownBefore;
+	getArenaVectorStats( abandonedBefore, grownBefore );
+
+	// The only allocations in the block, so each push_back that needs room finds the vector at its tail
+	Arena arena( 4096 );
+	VectorRef<int> v;
+	v.push_back( arena, 0 );
+	const int* data = v.begin();
+	for(int i = 1; i < 100; i++)
+		v.push_back( arena, i );
+	ASSERT( v.begin() == data );
+	getArenaVectorStats( abandoned, grown );
+	ASSERT( grown > grownBefore && abandoned == abandonedBefore );
+
+	// Another allocation after it makes it move to grow
+	while (v.size() < v.capacity())
+		v.push_back( arena, v.size() );
+	new (arena) uint8_t[1];
+	v.push_back( arena, v.size() );
+	ASSERT( v.begin() != data );
+	getArenaVectorStats( abandonedBefore, grownBefore );
+	ASSERT( abandonedBefore > abandoned );
+
+	// It is at the tail of a block again, where it grows in place until the block is full, and then moves
+	data = v.begin();
+	while (v.begin() == data)
+		v.push_back( arena, v.size() );
+	for(int i = 0; i < v.size(); i++)
+		ASSERT( v[i] == i );
+	getArenaVectorStats( abandoned, grown );
+	ASSERT( abandoned > abandonedBefore );
+	return Void();
+}
@@ -27,6 +27,7 @@
 #include "flow/Error.h"
 #include "flow/Trace.h"
 #include <algorithm>
+#include <atomic>
 #include <stdint.h>
 #include <string>
 #include <cstring>
@@ -34,6 +35,18 @@
 #include <set>
 #include <type_traits>
 
+// With FLOW_ARENA_THREAD_SAFE 0, ArenaBlocks are reference counted without atomic instructions, which makes copying
+// Arenas and Standalones cheaper but means that an arena must only be shared between threads through crossThread()
+#ifndef FLOW_ARENA_THREAD_SAFE
+#define FLOW_ARENA_THREAD_SAFE 1
+#endif
+
+#if FLOW_ARENA_THREAD_SAFE
+#define ArenaReferenceCounted ThreadSafeReferenceCounted
+#else
+#define ArenaReferenceCounted ThreadUnsafeReferenceCounted
+#endif
+
 // TrackIt is a zero-size class for tracking constructions, destructions, and assignments of instances
 // of a class.  Just inherit TrackIt<T> from T to enable tracking of construction and destruction of
 // T, and use the TRACKIT_ASSIGN(rhs) macro in any operator= definitions to enable assignment tracking.
@@ -100,6 +113,9 @@ public:
 	inline size_t getSize() const;
 
 	inline bool hasFree( size_t size, const void *address );
+	// If address is the end of the last allocation, grows it by between minBytes and maxBytes, in multiples of unit,
+	// and returns the growth (or 0)
+	inline int extend( const void* address, int minBytes, int maxBytes, int unit = 1 );
 
 	friend void* operator new ( size_t size, Arena& p );
 	friend void* operator new[] ( size_t size, Arena& p );
@@ -112,17 +128,34 @@ struct ArenaBlockRef {
 	uint32_t nextBlockOffset;
 };
 
-struct ArenaBlock : NonCopyable, ThreadSafeReferenceCounted<ArenaBlock>
+// Set on a thread while it runs a network's tasks, if ARENA_FREE_BYTES_PER_TASK > 0.  There, ArenaBlock::destroy() frees
+// ARENA_FREE_BYTES_PER_TASK of an arena and leaves the rest to freeArenaBlocksLater(), which frees it a piece at a time
+// in later tasks.  Elsewhere, and once run() returns, arenas are freed at once.
+extern thread_local bool g_arenaFreeIncrementally;
+extern std::atomic<int64_t> g_arenaFreePendingBytes;  // In blocks waiting for freeArenaBlocksLater(), on any run loop
+void freeArenaBlocksLater( std::vector<ArenaBlock*> blocks );  // Takes blocks whose reference counts have reached 0
+
+// The calling thread's scratch arena, for transient data (parsing, serialization) that does not outlive the task
+// allocating it, i.e. is not kept across a wait().  It is one large block, reset wholesale by the run loop after each
+// batch of tasks instead of a trip through FastAllocator per block.  A Standalone or dependsOn() that keeps the arena
+// past the reset is reported as ScratchArenaEscaped; builds with FLOW_SCRATCH_ARENA_POISON also overwrite the reset
+// memory, to catch raw StringRefs that escaped.
+Arena& scratchArena();  // Only on a run loop's thread
+void resetScratchArena();  // Called by run loops before and between batches of tasks
+
+struct ArenaBlock : NonCopyable, ArenaReferenceCounted<ArenaBlock>
 {
 	enum {
 		SMALL = 64,
-		LARGE = 8193 // If size == used == LARGE, then use hugeSize, hugeUsed
+		LARGE = 8193, // Blocks grow geometrically up to this size
+		HUGE_SIZE = 65537, // Blocks of at least this size come from the global heap
+		LARGE_PAGE_SIZE = 2<<20 // ... or, with FAST_ALLOC_HUGE_PAGES, from huge pages if they are at least this large
 	};
 
-	enum { NOT_TINY = 255, TINY_HEADER = 6 };
+	enum { NOT_TINY = 255, LARGE_PAGES = 254, TINY_HEADER = 6 };
 
-	// int32_t referenceCount;	  // 4 bytes (in ThreadSafeReferenceCounted)
-	uint8_t tinySize, tinyUsed;   // If these == NOT_TINY, use bigSize, bigUsed instead
+	// int32_t referenceCount;	  // 4 bytes (in ArenaReferenceCounted)
+	uint8_t tinySize, tinyUsed;   // If these == NOT_TINY, use bigSize, bigUsed instead; tinyUsed == LARGE_PAGES marks a block from allocateLargePages()
 	// if tinySize != NOT_TINY, following variables aren't used
 	uint32_t bigSize, bigUsed;	  // include block header
 	uint32_t nextBlockOffset;
@@ -150,6 +183,19 @@ struct ArenaBlock : NonCopyable, ThreadSafeReferenceCounted<ArenaBlock>
 		}
 		return s;
 	}
+	// True if nothing but its one reference can reach this block or any block it depends on
+	bool isSoleOwnerOfAllUnsafe() const {
+		if (!isSoleOwnerUnsafe()) return false;
+		if (isTiny()) return true;
+
+		int o = nextBlockOffset;
+		while (o) {
+			ArenaBlockRef* r = (ArenaBlockRef*)((char*)getData() + o);
+			if (!r->next->isSoleOwnerOfAllUnsafe()) return false;
+			o = r->nextBlockOffset;
+		}
+		return true;
+	}
 	// just for debugging:
 	void getUniqueBlocks(std::set<ArenaBlock*>& a) {
 		a.insert(this);
@@ -192,6 +238,13 @@ struct ArenaBlock : NonCopyable, ThreadSafeReferenceCounted<ArenaBlock>
 			self->makeReference( other );
 	}
 
+	static inline int extend( Reference<ArenaBlock>& self, const void* address, int minBytes, int maxBytes, int unit ) {
+		if (!self || self->getNextData() != address || self->unused() < minBytes) return 0;
+		int bytes = std::min( self->unused(), maxBytes ) / unit * unit;
+		self->addUsed( bytes );
+		return bytes;
+	}
+
 	static inline void* allocate( Reference<ArenaBlock>& self, int bytes ) {
 		ArenaBlock* b = self.getPtr();
 		if (!self || self->unused() < bytes)
@@ -232,21 +285,32 @@ struct ArenaBlock : NonCopyable, ThreadSafeReferenceCounted<ArenaBlock>
 				b->tinySize = b->tinyUsed = NOT_TINY;
 				b->bigUsed = sizeof(ArenaBlock);
 			} else {
-				#ifdef ALLOC_INSTRUMENTATION
-					allocInstr[ "ArenaHugeKB" ].alloc( (reqSize+1023)>>10 );
-				#endif
-				b = (ArenaBlock*)new uint8_t[ reqSize ];
-				b->tinySize = b->tinyUsed = NOT_TINY;
-				b->bigSize = reqSize;
-				b->bigUsed = sizeof(ArenaBlock);
-
-				if(FLOW_KNOBS && g_trace_depth == 0 && g_nondeterministic_random && g_nondeterministic_random->random01() < (reqSize / FLOW_KNOBS->HUGE_ARENA_LOGGING_BYTES)) {
-					hugeArenaSample(reqSize);
+				bool largePages = false;
+				if (reqSize <= 16384) { b = (ArenaBlock*)FastAllocator<16384>::allocate(); b->bigSize = 16384; INSTRUMENT_ALLOCATE("Arena16384"); }
+				else if (reqSize <= 32768) { b = (ArenaBlock*)FastAllocator<32768>::allocate(); b->bigSize = 32768; INSTRUMENT_ALLOCATE("Arena32768"); }
+				else if (reqSize < HUGE_SIZE) { b = (ArenaBlock*)FastAllocator<65536>::allocate(); b->bigSize = 65536; INSTRUMENT_ALLOCATE("Arena65536"); }
+				else {
+					largePages = reqSize >= LARGE_PAGE_SIZE && FLOW_KNOBS && FLOW_KNOBS->FAST_ALLOC_HUGE_PAGES;
+					if (largePages)
+						reqSize = (reqSize + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+					#ifdef ALLOC_INSTRUMENTATION
+						allocInstr[ "ArenaHugeKB" ].alloc( (reqSize+1023)>>10 );
+					#endif
+					b = largePages ? (ArenaBlock*)allocateLargePages( reqSize ) : (ArenaBlock*)new uint8_t[ reqSize ];
+					b->bigSize = reqSize;
+
+					if(FLOW_KNOBS && g_trace_depth == 0 && g_nondeterministic_random && g_nondeterministic_random->random01() < (reqSize / FLOW_KNOBS->HUGE_ARENA_LOGGING_BYTES)) {
+						hugeArenaSample(reqSize);
+					}
+					g_hugeArenaMemory += reqSize;
+					heapSampleAllocation( b, reqSize );
 				}
-				g_hugeArenaMemory += reqSize;
+				b->tinySize = NOT_TINY;
+				b->tinyUsed = largePages ? LARGE_PAGES : NOT_TINY;
+				b->bigUsed = sizeof(ArenaBlock);
 
 				// If the new block has less free space than the old block, make the old block depend on it
-				if (next && !next->isTiny() && next->unused() >= reqSize-dataSize) {
+				if (next && !next->isTiny() && next->unused() >= (int)b->bigSize-dataSize) {
 					b->nextBlockOffset = 0;
 					b->setrefCountUnsafe(1);
 					next->makeReference(b);
@@ -263,6 +327,19 @@ struct ArenaBlock : NonCopyable, ThreadSafeReferenceCounted<ArenaBlock>
 
 	inline void destroy();
 
+	// Drops the references this block holds to the blocks it depends on, calling f(block) for each block left without one
+	template <class F>
+	void releaseDependencies( F f ) {
+		if (isTiny()) return;
+		int o = nextBlockOffset;
+		while (o) {
+			ArenaBlockRef* br = (ArenaBlockRef*)((char*)getData() + o);
+			if (br->next->delref_no_destroy())
+				f( br->next );
+			o = br->nextBlockOffset;
+		}
+	}
+
 	void destroyLeaf() {
 		if (isTiny()) {
 			if (tinySize <= 16) { FastAllocator<16>::release(this); INSTRUMENT_RELEASE("Arena16");}
@@ -276,12 +353,19 @@ struct ArenaBlock : NonCopyable, ThreadSafeReferenceCounted<ArenaBlock>
 			else if (bigSize <= 2048) { FastAllocator<2048>::release(this); INSTRUMENT_RELEASE("Arena2048"); }
 			else if (bigSize <= 4096) { FastAllocator<4096>::release(this); INSTRUMENT_RELEASE("Arena4096"); }
 			else if (bigSize <= 8192) { FastAllocator<8192>::release(this); INSTRUMENT_RELEASE("Arena8192"); }
+			else if (bigSize <= 16384) { FastAllocator<16384>::release(this); INSTRUMENT_RELEASE("Arena16384"); }
+			else if (bigSize <= 32768) { FastAllocator<32768>::release(this); INSTRUMENT_RELEASE("Arena32768"); }
+			else if (bigSize < HUGE_SIZE) { FastAllocator<65536>::release(this); INSTRUMENT_RELEASE("Arena65536"); }
 			else {
 				#ifdef ALLOC_INSTRUMENTATION
 					allocInstr[ "ArenaHugeKB" ].dealloc( (bigSize+1023)>>10 );
 				#endif
 				g_hugeArenaMemory -= bigSize;
-				delete[] (uint8_t*)this;
+				heapSampleRelease( this );
+				if (tinyUsed == LARGE_PAGES)
+					freeLargePages(this, bigSize);
+				else
+					delete[] (uint8_t*)this;
 			}
 		}
 	}
@@ -311,6 +395,7 @@ inline void Arena::dependsOn( const Arena& p ) {
 }
 inline size_t Arena::getSize() const { return impl ? impl->totalSize() : 0; }
 inline bool Arena::hasFree( size_t size, const void *address ) { return impl && impl->unused() >= size && impl->getNextData() == address; }
+inline int Arena::extend( const void* address, int minBytes, int maxBytes, int unit ) { return ArenaBlock::extend( impl, address, minBytes, maxBytes, unit ); }
 inline void* operator new ( size_t size, Arena& p ) {
 	UNSTOPPABLE_ASSERT( size < std::numeric_limits<int>::max() );
 	return ArenaBlock::allocate( p.impl, (int)size );
@@ -486,6 +571,26 @@ private:
 	template <class U> Standalone<T> const& operator=( Standalone<U> const& );  // unimplemented
 };
 
+// Takes t, leaving it empty, to be handed to another thread.  Without FLOW_ARENA_THREAD_SAFE that is only safe if no
+// other Arena shares a block with t's, so otherwise t is deep copied into an arena of its own.  That check is all there
+// is: blocks have no room to record the thread that owns them, so nothing catches an Arena that reaches another thread
+// without going through crossThread().
+template <class T>
+Standalone<T> crossThread( Standalone<T>& t ) {
+	Standalone<T> r;
+#if !FLOW_ARENA_THREAD_SAFE
+	if (t.arena().impl && !t.arena().impl->isSoleOwnerOfAllUnsafe()) {
+		r = t.contents();
+		t = Standalone<T>();
+		return r;
+	}
+#endif
+	r.contents() = t.contents();
+	r.arena() = std::move( t.arena() );
+	t.contents() = T();
+	return r;
+}
+
 extern std::string format(const char* form, ...);
 
 #pragma pack( push, 4 )
@@ -881,10 +986,20 @@ private:
 	int m_size, m_capacity;
 
 	void reallocate(Arena& p, int requiredCapacity) {
+		// If we are the last allocation in the arena, grow in place into as much of the rest of its block as we would
+		// have allocated
+		int grownBytes = m_capacity ? p.extend( data + m_capacity, (requiredCapacity - m_capacity) * sizeof(T),
+		                                         std::max( m_capacity, requiredCapacity - m_capacity ) * sizeof(T), sizeof(T) ) : 0;
+		if (grownBytes) {
+			ArenaVectorStats::add( ArenaVectorStats::local().grownInPlaceBytes, grownBytes );
+			m_capacity += grownBytes / sizeof(T);
+			return;
+		}
+
 		requiredCapacity = std::max( m_capacity*2, requiredCapacity );
-		// SOMEDAY: Maybe we are right at the end of the arena and can expand cheaply
 		T* newData = (T*)new (p) uint8_t[ requiredCapacity * sizeof(T) ];
 		memcpy(newData, data, m_size*sizeof(T));
+		ArenaVectorStats::add( ArenaVectorStats::local().abandonedBytes, m_capacity*sizeof(T) );
 		data = newData;
 		m_capacity = requiredCapacity;
 	}
@@ -914,20 +1029,20 @@ inline void save( Archive& ar, const VectorRef<T>& value ) {
 	ArenaBlock* tinyStack = this;
 	Arena stackArena;
 	VectorRef<ArenaBlock*> stack( &tinyStack, 1 );
+	int64_t freed = 0;
 
 	while (stack.size()) {
+		if (g_arenaFreeIncrementally && freed >= FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK) {
+			// A huge arena; free the rest later rather than make this a slow task
+			freeArenaBlocksLater( std::vector<ArenaBlock*>( stack.begin(), stack.end() ) );
+			return;
+		}
+
 		ArenaBlock* b = stack.end()[-1];
 		stack.pop_back();
 
-		if (!b->isTiny()) {
-			int o = b->nextBlockOffset;
-			while (o) {
-				ArenaBlockRef* br = (ArenaBlockRef*)((char*)b->getData() + o);
-				if (br->next->delref_no_destroy())
-					stack.push_back( stackArena, br->next );
-				o = br->nextBlockOffset;
-			}
-		}
+		b->releaseDependencies( [&stack, &stackArena](ArenaBlock* next) { stack.push_back( stackArena, next ); } );
+		freed += b->size();
 		b->destroyLeaf();
 	}
 }
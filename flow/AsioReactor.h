@@ -39,13 +39,50 @@ public:
 	boost::asio::io_service ios;
 	boost::asio::io_service::work do_not_stop;  // Reactor needs to keep running when there is nothing to do until stopped explicitly
 
+#ifdef FLOW_HAVE_IO_URING
+	// Non-null when FLOW_KNOBS->REACTOR_IO_URING is set and the kernel supports io_uring.  The operations queued on it
+	// during one run loop iteration are submitted together by sleepAndReact(), which still sleeps in asio: the ring
+	// signals ringEvents when it posts completions.
+	IoUring* ring;
+#endif
+
 private:
 	Net2* network;
 	boost::asio::deadline_timer firstTimer;
 
+	// The lengths of recent idle periods that ended in a network event or a cross-thread task (which wakes the
+	// reactor), from which sleepAndReact() predicts whether the next one will end soon enough to poll through
+	struct IdleHistogram {
+		enum { BUCKETS = 24 };  // Bucket 0 counts periods under 1us, bucket i those in [2^(i-1), 2^i) us, and the last any longer
+		enum { HISTORY = 256 }; // Counts are halved when they reach this many periods, so that the history follows the load
+		int counts[BUCKETS];
+		int total;
+
+		IdleHistogram() : total(0) { memset(counts, 0, sizeof(counts)); }
+		void add( double seconds );
+		// The shortest time within which at least fraction q of recent idle periods ended, or 1e99 if there is no such
+		// time below the last bucket
+		double quantile( double q ) const;
+	};
+	IdleHistogram idleHistogram;
+
+	// Polls for events for up to limit seconds, and returns true when one arrives
+	bool spin( double limit );
+	// spin() watches state in memory, and asks asio for socket events (a system call) only this often
+	enum { SPIN_POLL_INTERVAL = 64 };
+	std::atomic<bool> woken;  // Set by wake() once it has posted, so that spin() sees it without polling asio
+
 	static void nullWaitHandler( const boost::system::error_code& ) {}
 	static void nullCompletionHandler() {}
 
+#ifdef FLOW_HAVE_IO_URING
+	boost::asio::posix::stream_descriptor ringEvents;
+	int64_t ringEventsValue;
+
+	void waitForRingEvents();
+	void reapRing();
+#endif
+
 #ifdef __linux__
 	class EventFD : public IEventFD {
 		int fd;
@@ -0,0 +1,581 @@
+/*
+ * AsyncFileCached.actor.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/AsyncFileCached.h"
+#include "flow/Knobs.h"
+#include "flow/TDMetric.actor.h"
+#include "flow/UnitTest.h"
+#include "flow/genericactors.actor.h"
+#include <algorithm>
+#include <unordered_map>
+#include "flow/actorcompiler.h"  // This must be the last #include.
+
+namespace {
+
+struct CacheMetrics {
+	Int64MetricHandle countFinds;
+	Int64MetricHandle countReads;
+	Int64MetricHandle countReadBytes;
+	Int64MetricHandle countWrites;
+	Int64MetricHandle countReadsBlocked;
+	Int64MetricHandle countWritesBlocked;
+	Int64MetricHandle countPageReadsMerged;
+	bool initialized = false;
+
+	void init() {
+		if (initialized) return;
+		initialized = true;
+		countFinds.init(LiteralStringRef("AsyncFile.CountCacheFinds"));
+		countReads.init(LiteralStringRef("AsyncFile.CountCacheReads"));
+		countReadBytes.init(LiteralStringRef("AsyncFile.CountCacheReadBytes"));
+		countWrites.init(LiteralStringRef("AsyncFile.CountCacheWrites"));
+		countReadsBlocked.init(LiteralStringRef("AsyncFile.CountCacheReadsBlocked"));
+		countWritesBlocked.init(LiteralStringRef("AsyncFile.CountCacheWritesBlocked"));
+		countPageReadsMerged.init(LiteralStringRef("AsyncFile.CountCachePageReadsMerged"));
+	}
+};
+
+CacheMetrics cacheMetrics;
+
+class AsyncFileCached;
+
+struct CachedPage : FastAllocated<CachedPage>, NonCopyable {
+	AsyncFileCached* owner;
+	int64_t offset;
+	uint8_t* data;
+	int index;        // Position in PageCache::pages, or -1 once the page has been dropped from the cache
+	int pins;         // Reads and writes that will use data after a wait
+	bool dirty;
+	bool referenced;  // Set by every hit, and cleared as the clock hand passes
+	Future<Void> reading;   // Ready once data holds the page's contents
+	Future<Void> flushing;  // Ready when no write of the page to the file is in flight
+
+	CachedPage( AsyncFileCached* owner, int64_t offset ) : owner(owner), offset(offset), data(NULL), index(-1), pins(0), dirty(false), referenced(false), reading(Void()), flushing(Void()) {}
+
+	bool idle() const { return !pins && reading.isReady() && flushing.isReady(); }
+};
+
+// The pages of one size, for all files.  Eviction is CLOCK: a hit marks a page referenced, and the hand clears the mark
+// of each referenced page it passes and evicts the first unmarked one.  New pages start unmarked, so a page read once by
+// a scan is evicted on the hand's next pass, while pages that are read again survive it.  Pages in use or being read
+// cannot be evicted, and dirty pages are written back as the hand passes them; after MAX_EVICT_ATTEMPTS pages without
+// a candidate the cache grows past its limit until pages become evictable.
+class PageCache : NonCopyable {
+public:
+	const int pageSize;
+
+	PageCache( int pageSize, int64_t maxPages ) : pageSize(pageSize), maxPages(std::max<int64_t>(maxPages, 1)), hand(0) {}
+
+	static PageCache* get( int pageSize );
+
+	// Gives page a buffer, making room for it first
+	void insert( CachedPage* page );
+	// Removes page from the cache.  Its buffer is freed once nothing is using it.
+	void drop( CachedPage* page );
+
+	int64_t size() const { return pages.size(); }
+
+private:
+	int64_t maxPages;
+	std::vector<CachedPage*> pages;
+	size_t hand;
+
+	bool evictOne();
+
+	// Frees a dropped page once its read and write back finish, unless it is still pinned; the last unpin() frees it then
+	ACTOR static void destroyAfterIO( CachedPage* page ) {
+		// Pinned meanwhile, so that an unpin() that runs first does not free it under us
+		page->pins++;
+		wait( ready( page->reading ) && ready( page->flushing ) );
+		page->pins--;
+		if (page->idle()) destroy( page );
+	}
+
+	static void destroy( CachedPage* page ) {
+		aligned_free( page->data );
+		delete page;
+	}
+};
+
+class AsyncFileCached : public IAsyncFile, public ReferenceCounted<AsyncFileCached> {
+public:
+	AsyncFileCached( Reference<IAsyncFile> uncached, PageCache* cache, int64_t length )
+		: uncached(uncached), cache(cache), pageSize(cache->pageSize), length(length), physicalLength(length) {}
+
+	virtual void addref() { ReferenceCounted<AsyncFileCached>::addref(); }
+	virtual void delref() {
+		// Dirty pages are written back before the file is closed
+		if (delref_no_destroy()) close( this );
+	}
+
+	virtual Future<int> read( void* data, int length, int64_t offset ) {
+		if (offset >= this->length) return 0;
+		length = std::min<int64_t>( length, this->length - offset );
+
+		// A hit within one page, the common case, is copied without starting an actor
+		int64_t pageOffset = offset - offset % pageSize;
+		if (offset + length <= pageOffset + pageSize) {
+			auto it = pages.find( pageOffset );
+			if (it != pages.end() && it->second->reading.isReady() && !it->second->reading.isError()) {
+				++cacheMetrics.countFinds;
+				it->second->referenced = true;
+				memcpy( data, it->second->data + (offset - pageOffset), length );
+				return length;
+			}
+		}
+		return read_impl( Reference<AsyncFileCached>::addRef(this), (uint8_t*)data, length, offset );
+	}
+	virtual Future<Void> write( void const* data, int length, int64_t offset ) {
+		return write_impl( Reference<AsyncFileCached>::addRef(this), (uint8_t const*)data, length, offset );
+	}
+	virtual Future<Void> truncate( int64_t size ) {
+		return truncate_impl( Reference<AsyncFileCached>::addRef(this), size );
+	}
+	virtual Future<Void> sync() {
+		return sync_impl( Reference<AsyncFileCached>::addRef(this) );
+	}
+	virtual Future<int64_t> size() { return length; }
+	virtual std::string getFilename() { return uncached->getFilename(); }
+
+	// Called by the cache, for pages that are idle and clean
+	void evict( CachedPage* page ) {
+		pages.erase( page->offset );
+		cache->drop( page );
+	}
+	// Starts writing a dirty page back to the file
+	void flush( CachedPage* page ) {
+		ASSERT( page->dirty && page->flushing.isReady() );
+		page->dirty = false;
+		page->flushing = writePage( this, page );
+	}
+
+private:
+	Reference<IAsyncFile> uncached;
+	PageCache* cache;
+	const int pageSize;
+	int64_t length;          // The size of the file, including writes still in the cache
+	int64_t physicalLength;  // What the uncached file's size is, or will be once its writes complete
+	std::unordered_map<int64_t, CachedPage*> pages;
+
+	virtual ~AsyncFileCached() {}
+
+	// Returns the page at offset, without reading it from the file if it is not cached
+	CachedPage* find( int64_t offset, bool mustRead ) {
+		++cacheMetrics.countFinds;
+		auto it = pages.find( offset );
+		if (it != pages.end()) {
+			CachedPage* page = it->second;
+			page->referenced = true;
+			if (!page->reading.isReady()) ++cacheMetrics.countPageReadsMerged;
+			return page;
+		}
+		CachedPage* page = new CachedPage( this, offset );
+		cache->insert( page );
+		pages[offset] = page;
+		if (mustRead && offset < physicalLength) {
+			++cacheMetrics.countReads;
+			page->reading = readPage( Reference<AsyncFileCached>::addRef(this), page );
+		} else
+			memset( page->data, 0, pageSize );
+		return page;
+	}
+
+	static void unpin( std::vector<CachedPage*> const& pinned ) {
+		for(auto page : pinned) {
+			page->pins--;
+			if (page->index < 0 && page->idle()) page->owner->cache->drop( page );
+		}
+	}
+
+	// Holds a reference to the file, since the page may be dropped by truncate() and the file closed before it finishes
+	ACTOR static Future<Void> readPage( Reference<AsyncFileCached> self, CachedPage* page ) {
+		try {
+			int n = wait( self->uncached->read( page->data, self->pageSize, page->offset ) );
+			cacheMetrics.countReadBytes += n;
+			// The file may have been truncated while the read was in flight
+			int valid = std::max<int64_t>( 0, std::min<int64_t>( n, self->length - page->offset ) );
+			memset( page->data + valid, 0, self->pageSize - valid );
+		} catch (Error& e) {
+			// Later reads of the page try again
+			if (page->index >= 0) {
+				self->pages.erase( page->offset );
+				self->cache->drop( page );
+			}
+			throw;
+		}
+		return Void();
+	}
+
+	ACTOR static Future<Void> writePage( AsyncFileCached* self, CachedPage* page ) {
+		// Writes of the uncached file must be whole multiples of 4KB
+		state int length = std::min<int64_t>( self->pageSize, (self->length - page->offset + 4095) & ~int64_t(4095) );
+		if (length <= 0) return Void();
+		++cacheMetrics.countWrites;
+		self->physicalLength = std::max( self->physicalLength, page->offset + length );
+		try {
+			wait( self->uncached->write( page->data, length, page->offset ) );
+		} catch (Error& e) {
+			page->dirty = true;
+			throw;
+		}
+		return Void();
+	}
+
+	ACTOR static Future<int> read_impl( Reference<AsyncFileCached> self, uint8_t* data, int length, int64_t offset ) {
+		state std::vector<CachedPage*> pinned;
+		state std::vector<Future<Void>> reads;
+		for(int64_t p = offset - offset % self->pageSize; p < offset + length; p += self->pageSize) {
+			CachedPage* page = self->find( p, true );
+			page->pins++;
+			pinned.push_back( page );
+			if (!page->reading.isReady()) reads.push_back( page->reading );
+		}
+		if (reads.size()) {
+			++cacheMetrics.countReadsBlocked;
+			try {
+				wait( waitForAll( reads ) );
+			} catch (Error& e) {
+				unpin( pinned );
+				throw;
+			}
+		}
+		for(auto page : pinned) {
+			int64_t begin = std::max( offset, page->offset ), end = std::min( offset + length, page->offset + self->pageSize );
+			memcpy( data + (begin - offset), page->data + (begin - page->offset), end - begin );
+		}
+		unpin( pinned );
+		return length;
+	}
+
+	ACTOR static Future<Void> write_impl( Reference<AsyncFileCached> self, uint8_t const* data, int length, int64_t offset ) {
+		state std::vector<CachedPage*> pinned;
+		state std::vector<CachedPage*> created;  // Pages the write covers that were not cached, and are not read
+		state std::vector<Promise<Void>> filled;  // For each of created, sent once the write has copied into it
+		for(int64_t p = offset - offset % self->pageSize; p < offset + length; p += self->pageSize) {
+			// A write covering a page, or all of it that is in the file, does not need its old contents
+			bool whole = offset <= p && offset + length >= std::min( p + self->pageSize, std::max( self->length, p + 1 ) );
+			bool cached = self->pages.count( p );
+			CachedPage* page = self->find( p, !whole );
+			page->pins++;
+			pinned.push_back( page );
+			if (!cached && whole) {
+				// Its zeros are not the file's contents, so reads of it wait for the copy like reads of a page being read
+				created.push_back( page );
+				filled.push_back( Promise<Void>() );
+				page->reading = filled.back().getFuture();
+			}
+		}
+		try {
+			// The page must not change under a read or write of it, and a flush may start while we wait for another
+			state bool blocked = false;
+			loop {
+				state std::vector<Future<Void>> busy;
+				for(auto page : pinned) {
+					if (!page->reading.isReady() && std::find( created.begin(), created.end(), page ) == created.end()) busy.push_back( page->reading );
+					if (!page->flushing.isReady()) busy.push_back( ready( page->flushing ) );
+				}
+				if (busy.empty()) break;
+				if (!blocked) ++cacheMetrics.countWritesBlocked;
+				blocked = true;
+				wait( waitForAll( busy ) );
+			}
+		} catch (Error& e) {
+			// The pages this write was to fill are dropped, so that later reads read them from the file
+			Error err = e.code() == error_code_operation_cancelled ? io_error() : e;
+			for(int i = 0; i < created.size(); i++) {
+				if (created[i]->index >= 0) {
+					self->pages.erase( created[i]->offset );
+					self->cache->drop( created[i] );
+				}
+				filled[i].sendError( err );
+			}
+			unpin( pinned );
+			throw;
+		}
+		for(auto page : pinned) {
+			int64_t begin = std::max( offset, page->offset ), end = std::min( offset + length, page->offset + self->pageSize );
+			memcpy( page->data + (begin - page->offset), data + (begin - offset), end - begin );
+			page->dirty = true;
+			page->referenced = true;
+		}
+		self->length = std::max( self->length, offset + length );
+		for(auto& p : filled)
+			p.send( Void() );
+		unpin( pinned );
+		return Void();
+	}
+
+	ACTOR static Future<Void> truncate_impl( Reference<AsyncFileCached> self, int64_t size ) {
+		state std::vector<Future<Void>> flushes;
+		int64_t oldLength = self->length;
+		int64_t firstDropped = (size + self->pageSize - 1) / self->pageSize * self->pageSize;
+		self->length = size;
+
+		std::vector<CachedPage*> toDrop;
+		int64_t lookups = (std::max( oldLength, self->physicalLength ) - firstDropped + self->pageSize - 1) / self->pageSize;
+		if (lookups < FLOW_KNOBS->PAGE_CACHE_TRUNCATE_LOOKUP_FRACTION * self->pages.size()) {
+			for(int64_t p = firstDropped; p < firstDropped + lookups * self->pageSize; p += self->pageSize) {
+				auto it = self->pages.find( p );
+				if (it != self->pages.end()) toDrop.push_back( it->second );
+			}
+		} else {
+			for(auto& p : self->pages)
+				if (p.first >= firstDropped) toDrop.push_back( p.second );
+		}
+		for(auto page : toDrop) {
+			// A write back still in flight has to finish before the file is truncated under it
+			if (!page->flushing.isReady()) flushes.push_back( ready( page->flushing ) );
+			self->pages.erase( page->offset );
+			self->cache->drop( page );
+		}
+
+		// The end of the last page is zeroed, as the file's would be
+		auto last = self->pages.find( firstDropped - self->pageSize );
+		if (size % self->pageSize && last != self->pages.end()) {
+			CachedPage* page = last->second;
+			if (page->reading.isReady())
+				memset( page->data + size % self->pageSize, 0, self->pageSize - size % self->pageSize );
+			if (!page->flushing.isReady()) flushes.push_back( ready( page->flushing ) );
+		}
+
+		wait( waitForAll( flushes ) );
+		wait( self->uncached->truncate( size ) );
+		self->physicalLength = size;
+		return Void();
+	}
+
+	ACTOR static Future<Void> sync_impl( Reference<AsyncFileCached> self ) {
+		state std::vector<Future<Void>> flushes;
+		for(auto& p : self->pages) {
+			CachedPage* page = p.second;
+			if (page->dirty && page->flushing.isReady()) self->flush( page );
+			if (!page->flushing.isReady()) flushes.push_back( page->flushing );
+		}
+		wait( waitForAll( flushes ) );
+		// Pages are written whole, which can leave the file longer than it should be
+		if (self->physicalLength > self->length) {
+			wait( self->uncached->truncate( self->length ) );
+			self->physicalLength = self->length;
+		}
+		wait( self->uncached->sync() );
+		return Void();
+	}
+
+	ACTOR static void close( AsyncFileCached* self ) {
+		state std::vector<Future<Void>> busy;
+		for(auto& p : self->pages) {
+			CachedPage* page = p.second;
+			if (page->dirty && page->flushing.isReady()) self->flush( page );
+			busy.push_back( ready( page->reading ) );
+			busy.push_back( ready( page->flushing ) );
+		}
+		wait( waitForAll( busy ) );
+		for(auto& p : self->pages) {
+			if (p.second->dirty)
+				TraceEvent(SevWarnAlways, "AsyncFileCachedDirtyPageLost").detail("Filename", self->getFilename()).detail("Offset", p.first);
+			self->cache->drop( p.second );
+		}
+		delete self;
+	}
+};
+
+PageCache* PageCache::get( int pageSize ) {
+	static PageCache* cache4k = NULL;
+	static PageCache* cache64k = NULL;
+	if (pageSize == 4096) {
+		if (!cache4k) cache4k = new PageCache( 4096, FLOW_KNOBS->PAGE_CACHE_4K / 4096 );
+		return cache4k;
+	}
+	ASSERT( pageSize == 65536 );
+	if (!cache64k) cache64k = new PageCache( 65536, FLOW_KNOBS->PAGE_CACHE_64K / 65536 );
+	return cache64k;
+}
+
+void PageCache::insert( CachedPage* page ) {
+	while (pages.size() >= maxPages && evictOne());
+	page->data = (uint8_t*)aligned_alloc( 4096, pageSize );
+	page->index = pages.size();
+	pages.push_back( page );
+}
+
+void PageCache::drop( CachedPage* page ) {
+	if (page->index >= 0) {
+		pages[page->index] = pages.back();
+		pages[page->index]->index = page->index;
+		pages.pop_back();
+		page->index = -1;
+		if (!page->reading.isReady() || !page->flushing.isReady()) {
+			destroyAfterIO( page );
+			return;
+		}
+	}
+	if (page->idle())
+		destroy( page );
+}
+
+bool PageCache::evictOne() {
+	for(int attempt = 0; attempt < FLOW_KNOBS->MAX_EVICT_ATTEMPTS && pages.size(); attempt++) {
+		if (hand >= pages.size()) hand = 0;
+		CachedPage* page = pages[hand];
+		if (page->referenced) {
+			page->referenced = false;
+		} else if (page->idle() && !page->dirty) {
+			// The last page takes this one's slot, and is looked at next
+			page->owner->evict( page );
+			return true;
+		} else if (page->dirty && page->flushing.isReady()) {
+			page->owner->flush( page );
+		}
+		hand++;
+	}
+	return false;
+}
+
+ACTOR Future<Reference<IAsyncFile>> openCached( Reference<IAsyncFile> uncached, PageCache* cache ) {
+	int64_t length = wait( uncached->size() );
+	return Reference<IAsyncFile>( new AsyncFileCached( uncached, cache, length ) );
+}
+
+// A file in memory, whose operations complete immediately, except that reads wait for stall while stalled is set
+class MemoryFile : public IAsyncFile, public ReferenceCounted<MemoryFile> {
+public:
+	std::string contents;
+	int reads = 0, writes = 0, syncs = 0;
+	bool stalled = false;
+	Promise<Void> stall;
+
+	virtual void addref() { ReferenceCounted<MemoryFile>::addref(); }
+	virtual void delref() { ReferenceCounted<MemoryFile>::delref(); }
+	virtual Future<int> read( void* data, int length, int64_t offset ) {
+		if (stalled)
+			return map( stall.getFuture(), [this, data, length, offset](Void) { return readNow( data, length, offset ).get(); } );
+		return readNow( data, length, offset );
+	}
+	Future<int> readNow( void* data, int length, int64_t offset ) {
+		reads++;
+		int n = std::max<int64_t>( 0, std::min<int64_t>( length, contents.size() - offset ) );
+		memcpy( data, contents.data() + offset, n );
+		return n;
+	}
+	virtual Future<Void> write( void const* data, int length, int64_t offset ) {
+		ASSERT( length % 4096 == 0 && offset % 4096 == 0 );
+		writes++;
+		if (contents.size() < offset + length) contents.resize( offset + length );
+		memcpy( &contents[offset], data, length );
+		return Void();
+	}
+	virtual Future<Void> truncate( int64_t size ) { contents.resize( size ); return Void(); }
+	virtual Future<Void> sync() { syncs++; return Void(); }
+	virtual Future<int64_t> size() { return int64_t(contents.size()); }
+	virtual std::string getFilename() { return "memory"; }
+};
+
+}
+
+Future<Reference<IAsyncFile>> openCachedFile( Reference<IAsyncFile> const& uncached, int64_t const& flags ) {
+	cacheMetrics.init();
+	return openCached( uncached, PageCache::get( (flags & IAsyncFile::OPEN_LARGE_PAGES) ? 65536 : 4096 ) );
+}
+
+TEST_CASE("/flow/AsyncFileCached/cache") {
+	Reference<MemoryFile> mem( new MemoryFile );
+	mem->contents = std::string( 10000, 'a' );
+	PageCache cache( 4096, 4 );
+	Reference<IAsyncFile> f = openCached( mem, &cache ).get();
+
+	// Misses read whole pages, and hits do not go to the file
+	char buf[8192];
+	ASSERT( f->read( buf, 100, 4000 ).get() == 100 && buf[0] == 'a' && buf[99] == 'a' );
+	ASSERT( mem->reads == 2 );
+	ASSERT( f->read( buf, 8192, 0 ).get() == 8192 && mem->reads == 2 );
+	ASSERT( f->read( buf, 8192, 8192 ).get() == 10000 - 8192 );
+
+	// Writes stay in the cache until sync(), which also trims the file to its size
+	memset( buf, 'b', sizeof(buf) );
+	f->write( buf, 10, 9995 ).get();
+	ASSERT( f->size().get() == 10005 && mem->writes == 0 && mem->contents.size() == 10000 );
+	f->sync().get();
+	ASSERT( mem->writes == 1 && mem->syncs == 1 && mem->contents.size() == 10005 && mem->contents[9994] == 'a' && mem->contents[9995] == 'b' );
+
+	// Filling the cache evicts pages, writing back the dirty ones first
+	for(int i = 0; i < 8; i++)
+		f->write( buf, 4096, 16384 + i*4096 ).get();
+	ASSERT( cache.size() <= 5 && mem->writes > 1 );
+	f->sync().get();
+	ASSERT( mem->contents.size() == 16384 + 8*4096 && mem->contents[16384 + 8*4096 - 1] == 'b' );
+
+	// Truncation drops cached pages past the new end, and zeroes the rest of the last one
+	f->truncate( 5000 ).get();
+	ASSERT( f->size().get() == 5000 && mem->contents.size() == 5000 );
+	f->write( buf, 1, 6000 ).get();
+	ASSERT( f->read( buf, 2000, 4096 ).get() == 1905 && buf[0] == 'a' && buf[5000-4096] == 0 && buf[6000-4096] == 'b' );
+
+	// Closing the file writes back what is still dirty
+	f = Reference<IAsyncFile>();
+	ASSERT( mem->contents.size() >= 6001 && mem->contents[6000] == 'b' && cache.size() == 0 );
+	return Void();
+}
+
+TEST_CASE("/flow/AsyncFileCached/concurrent") {
+	Reference<MemoryFile> mem( new MemoryFile );
+	mem->contents = std::string( 8192, 'a' );
+	PageCache cache( 4096, 4 );
+	Reference<IAsyncFile> f = openCached( mem, &cache ).get();
+
+	// A write covering the first page has to read the second one, and until it copies its data into the first page
+	// reads of that page wait for it rather than see the zeros it starts with
+	char buf[8192];
+	memset( buf, 'b', sizeof(buf) );
+	mem->stalled = true;
+	Future<Void> w = f->write( buf, 4096 + 100, 0 );
+	char readBuf[100];
+	Future<int> r = f->read( readBuf, 100, 0 );
+	ASSERT( !w.isReady() && !r.isReady() );
+	mem->stalled = false;
+	mem->stall.send( Void() );
+	ASSERT( w.isReady() && !w.isError() && r.get() == 100 && readBuf[0] == 'b' && readBuf[99] == 'b' );
+	ASSERT( f->read( buf, 200, 4096 ).get() == 200 && buf[99] == 'b' && buf[100] == 'a' );
+
+	f = Reference<IAsyncFile>();
+	ASSERT( cache.size() == 0 );
+	return Void();
+}
+
+TEST_CASE("/flow/AsyncFileCached/closeWhileReading") {
+	Reference<MemoryFile> mem( new MemoryFile );
+	mem->contents = std::string( 8192, 'a' );
+	PageCache cache( 4096, 4 );
+	Reference<IAsyncFile> f = openCached( mem, &cache ).get();
+
+	// A cancelled read leaves its page's read in flight, truncation drops the page without waiting for it, and closing
+	// the file has no pages left to wait for; the file must still outlive the read
+	char buf[100];
+	mem->stalled = true;
+	Future<int> r = f->read( buf, 100, 4096 );
+	ASSERT( !r.isReady() );
+	r = Future<int>();
+	f->truncate( 0 ).get();
+	f = Reference<IAsyncFile>();
+	ASSERT( !mem->isSoleOwner() );
+	mem->stalled = false;
+	mem->stall.send( Void() );
+	ASSERT( mem->isSoleOwner() && cache.size() == 0 );
+	return Void();
+}
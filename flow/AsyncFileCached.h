@@ -0,0 +1,33 @@
+/*
+ * AsyncFileCached.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOW_ASYNCFILECACHED_H
+#define FLOW_ASYNCFILECACHED_H
+#pragma once
+
+#include "flow/IAsyncFile.h"
+
+// Wraps a file opened with OPEN_UNCACHED in the process's page cache, which holds PAGE_CACHE_4K bytes of 4KB pages, or
+// PAGE_CACHE_64K bytes of 64KB pages if flags include OPEN_LARGE_PAGES.  Concurrent misses on a page share one read.
+// Writes only go to the cache; dirty pages are written back when they are evicted, by sync(), and when the file is
+// closed.  Like the files it wraps, a cached file must only be used from the primary run loop.
+Future<Reference<IAsyncFile>> openCachedFile( Reference<IAsyncFile> const& uncached, int64_t const& flags );
+
+#endif
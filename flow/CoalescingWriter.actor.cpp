@@ -0,0 +1,101 @@
+/*
+ * CoalescingWriter.actor.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/CoalescingWriter.h"
+#include "flow/Knobs.h"
+#include "flow/TDMetric.actor.h"
+#include "flow/actorcompiler.h"  // This must be the last #include.
+
+namespace {
+
+struct CoalescingMetrics {
+	Int64MetricHandle countWrites;
+	Int64MetricHandle bytesWritten;
+	bool initialized = false;
+
+	void init() {
+		if (initialized) return;
+		initialized = true;
+		countWrites.init(LiteralStringRef("Net2.CountCoalescedWrites"));
+		bytesWritten.init(LiteralStringRef("Net2.CoalescedWriteBytes"));
+	}
+};
+
+CoalescingMetrics coalescingMetrics;
+
+}
+
+struct CoalescingWriterActors {
+	ACTOR static Future<Void> writeLoop( CoalescingWriter* self ) {
+		loop {
+			if (self->unsent.empty())
+				wait( self->dataToSend.onTrigger() );
+
+			// Packets queued during the delay go out with these ones
+			if (!self->flushable()) {
+				choose {
+					when( wait( delay( self->coalesceDelay(), TaskWriteSocket ) ) ) {}
+					when( wait( self->flushNow.onTrigger() ) ) {}
+				}
+			}
+
+			while (!self->unsent.empty()) {
+				int sent = self->conn->write( self->unsent.getUnsent() );
+				if (sent) {
+					self->unsent.sent( sent );
+					self->writes++;
+					self->bytesWritten += sent;
+					++coalescingMetrics.countWrites;
+					coalescingMetrics.bytesWritten += sent;
+				} else
+					wait( self->conn->onWritable() );
+			}
+		}
+	}
+};
+
+CoalescingWriter::CoalescingWriter( Reference<IConnection> const& conn )
+	: conn(conn), lastSend(now()), sendInterval(FLOW_KNOBS->MAX_COALESCE_DELAY), writes(0), bytesWritten(0)
+{
+	coalescingMetrics.init();
+	writer = CoalescingWriterActors::writeLoop( this );
+}
+
+void CoalescingWriter::send() {
+	double t = now();
+	sendInterval = 0.9 * sendInterval + 0.1 * std::min( t - lastSend, FLOW_KNOBS->MAX_COALESCE_DELAY );
+	lastSend = t;
+	dataToSend.trigger();
+	if (flushable())
+		flushNow.trigger();
+}
+
+bool CoalescingWriter::flushable() const {
+	// Stops counting at the threshold, so this looks at no more than a few buffers however much is queued
+	int64_t bytes = 0;
+	for(PacketBuffer* b = unsent.getUnsent(); b && bytes < FLOW_KNOBS->COALESCE_FLUSH_BYTES; b = b->nextPacketBuffer())
+		bytes += b->bytes_written - b->bytes_sent;
+	return bytes >= FLOW_KNOBS->COALESCE_FLUSH_BYTES;
+}
+
+double CoalescingWriter::coalesceDelay() const {
+	// A sender that has been idle for MAX_COALESCE_DELAY - MIN_COALESCE_DELAY or more gets the minimum delay
+	return std::max( FLOW_KNOBS->MIN_COALESCE_DELAY, FLOW_KNOBS->MAX_COALESCE_DELAY - sendInterval );
+}
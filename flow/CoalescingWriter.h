@@ -0,0 +1,66 @@
+/*
+ * CoalescingWriter.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOW_COALESCINGWRITER_H
+#define FLOW_COALESCINGWRITER_H
+#pragma once
+
+#include "flow/Net2Packet.h"
+#include "flow/genericactors.actor.h"
+
+// Sends the packets queued in an UnsentPacketQueue on a connection, holding them briefly so that packets queued close
+// together go out in one write() (a writev() of the queue's buffers) instead of a system call and a TCP segment each.
+// The hold is between MIN_COALESCE_DELAY and MAX_COALESCE_DELAY: the longer the more often packets have been sent
+// recently, since waiting only gathers more packets when others are likely to follow soon.  Once COALESCE_FLUSH_BYTES
+// are queued there is nothing to gain from waiting, and the packets are written at once.
+//
+// Coalescing is opt-in: IConnection::write() still writes whatever it is given immediately, and a sender that wants
+// coalescing queues its packets here instead.
+class CoalescingWriter : NonCopyable {
+public:
+	explicit CoalescingWriter( Reference<IConnection> const& conn );
+
+	// Packets are written with a PacketWriter over unsent.getWriteBuffer(), followed by unsent.setWriteBuffer(), and
+	// then handed over with send().  Packets still unsent when the writer is destroyed are discarded.
+	UnsentPacketQueue unsent;
+	void send();
+
+	// Throws the connection's error when a write fails, and is never ready otherwise
+	Future<Void> onError() { return writer; }
+
+	// The write() calls made so far, and the bytes they sent
+	int64_t getWrites() const { return writes; }
+	int64_t getBytesWritten() const { return bytesWritten; }
+
+private:
+	Reference<IConnection> conn;
+	AsyncTrigger dataToSend;
+	AsyncTrigger flushNow;  // Ends the coalescing delay early
+	double lastSend;
+	double sendInterval;  // Smoothed time between calls to send(), at most MAX_COALESCE_DELAY
+	int64_t writes, bytesWritten;
+	Future<Void> writer;
+
+	double coalesceDelay() const;
+	bool flushable() const;  // Whether at least COALESCE_FLUSH_BYTES are queued
+	friend struct CoalescingWriterActors;
+};
+
+#endif
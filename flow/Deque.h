@@ -112,6 +112,16 @@ public:
 		return result;
 	}
 
+	void push_front(const T& val) {
+		if (full()) grow();
+		if (begin == 0) {
+			begin = mask;
+			end += mask + 1;
+		} else
+			begin--;
+		new (&arr[begin]) T(val);
+	}
+
 	void pop_back() {
 		ASSERT(!empty());
 		end--;
@@ -25,6 +25,7 @@
 #include "flow/Error.h"
 #include "flow/Knobs.h"
 #include "flow/flow.h"
+#include "flow/UnitTest.h"
 
 #include <cstdint>
 #include <unordered_map>
@@ -84,6 +85,26 @@ void setFastAllocatorThreadInitFunction( ThreadInitFunction f ) {
 
 int64_t g_hugeArenaMemory = 0;
 
+thread_local ArenaVectorStats* g_arenaVectorStats = nullptr;
+static std::atomic<ArenaVectorStats*> arenaVectorStatsList( nullptr );
+
+ArenaVectorStats& ArenaVectorStats::create() {
+	ArenaVectorStats* s = new ArenaVectorStats;
+	s->abandonedBytes = 0;
+	s->grownInPlaceBytes = 0;
+	s->next = arenaVectorStatsList.load();
+	while (!arenaVectorStatsList.compare_exchange_weak( s->next, s ));
+	return *(g_arenaVectorStats = s);
+}
+
+void getArenaVectorStats( int64_t& abandonedBytes, int64_t& grownInPlaceBytes ) {
+	abandonedBytes = grownInPlaceBytes = 0;
+	for(ArenaVectorStats* s = arenaVectorStatsList.load(); s; s = s->next) {
+		abandonedBytes += s->abandonedBytes.load( std::memory_order_relaxed );
+		grownInPlaceBytes += s->grownInPlaceBytes.load( std::memory_order_relaxed );
+	}
+}
+
 double hugeArenaLastLogged = 0;
 std::map<std::string, std::pair<int,int>> hugeArenaTraces;
 
@@ -209,28 +230,70 @@ struct FastAllocator<Size>::GlobalData {
 	CRITICAL_SECTION mutex;
 	std::vector<void*> magazines;   // These magazines are always exactly magazine_size ("full")
 	std::vector<std::pair<int, void*>> partial_magazines;  // Magazines that are not "full" and their counts.  Only created by releaseThreadMagazines().
+	std::vector<void*> reclaimed_magazines;  // Full magazines whose objects have been (mostly) given back to the system
 	long long totalMemory;
 	long long partialMagazineUnallocatedMemory;
+	long long reclaimedMemory;
 	long long activeThreads;
-	GlobalData() : totalMemory(0), partialMagazineUnallocatedMemory(0), activeThreads(0) { 
+	long long crossNodeFreeSamples;
+	long long remoteMagazines;
+	uint8_t* hugePageChunk;  // New magazines are carved from here when FAST_ALLOC_HUGE_PAGES is set
+	int hugePageChunkUsed;
+	GlobalData() : totalMemory(0), partialMagazineUnallocatedMemory(0), reclaimedMemory(0), activeThreads(0), crossNodeFreeSamples(0), remoteMagazines(0), hugePageChunk(nullptr), hugePageChunkUsed(0) { 
 		InitializeCriticalSection(&mutex);
 	}
 };
 
 template <int Size>
 long long FastAllocator<Size>::getTotalMemory() {
-	return globalData()->totalMemory;
+	long long total = 0;
+	for(int n = 0; n < numaNodes(); n++)
+		total += globalData(n)->totalMemory - globalData(n)->reclaimedMemory;
+	return total;
 }
 
-// This does not include memory held by various threads that's available for allocation
+// This does not include memory held by various threads that's available for allocation, or memory given back to the system
 template <int Size>
 long long FastAllocator<Size>::getApproximateMemoryUnused() {
-	return globalData()->magazines.size() * magazine_size * Size + globalData()->partialMagazineUnallocatedMemory;
+	long long unused = 0;
+	for(int n = 0; n < numaNodes(); n++) {
+		GlobalData* data = globalData(n);
+		unused += data->magazines.size() * magazine_size * Size + data->partialMagazineUnallocatedMemory +
+		          data->reclaimed_magazines.size() * magazine_size * Size - data->reclaimedMemory;
+	}
+	return unused;
+}
+
+template <int Size>
+long long FastAllocator<Size>::getReclaimedMemory() {
+	long long reclaimed = 0;
+	for(int n = 0; n < numaNodes(); n++)
+		reclaimed += globalData(n)->reclaimedMemory;
+	return reclaimed;
 }
 
 template <int Size>
 long long FastAllocator<Size>::getActiveThreads() {
-	return globalData()->activeThreads;
+	long long threads = 0;
+	for(int n = 0; n < numaNodes(); n++)
+		threads += globalData(n)->activeThreads;
+	return threads;
+}
+
+template <int Size>
+long long FastAllocator<Size>::getCrossNodeFrees() {
+	long long samples = 0;
+	for(int n = 0; n < numaNodes(); n++)
+		samples += globalData(n)->crossNodeFreeSamples;
+	return samples * NUMA_SAMPLE_INTERVAL;
+}
+
+template <int Size>
+long long FastAllocator<Size>::getRemoteMagazines() {
+	long long remote = 0;
+	for(int n = 0; n < numaNodes(); n++)
+		remote += globalData(n)->remoteMagazines;
+	return remote;
 }
 
 static int64_t getSizeCode(int i) {
@@ -245,7 +308,10 @@ static int64_t getSizeCode(int i) {
 		case 2048: return 8;
 		case 4096: return 9;
 		case 8192: return 10;
-		default: return 11;
+		case 16384: return 11;
+		case 32768: return 12;
+		case 65536: return 13;
+		default: return 14;
 	}
 }
 
@@ -289,6 +355,7 @@ void *FastAllocator<Size>::allocate() {
 #if defined(ALLOC_INSTRUMENTATION) || defined(ALLOC_INSTRUMENTATION_STDOUT)
 	recordAllocation(p, Size);
 #endif
+	heapSampleAllocation( p, Size );
 	return p;
 }
 
@@ -297,6 +364,7 @@ void FastAllocator<Size>::release(void *ptr) {
 	if(!threadInitialized) {
 		initThread();
 	}
+	heapSampleRelease( ptr );
 
 #if FASTALLOC_THREAD_SAFE
 	ThreadData& thr = threadData;
@@ -310,6 +378,9 @@ void FastAllocator<Size>::release(void *ptr) {
 
 	ASSERT(!thr.freelist == (thr.count == 0)); // freelist is empty if and only if count is 0
 
+	if (thr.releasesUntilSample && !--thr.releasesUntilSample)
+		sampleRelease(ptr);
+
 	++thr.count;
 	*(void**)ptr = thr.freelist;
 	//check(ptr, false);
@@ -385,9 +456,12 @@ void FastAllocator<Size>::initThread() {
 		threadInitFunction();
 	}
 
-	EnterCriticalSection(&globalData()->mutex);
-	++globalData()->activeThreads;
-	LeaveCriticalSection(&globalData()->mutex);
+	threadData.node = threadData.activeNode = getCurrentNumaNode() % MAX_NUMA_NODES;
+	threadData.releasesUntilSample = numaNodes() > 1 ? NUMA_SAMPLE_INTERVAL : 0;
+
+	EnterCriticalSection(&globalData(threadData.node)->mutex);
+	++globalData(threadData.node)->activeThreads;
+	LeaveCriticalSection(&globalData(threadData.node)->mutex);
 
 	threadData.freelist = nullptr;
 	threadData.alternate = nullptr;
@@ -395,29 +469,75 @@ void FastAllocator<Size>::initThread() {
 }
 
 template <int Size>
-void FastAllocator<Size>::getMagazine() {
-	ASSERT(threadInitialized);
-	ASSERT(!threadData.freelist && !threadData.alternate && threadData.count == 0);
+void FastAllocator<Size>::sampleRelease(void* ptr) {
+	threadData.releasesUntilSample = NUMA_SAMPLE_INTERVAL;
+	int node = getNumaNodeOfAddress(ptr);
+	if (node >= 0 && node % MAX_NUMA_NODES != threadData.node) {
+		EnterCriticalSection(&globalData(threadData.node)->mutex);
+		++globalData(threadData.node)->crossNodeFreeSamples;
+		LeaveCriticalSection(&globalData(threadData.node)->mutex);
+	}
+}
 
-	EnterCriticalSection(&globalData()->mutex);
-	if (globalData()->magazines.size()) {
-		void* m = globalData()->magazines.back();
-		globalData()->magazines.pop_back();
-		LeaveCriticalSection(&globalData()->mutex);
+// Takes a magazine from the given node's pool into threadData, if it has one
+template <int Size>
+bool FastAllocator<Size>::takeMagazine(int node) {
+	GlobalData* data = globalData(node);
+	EnterCriticalSection(&data->mutex);
+	if (data->magazines.size()) {
+		void* m = data->magazines.back();
+		data->magazines.pop_back();
+		LeaveCriticalSection(&data->mutex);
 		threadData.freelist = m;
 		threadData.count = magazine_size;
-		return;
-	} else if (globalData()->partial_magazines.size()) {
-		std::pair<int, void*> p = globalData()->partial_magazines.back();
-		globalData()->partial_magazines.pop_back();
-		globalData()->partialMagazineUnallocatedMemory -= p.first * Size;
-		LeaveCriticalSection(&globalData()->mutex);
+		return true;
+	} else if (data->partial_magazines.size()) {
+		std::pair<int, void*> p = data->partial_magazines.back();
+		data->partial_magazines.pop_back();
+		data->partialMagazineUnallocatedMemory -= p.first * Size;
+		LeaveCriticalSection(&data->mutex);
 		threadData.freelist = p.second;
 		threadData.count = p.first;
+		return true;
+	} else if (data->reclaimed_magazines.size()) {
+		// The reclaimed pages come back zero filled as they are touched; the freelist itself was never given up
+		void* m = data->reclaimed_magazines.back();
+		data->reclaimed_magazines.pop_back();
+		data->reclaimedMemory -= (long long)magazine_size * (Size - RECLAIM_PAGE_SIZE);
+		LeaveCriticalSection(&data->mutex);
+		threadData.freelist = m;
+		threadData.count = magazine_size;
+		return true;
+	}
+	LeaveCriticalSection(&data->mutex);
+	return false;
+}
+
+template <int Size>
+void FastAllocator<Size>::getMagazine() {
+	ASSERT(threadInitialized);
+	ASSERT(!threadData.freelist && !threadData.alternate && threadData.count == 0);
+
+	// The thread may have moved since it last looked
+	int nodes = numaNodes();
+	if (nodes > 1)
+		threadData.node = getCurrentNumaNode() % MAX_NUMA_NODES;
+	if (takeMagazine(threadData.node))
 		return;
+	// Rather than letting another node's idle magazines pile up, use them before asking the system for more memory
+	for(int n = 1; n < nodes; n++) {
+		int node = (threadData.node + n) % nodes;
+		if (takeMagazine(node)) {
+			EnterCriticalSection(&globalData(threadData.node)->mutex);
+			++globalData(threadData.node)->remoteMagazines;
+			LeaveCriticalSection(&globalData(threadData.node)->mutex);
+			return;
+		}
 	}
-	globalData()->totalMemory += magazine_size*Size;
-	LeaveCriticalSection(&globalData()->mutex);
+
+	EnterCriticalSection(&globalData(threadData.node)->mutex);
+	globalData(threadData.node)->totalMemory += magazine_size*Size;
+	LeaveCriticalSection(&globalData(threadData.node)->mutex);
 
 	// Allocate a new page of data from the system allocator
 	#ifdef ALLOC_INSTRUMENTATION
@@ -437,13 +557,17 @@ void FastAllocator<Size>::getMagazine() {
 	ASSERT( block == desiredBlock );
 #endif
 #else
-	// FIXME: We should be able to allocate larger magazine sizes here if we
-	// detect that the underlying system supports hugepages.  Using hugepages
-	// with smaller-than-2MiB magazine sizes strands memory.  See issue #909.
 	if(FLOW_KNOBS && g_trace_depth == 0 && g_nondeterministic_random && g_nondeterministic_random->random01() < (magazine_size * Size)/FLOW_KNOBS->FAST_ALLOC_LOGGING_BYTES) {
 		TraceEvent("GetMagazineSample").detail("Size", Size).backtrace();
 	}
-	block = (void **)::allocate(magazine_size * Size, false);
+	if (FLOW_KNOBS && FLOW_KNOBS->FAST_ALLOC_HUGE_PAGES) {
+		block = (void **)allocateHugePageMagazine();
+	} else {
+		block = (void **)::allocate(magazine_size * Size, false);
+		// Without this the pages would still mostly land on this node, since this thread touches them first below
+		if (nodes > 1)
+			bindToNumaNode(block, magazine_size * Size, threadData.node);
+	}
 #endif
 
 	//void** block = new void*[ magazine_size * PSize ];
@@ -457,32 +581,84 @@ void FastAllocator<Size>::getMagazine() {
 	threadData.freelist = block;
 	threadData.count = magazine_size;
 }
+// Magazines are smaller than a huge page, so each node's pool carves them out of a shared 2MB chunk instead of
+// stranding most of a huge page per magazine.  A chunk is never returned to the system.
+template <int Size>
+void* FastAllocator<Size>::allocateHugePageMagazine() {
+	static_assert(HUGE_PAGE_CHUNK % (magazine_size * Size) == 0, "Magazines must tile a huge page chunk");
+	GlobalData* data = globalData(threadData.node);
+	EnterCriticalSection(&data->mutex);
+	if (!data->hugePageChunk || data->hugePageChunkUsed == HUGE_PAGE_CHUNK) {
+		data->hugePageChunk = (uint8_t*)allocateLargePages(HUGE_PAGE_CHUNK);
+		data->hugePageChunkUsed = 0;
+		if (numaNodes() > 1)
+			bindToNumaNode(data->hugePageChunk, HUGE_PAGE_CHUNK, threadData.node);
+	}
+	void* mag = data->hugePageChunk + data->hugePageChunkUsed;
+	data->hugePageChunkUsed += magazine_size * Size;
+	LeaveCriticalSection(&data->mutex);
+	return mag;
+}
+
 template <int Size>
 void FastAllocator<Size>::releaseMagazine(void* mag) {
 	ASSERT(threadInitialized);
-	EnterCriticalSection(&globalData()->mutex);
-	globalData()->magazines.push_back(mag);
-	LeaveCriticalSection(&globalData()->mutex);
+	GlobalData* data = globalData(threadData.node);
+	void* idle = nullptr;
+	EnterCriticalSection(&data->mutex);
+	// Giving back part of a huge page would split it up, or fail outright for reserved huge pages
+	if (Size >= RECLAIM_MIN_SIZE && FLOW_KNOBS && !FLOW_KNOBS->FAST_ALLOC_HUGE_PAGES && data->magazines.size() * magazine_size * Size >= FLOW_KNOBS->FAST_ALLOC_IDLE_MAGAZINE_BYTES) {
+		// Enough magazines are already waiting; the one that has been waiting longest goes back to the system
+		idle = data->magazines.front();
+		data->magazines.erase(data->magazines.begin());
+	}
+	data->magazines.push_back(mag);
+	LeaveCriticalSection(&data->mutex);
+
+	if (idle) reclaimMagazine(idle);
+}
+template <int Size>
+void FastAllocator<Size>::reclaimMagazine(void* mag) {
+	GlobalData* data = globalData(threadData.node);
+#ifdef __linux__
+	// Blocks come from mmap, so every object of a reclaimable size class is page aligned
+	for(void* p = mag; p; p = *(void**)p)
+		madvise((uint8_t*)p + RECLAIM_PAGE_SIZE, Size - RECLAIM_PAGE_SIZE, MADV_DONTNEED);
+
+	EnterCriticalSection(&data->mutex);
+	data->reclaimed_magazines.push_back(mag);
+	data->reclaimedMemory += (long long)magazine_size * (Size - RECLAIM_PAGE_SIZE);
+	LeaveCriticalSection(&data->mutex);
+#else
+	EnterCriticalSection(&data->mutex);
+	data->magazines.push_back(mag);
+	LeaveCriticalSection(&data->mutex);
+#endif
 }
 template <int Size>
 void FastAllocator<Size>::releaseThreadMagazines() {
 	if(threadInitialized) {
 		threadInitialized = false;
 		ThreadData& thr = threadData;
+		GlobalData* data = globalData(thr.node);
 
-		EnterCriticalSection(&globalData()->mutex);
+		EnterCriticalSection(&data->mutex);
 		if (thr.freelist || thr.alternate) {
 			if (thr.freelist) {
 				ASSERT(thr.count > 0 && thr.count <= magazine_size);
-				globalData()->partial_magazines.push_back( std::make_pair(thr.count, thr.freelist) );
-				globalData()->partialMagazineUnallocatedMemory += thr.count * Size;
+				data->partial_magazines.push_back( std::make_pair(thr.count, thr.freelist) );
+				data->partialMagazineUnallocatedMemory += thr.count * Size;
 			}
 			if (thr.alternate) {
-				globalData()->magazines.push_back(thr.alternate);
+				data->magazines.push_back(thr.alternate);
 			}
 		}
-		--globalData()->activeThreads;
-		LeaveCriticalSection(&globalData()->mutex);
+		LeaveCriticalSection(&data->mutex);
+
+		GlobalData* active = globalData(thr.activeNode);
+		EnterCriticalSection(&active->mutex);
+		--active->activeThreads;
+		LeaveCriticalSection(&active->mutex);
 
 		thr.count = 0;
 		thr.alternate = nullptr;
@@ -501,6 +677,9 @@ void releaseAllThreadMagazines() {
 	FastAllocator<2048>::releaseThreadMagazines();
 	FastAllocator<4096>::releaseThreadMagazines();
 	FastAllocator<8192>::releaseThreadMagazines();
+	FastAllocator<16384>::releaseThreadMagazines();
+	FastAllocator<32768>::releaseThreadMagazines();
+	FastAllocator<65536>::releaseThreadMagazines();
 }
 
 int64_t getTotalUnusedAllocatedMemory() {
@@ -516,6 +695,9 @@ int64_t getTotalUnusedAllocatedMemory() {
 	unusedMemory += FastAllocator<2048>::getApproximateMemoryUnused();
 	unusedMemory += FastAllocator<4096>::getApproximateMemoryUnused();
 	unusedMemory += FastAllocator<8192>::getApproximateMemoryUnused();
+	unusedMemory += FastAllocator<16384>::getApproximateMemoryUnused();
+	unusedMemory += FastAllocator<32768>::getApproximateMemoryUnused();
+	unusedMemory += FastAllocator<65536>::getApproximateMemoryUnused();
 
 	return unusedMemory;
 }
@@ -530,4 +712,38 @@ template class FastAllocator<1024>;
 template class FastAllocator<2048>;
 template class FastAllocator<4096>;
 template class FastAllocator<8192>;
-
+template class FastAllocator<16384>;
+template class FastAllocator<32768>;
+template class FastAllocator<65536>;
+
+TEST_CASE("/flow/FastAllocator/reclaim") {
+	// Magazines of huge pages are never given back
+	if (FLOW_KNOBS->FAST_ALLOC_HUGE_PAGES) return Void();
+	typedef FastAllocator<65536> Allocator;
+	int count = 4 * FLOW_KNOBS->FAST_ALLOC_IDLE_MAGAZINE_BYTES / 65536;
+	std::vector<uint8_t*> objects;
+	for(int i = 0; i < count; i++) {
+		objects.push_back( (uint8_t*)Allocator::allocate() );
+		objects.back()[65535] = 1;
+	}
+	long long reclaimed = Allocator::getReclaimedMemory();
+	for(auto p : objects)
+		Allocator::release(p);
+	// Freeing this much fills the global pool well past the idle limit
+	long long afterRelease = Allocator::getReclaimedMemory();
+	ASSERT( afterRelease > reclaimed );
+	ASSERT( Allocator::getTotalMemory() + Allocator::getReclaimedMemory() >= (long long)count * 65536 );
+
+	// Reclaimed magazines are handed out again once the others are gone, and their objects are still usable
+	objects.clear();
+	for(int i = 0; i < count; i++) {
+		objects.push_back( (uint8_t*)Allocator::allocate() );
+		objects.back()[65535] = 2;
+	}
+	ASSERT( Allocator::getReclaimedMemory() < afterRelease );
+	for(auto p : objects) {
+		ASSERT( p[65535] == 2 );
+		Allocator::release(p);
+	}
+	return Void();
+}
@@ -39,6 +39,7 @@
 
 #include "flow/Hash3.h"
 
+#include <atomic>
 #include <vector>
 #include <cstdlib>
 #include <cstdio>
@@ -99,6 +100,56 @@ void recordAllocation( void *ptr, size_t size );
 void recordDeallocation( void *ptr );
 #endif
 
+// The sampling heap profiler (see HeapProfiler.h).  While it runs, each thread samples one allocation roughly every
+// g_heapSampleBytes bytes allocated through FastAllocator, allocateFast() and huge ArenaBlocks.  Releases only look
+// further while sampled allocations are live, and then search g_heapSampleTable for their address without a lock; only
+// the releases of sampled allocations go on to heapProfileRelease() and its lock.
+extern std::atomic<int64_t> g_heapSampleBytes;  // 0 when not profiling
+extern std::atomic<int64_t> g_heapLiveSamples;
+extern thread_local int64_t g_heapBytesUntilSample;
+void heapProfileAllocation( void* ptr, size_t size );
+void heapProfileRelease( void* ptr );
+
+// The addresses of the live sampled allocations, by linear probing.  At most a quarter of the slots are used, so a
+// search for an address that was not sampled usually stops at the first empty slot.
+struct HeapSampleTable {
+	int bits;
+	std::atomic<uintptr_t>* slots;  // 1 << bits of them, each a sampled address or 0
+
+	size_t home( uintptr_t address ) const { return (size_t)( ((uint64_t)address * 0x9E3779B97F4A7C15ULL) >> (64 - bits) ); }
+	bool contains( void* ptr ) const {
+		size_t mask = ((size_t)1 << bits) - 1;
+		for(size_t i = home( (uintptr_t)ptr );; i = (i + 1) & mask) {
+			uintptr_t s = slots[i].load( std::memory_order_relaxed );
+			if (s == (uintptr_t)ptr) return true;
+			if (!s) return false;
+		}
+	}
+};
+// The profiler changes these only while holding its lock, and makes g_heapSampleTableVersion odd while it does, so
+// that a search which overlapped a change can tell and search again.  Tables it outgrows are never freed.
+extern std::atomic<HeapSampleTable*> g_heapSampleTable;
+extern std::atomic<uint32_t> g_heapSampleTableVersion;
+
+inline void heapSampleAllocation( void* ptr, size_t size ) {
+	if ((g_heapBytesUntilSample -= size) < 0 && g_heapSampleBytes.load(std::memory_order_relaxed))
+		heapProfileAllocation( ptr, size );
+}
+inline bool heapSampleTableContains( void* ptr ) {
+	for(;;) {
+		uint32_t version = g_heapSampleTableVersion.load( std::memory_order_acquire );
+		if (version & 1) continue;
+		HeapSampleTable* table = g_heapSampleTable.load( std::memory_order_acquire );
+		bool found = table && table->contains( ptr );
+		std::atomic_thread_fence( std::memory_order_acquire );
+		if (g_heapSampleTableVersion.load( std::memory_order_relaxed ) == version) return found;
+	}
+}
+inline void heapSampleRelease( void* ptr ) {
+	if (g_heapLiveSamples.load(std::memory_order_relaxed) && heapSampleTableContains( ptr ))
+		heapProfileRelease( ptr );
+}
+
 template <int Size>
 class FastAllocator {
 public:
@@ -106,9 +157,15 @@ public:
 	static void release(void* ptr);
 	static void check( void* ptr, bool alloc );
 
+	// Memory obtained from the system, less what idle magazines have given back to it
 	static long long getTotalMemory();
 	static long long getApproximateMemoryUnused();
+	static long long getReclaimedMemory();
 	static long long getActiveThreads();
+	// Estimated from a sample of releases on machines with more than one NUMA node
+	static long long getCrossNodeFrees();
+	// Magazines a thread had to take from another NUMA node's pool
+	static long long getRemoteMagazines();
 
 	static void releaseThreadMagazines();
 
@@ -121,37 +178,78 @@ private:
 	static unsigned long vLock;
 #endif
 
-	static const int magazine_size = (128<<10) / Size;
+	// Magazines are 128KB, but always hold at least MIN_MAGAZINE_OBJECTS objects so that the large size classes are not
+	// back in the global pool every few allocations
+	enum { MIN_MAGAZINE_OBJECTS = 8 };
+	static const int magazine_size = (128<<10) / Size >= MIN_MAGAZINE_OBJECTS ? (128<<10) / Size : MIN_MAGAZINE_OBJECTS;
 	static const int PSize = Size / sizeof(void*);
+	// Objects of at least RECLAIM_MIN_SIZE span several pages.  Everything but the first page of each object in an idle
+	// magazine can be handed back to the system, since the freelist only lives in the first page.
+	enum { RECLAIM_PAGE_SIZE = 4096, RECLAIM_MIN_SIZE = 16384 };
+	// Each NUMA node has its own global pool.  One release in NUMA_SAMPLE_INTERVAL checks where the object lives.
+	enum { MAX_NUMA_NODES = 8, NUMA_SAMPLE_INTERVAL = 1024 };
+	// With the FAST_ALLOC_HUGE_PAGES knob, magazines are carved out of chunks of this size
+	enum { HUGE_PAGE_CHUNK = 2<<20 };
 	struct GlobalData;
 	struct ThreadData {
 		void* freelist;
 		int count;		  // there are count items on freelist
 		void* alternate;  // alternate is either a full magazine, or an empty one
+		int node;		  // the NUMA node whose pool this thread uses
+		int activeNode;	  // the node whose activeThreads counts this thread, since node can change in getMagazine()
+		int releasesUntilSample;  // 0 if there is only one NUMA node
 	};
 	static thread_local ThreadData threadData;
 	static thread_local bool threadInitialized;
-	static GlobalData* globalData() {
+	static GlobalData* globalData(int node) {
 #ifdef VALGRIND
 		ANNOTATE_RWLOCK_ACQUIRED(vLock, 1);
 #endif
-		static GlobalData *data = new GlobalData(); // This is thread-safe as of c++11 (VS 2015, gcc 4.8, clang 3.3)
+		static GlobalData *data = new GlobalData[MAX_NUMA_NODES]; // This is thread-safe as of c++11 (VS 2015, gcc 4.8, clang 3.3)
 
 #ifdef VALGRIND
 		ANNOTATE_RWLOCK_RELEASED(vLock, 1);
 #endif
 
-		return data;
+		return &data[node];
+	}
+	static int numaNodes() {
+		int nodes = getNumaNodeCount();
+		return nodes < MAX_NUMA_NODES ? nodes : MAX_NUMA_NODES;
 	}
 	static void* freelist;
 
 	FastAllocator();  // not implemented
 	static void initThread();
 	static void getMagazine();   
+	static bool takeMagazine(int node);
+	static void* allocateHugePageMagazine();
 	static void releaseMagazine(void*);
+	static void reclaimMagazine(void*);
+	static void sampleRelease(void*);
 };
 
 extern int64_t g_hugeArenaMemory;
+
+// Arena memory left behind by VectorRefs that moved to grow, and grown into at the tail of an ArenaBlock instead.  Each
+// thread counts into its own, so that growing a VectorRef writes no shared cache line; getArenaVectorStats() sums them.
+// A thread's are kept after it exits, so that they still count.
+struct alignas(64) ArenaVectorStats {
+	std::atomic<int64_t> abandonedBytes, grownInPlaceBytes;  // Written only by the owning thread
+	ArenaVectorStats* next;  // In the list of every thread's
+
+	static inline ArenaVectorStats& local();
+	static void add( std::atomic<int64_t>& counter, int64_t bytes ) {
+		counter.store( counter.load( std::memory_order_relaxed ) + bytes, std::memory_order_relaxed );
+	}
+
+private:
+	static ArenaVectorStats& create();
+};
+extern thread_local ArenaVectorStats* g_arenaVectorStats;
+inline ArenaVectorStats& ArenaVectorStats::local() { return g_arenaVectorStats ? *g_arenaVectorStats : create(); }
+void getArenaVectorStats( int64_t& abandonedBytes, int64_t& grownInPlaceBytes );
+
 void hugeArenaSample(int size);
 void releaseAllThreadMagazines();
 int64_t getTotalUnusedAllocatedMemory();
@@ -195,7 +293,16 @@ static void* allocateFast(int size) {
 	if (size <= 128) return FastAllocator<128>::allocate();
 	if (size <= 256) return FastAllocator<256>::allocate();
 	if (size <= 512) return FastAllocator<512>::allocate();
-	return new uint8_t[size];
+	if (size <= 1024) return FastAllocator<1024>::allocate();
+	if (size <= 2048) return FastAllocator<2048>::allocate();
+	if (size <= 4096) return FastAllocator<4096>::allocate();
+	if (size <= 8192) return FastAllocator<8192>::allocate();
+	if (size <= 16384) return FastAllocator<16384>::allocate();
+	if (size <= 32768) return FastAllocator<32768>::allocate();
+	if (size <= 65536) return FastAllocator<65536>::allocate();
+	void* p = new uint8_t[size];
+	heapSampleAllocation( p, size );
+	return p;
 }
 
 static void freeFast(int size, void* ptr) {
@@ -205,6 +312,14 @@ static void freeFast(int size, void* ptr) {
 	if (size <= 128) return FastAllocator<128>::release(ptr);
 	if (size <= 256) return FastAllocator<256>::release(ptr);
 	if (size <= 512) return FastAllocator<512>::release(ptr);
+	if (size <= 1024) return FastAllocator<1024>::release(ptr);
+	if (size <= 2048) return FastAllocator<2048>::release(ptr);
+	if (size <= 4096) return FastAllocator<4096>::release(ptr);
+	if (size <= 8192) return FastAllocator<8192>::release(ptr);
+	if (size <= 16384) return FastAllocator<16384>::release(ptr);
+	if (size <= 32768) return FastAllocator<32768>::release(ptr);
+	if (size <= 65536) return FastAllocator<65536>::release(ptr);
+	heapSampleRelease( ptr );
 	delete[](uint8_t*)ptr;
 }
 
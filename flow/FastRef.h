@@ -75,8 +75,10 @@ public:
 			delete (Subclass*)this;
 	}
 	bool delref_no_destroy() const { return !--referenceCount; }
+	void setrefCountUnsafe(int32_t count) const { referenceCount = count; }
 	int32_t debugGetReferenceCount() const { return referenceCount; }	// Never use in production code, only for tracing
 	bool isSoleOwner() const { return referenceCount == 1; }
+	bool isSoleOwnerUnsafe() const { return referenceCount == 1; }
 private:
 	ThreadUnsafeReferenceCounted(const ThreadUnsafeReferenceCounted&) /* = delete*/;
 	void operator=(const ThreadUnsafeReferenceCounted&) /* = delete*/;
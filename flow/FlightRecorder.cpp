@@ -0,0 +1,137 @@
+/*
+ * FlightRecorder.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "flow/FlightRecorder.h"
+#include "flow/flow.h"
+#include "flow/UnitTest.h"
+#include <signal.h>
+
+#ifdef __linux__
+#include <cxxabi.h>
+#endif
+
+std::atomic<int> FlightRecorder::dumpRequests(0);
+
+FlightRecorder::FlightRecorder( int size ) : mask(0), recorded(0), dumped(0), dumpRequestsSeen(dumpRequests.load()) {
+	if (size <= 0) return;
+	int n = 1;
+	while (n < size) n <<= 1;
+	entries.resize( n );
+	mask = n-1;
+}
+
+static std::string typeName( const std::type_info* type ) {
+	std::string s = type->name();
+#ifdef __linux__
+	char *demangled = abi::__cxa_demangle(s.c_str(), NULL, NULL, NULL);
+	if (demangled) {
+		s = demangled;
+		free(demangled);
+	}
+#endif
+	size_t i;
+	while ((i = s.find("(anonymous namespace)::")) != std::string::npos)
+		s.erase(i, strlen("(anonymous namespace)::"));
+	return s;
+}
+
+uint64_t FlightRecorder::undumped( std::vector<Entry>& held ) const {
+	uint64_t first = std::max( dumped, recorded > entries.size() ? recorded - entries.size() : 0 );
+	held.clear();
+	for (uint64_t i = first; i < recorded; i++)
+		held.push_back( entries[ i & mask ] );
+	return first - dumped;
+}
+
+void FlightRecorder::dump( const char* reason ) {
+	dumpRequestsSeen = dumpRequests.load( std::memory_order_relaxed );
+	if (!enabled()) return;
+
+	std::vector<Entry> held;
+	uint64_t missed = undumped( held );
+	TraceEvent("FlightRecorder").detail("Reason", reason).detail("Tasks", held.size()).detail("Missed", missed);
+	for (int i = 0; i < held.size(); i++) {
+		Entry const& e = held[i];
+		TraceEvent("FlightRecorderTask")
+			.detail("Reason", reason)
+			.detail("Age", held.size() - 1 - i)
+			.detail("TaskID", e.taskID)
+			.detail("TaskType", typeName(e.type))
+			.detail("Task", format("%p", e.task))
+			.detail("StartTSC", e.startTsc)
+			.detail("MClocks", e.cycles / 1e6)
+			.detail("Yields", e.yields);
+	}
+	dumped = recorded;
+}
+
+static void dumpSignalHandler( int ) {
+	FlightRecorder::requestDump();
+}
+
+void FlightRecorder::installSignalHandler( int signal ) {
+#ifdef __linux__
+	struct sigaction action;
+	action.sa_handler = dumpSignalHandler;
+	sigemptyset( &action.sa_mask );
+	action.sa_flags = SA_RESTART;
+	sigaction(signal, &action, NULL);
+#endif
+}
+
+TEST_CASE("/flow/FlightRecorder/dump") {
+	FlightRecorder disabled( 0 );
+	ASSERT( !disabled.enabled() );
+
+	// A size of 5 keeps 8 tasks
+	FlightRecorder fr( 5 );
+	ASSERT( fr.enabled() );
+	std::vector<FlightRecorder::Entry> held;
+	ASSERT( fr.undumped( held ) == 0 && held.empty() );
+	for (int i = 0; i < 6; i++)
+		fr.record( TaskDefaultYield + i, &fr, &typeid(fr), i*100, 100, i );
+	ASSERT( fr.undumped( held ) == 0 && held.size() == 6 );
+	for (int i = 0; i < 6; i++)
+		ASSERT( held[i].startTsc == i*100 && held[i].taskID == TaskDefaultYield + i && held[i].yields == i );
+
+	// After wrapping around, the ring holds the last 8 in order, and the 12 overwritten are missed
+	for (int i = 6; i < 20; i++)
+		fr.record( TaskDefaultYield + i, &fr, &typeid(fr), i*100, 100, i );
+	ASSERT( fr.undumped( held ) == 12 && held.size() == 8 );
+	for (int i = 0; i < 8; i++)
+		ASSERT( held[i].startTsc == (12+i)*100 && held[i].taskID == TaskDefaultYield + 12 + i );
+
+	ASSERT( !fr.dumpRequested() );
+	FlightRecorder::requestDump();
+	ASSERT( fr.dumpRequested() && disabled.dumpRequested() );
+	fr.dump( "Test" );
+	ASSERT( !fr.dumpRequested() );
+	ASSERT( fr.undumped( held ) == 0 && held.empty() );
+
+	// A dump only covers what was recorded since the last one, and counts only those overwritten since as missed
+	for (int i = 20; i < 23; i++)
+		fr.record( TaskDefaultYield, &fr, &typeid(fr), i*100, 100, 0 );
+	ASSERT( fr.undumped( held ) == 0 && held.size() == 3 && held[0].startTsc == 2000 && held[2].startTsc == 2200 );
+	for (int i = 23; i < 33; i++)
+		fr.record( TaskDefaultYield, &fr, &typeid(fr), i*100, 100, 0 );
+	ASSERT( fr.undumped( held ) == 5 && held.size() == 8 && held[0].startTsc == 2500 && held[7].startTsc == 3200 );
+	return Void();
+}
@@ -0,0 +1,87 @@
+/*
+ * FlightRecorder.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef FLOW_FLIGHTRECORDER_H
+#define FLOW_FLIGHTRECORDER_H
+#pragma once
+
+#include <atomic>
+#include <typeinfo>
+#include <vector>
+#include <stdint.h>
+
+// The last tasks a run loop ran, oldest overwritten first, so that when the loop is slow the trace log can show what
+// led up to it.  Only the run loop's thread records and dumps, so record() is a few plain stores per task.
+class FlightRecorder {
+public:
+	struct Entry {
+		int64_t startTsc;
+		int64_t cycles;
+		const void* task;
+		const std::type_info* type;  // Of the task, or of what it wakes (e.g. an ActorCallback names the actor)
+		int taskID;
+		int yields;  // check_yield() calls during the task that returned true
+	};
+
+	// Keeps the last size tasks, rounded up to a power of two.  With a size of 0 it is disabled, and record() must not
+	// be called.
+	explicit FlightRecorder( int size );
+
+	bool enabled() const { return !entries.empty(); }
+
+	void record( int taskID, const void* task, const std::type_info* type, int64_t startTsc, int64_t cycles, int yields ) {
+		Entry& e = entries[ recorded++ & mask ];
+		e.startTsc = startTsc;
+		e.cycles = cycles;
+		e.task = task;
+		e.type = type;
+		e.taskID = taskID;
+		e.yields = yields;
+	}
+
+	// Traces a FlightRecorder event, then a FlightRecorderTask event for each task recorded since the last dump that
+	// is still held, oldest first
+	void dump( const char* reason );
+
+	// Sets held to the entries the next dump() would trace, and returns how many tasks recorded since the last dump
+	// were overwritten before it
+	uint64_t undumped( std::vector<Entry>& held ) const;
+
+	// May be called from a signal handler: every run loop dumps its flight recorder at its next iteration
+	static void requestDump() { ++dumpRequests; }
+	bool dumpRequested() { return dumpRequests.load( std::memory_order_relaxed ) != dumpRequestsSeen; }
+
+	// Makes the given signal call requestDump()
+	static void installSignalHandler( int signal );
+
+private:
+	std::vector<Entry> entries;
+	uint64_t mask;
+	uint64_t recorded, dumped;
+	int dumpRequestsSeen;
+
+	static std::atomic<int> dumpRequests;
+
+	FlightRecorder( FlightRecorder const& );  // not implemented
+	void operator=( FlightRecorder const& );  // not implemented
+};
+
+#endif
@@ -0,0 +1,363 @@
+/*
+ * HeapProfiler.actor.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "flow/HeapProfiler.h"
+#include "flow/FastAlloc.h"
+#include "flow/ThreadPrimitives.h"
+#include "flow/UnitTest.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "flow/actorcompiler.h"  // This must be the last #include.
+
+std::atomic<int64_t> g_heapSampleBytes(0);
+std::atomic<int64_t> g_heapLiveSamples(0);
+std::atomic<HeapSampleTable*> g_heapSampleTable(nullptr);
+std::atomic<uint32_t> g_heapSampleTableVersion(0);
+thread_local int64_t g_heapBytesUntilSample = 0;
+
+#ifdef __linux__
+
+#include <unistd.h>
+
+namespace {
+
+struct HeapSite {
+	std::vector<void*> stack;
+	int64_t liveCount, liveBytes, allocCount, allocBytes;
+	HeapSite() : liveCount(0), liveBytes(0), allocCount(0), allocBytes(0) {}
+};
+
+struct HeapSample {
+	HeapSite* site;
+	size_t size;
+};
+
+struct HeapProfiler {
+	enum { MAX_STACK_DEPTH = 256 };
+
+	ThreadSpinLock lock;
+	std::unordered_map<std::string, HeapSite> sites;  // Keyed by the bytes of the stack
+	std::unordered_map<void*, HeapSample> samples;  // The sampled allocations that are still live
+	std::vector<HeapSampleTable*> retiredTables;  // Outgrown g_heapSampleTables, which releases may still be searching
+	int maxStackDepth;
+	Future<Void> reports;
+
+	HeapProfiler() : maxStackDepth(0) {}
+};
+
+HeapProfiler& heapProfiler() {
+	static HeapProfiler* profiler = new HeapProfiler;
+	return *profiler;
+}
+
+// Set while a thread is in the profiler, so that it does not sample its own allocations
+thread_local bool inHeapProfiler = false;
+
+struct HeapProfilerHolder {
+	HeapProfilerHolder() { inHeapProfiler = true; heapProfiler().lock.enter(); }
+	~HeapProfilerHolder() { heapProfiler().lock.leave(); inHeapProfiler = false; }
+};
+
+// Exponentially distributed, so that each byte allocated is equally likely to be the one sampled
+int64_t nextSampleInterval( int64_t meanBytes ) {
+	static thread_local uint64_t x = 0;
+	if (!x) x = (((uint64_t)(uintptr_t)&x * 0x9E3779B97F4A7C15ULL) ^ timer_int()) | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);  // In (0,1]
+	return (int64_t)( -std::log(u) * meanBytes );
+}
+
+enum { MIN_SAMPLE_TABLE_BITS = 14 };
+
+// Brackets a change to g_heapSampleTable, so that heapSampleTableContains() searches again if it overlapped one.  The
+// changes inside must not release anything allocated through FastAllocator.
+struct HeapSampleTableChange {
+	HeapSampleTableChange() {
+		g_heapSampleTableVersion.fetch_add( 1, std::memory_order_relaxed );
+		std::atomic_thread_fence( std::memory_order_release );
+	}
+	~HeapSampleTableChange() { g_heapSampleTableVersion.fetch_add( 1, std::memory_order_release ); }
+};
+
+HeapSampleTable* newHeapSampleTable( int bits ) {
+	HeapSampleTable* t = new HeapSampleTable;
+	t->bits = bits;
+	t->slots = new std::atomic<uintptr_t>[ (size_t)1 << bits ];
+	for(size_t i = 0; i < ((size_t)1 << bits); i++)
+		t->slots[i].store( 0, std::memory_order_relaxed );
+	return t;
+}
+
+void insertHeapSample( HeapSampleTable* t, void* ptr ) {
+	size_t mask = ((size_t)1 << t->bits) - 1;
+	size_t i = t->home( (uintptr_t)ptr );
+	while (t->slots[i].load( std::memory_order_relaxed ))
+		i = (i + 1) & mask;
+	t->slots[i].store( (uintptr_t)ptr, std::memory_order_relaxed );
+}
+
+void eraseHeapSample( HeapSampleTable* t, void* ptr ) {
+	size_t mask = ((size_t)1 << t->bits) - 1;
+	size_t i = t->home( (uintptr_t)ptr );
+	for(uintptr_t s; (s = t->slots[i].load( std::memory_order_relaxed )) != (uintptr_t)ptr; i = (i + 1) & mask)
+		if (!s) return;
+	// Shift back the addresses after it that the hole would hide from searches, so that no tombstone is needed
+	for(size_t j = (i + 1) & mask;; j = (j + 1) & mask) {
+		uintptr_t s = t->slots[j].load( std::memory_order_relaxed );
+		if (!s) break;
+		if (((j - t->home( s )) & mask) >= ((j - i) & mask)) {
+			t->slots[i].store( s, std::memory_order_relaxed );
+			i = j;
+		}
+	}
+	t->slots[i].store( 0, std::memory_order_relaxed );
+}
+
+// ptr has just been added to samples
+void addToHeapSampleTable( void* ptr ) {
+	HeapProfiler& profiler = heapProfiler();
+	HeapSampleTable* t = g_heapSampleTable.load( std::memory_order_relaxed );
+	if (t && profiler.samples.size() * 4 <= ((size_t)1 << t->bits)) {
+		HeapSampleTableChange change;
+		insertHeapSample( t, ptr );
+		return;
+	}
+
+	// Build a table twice the size before anyone can search it, and keep the old one for whoever still is
+	HeapSampleTable* grown = newHeapSampleTable( t ? t->bits + 1 : MIN_SAMPLE_TABLE_BITS );
+	for(auto& s : profiler.samples)
+		insertHeapSample( grown, s.first );
+	{
+		HeapSampleTableChange change;
+		g_heapSampleTable.store( grown, std::memory_order_release );
+	}
+	if (t) profiler.retiredTables.push_back( t );
+}
+
+void forgetSample( std::unordered_map<void*, HeapSample>::iterator s ) {
+	HeapSite* site = s->second.site;
+	--site->liveCount;
+	site->liveBytes -= s->second.size;
+	{
+		HeapSampleTableChange change;
+		eraseHeapSample( g_heapSampleTable.load( std::memory_order_relaxed ), s->first );
+	}
+	g_heapLiveSamples.fetch_sub( 1, std::memory_order_relaxed );
+	heapProfiler().samples.erase( s );
+}
+
+} // namespace
+
+void heapProfileAllocation( void* ptr, size_t size ) {
+	int64_t sampleBytes = g_heapSampleBytes.load( std::memory_order_relaxed );
+	g_heapBytesUntilSample = nextSampleInterval( sampleBytes );
+	if (inHeapProfiler) return;
+
+	HeapProfiler& profiler = heapProfiler();
+	void* addresses[HeapProfiler::MAX_STACK_DEPTH];
+	int depth = platform::raw_backtrace( addresses, profiler.maxStackDepth );
+	int skip = depth > 2 ? 2 : 0;  // raw_backtrace() and heapProfileAllocation()
+
+	HeapProfilerHolder holder;
+	if (!g_heapSampleBytes.load( std::memory_order_relaxed )) return;  // Stopped in the meantime
+	auto s = profiler.samples.find( ptr );
+	if (s != profiler.samples.end())
+		forgetSample( s );  // Freed by a path that is not sampled
+	HeapSite& site = profiler.sites[ std::string( (const char*)(addresses + skip), (depth - skip) * sizeof(void*) ) ];
+	if (site.stack.empty())
+		site.stack.assign( addresses + skip, addresses + depth );
+	++site.liveCount;
+	site.liveBytes += size;
+	++site.allocCount;
+	site.allocBytes += size;
+	profiler.samples[ptr] = HeapSample{ &site, size };
+	addToHeapSampleTable( ptr );
+	g_heapLiveSamples.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void heapProfileRelease( void* ptr ) {
+	if (inHeapProfiler) return;
+	HeapProfilerHolder holder;
+	auto s = heapProfiler().samples.find( ptr );
+	if (s != heapProfiler().samples.end())
+		forgetSample( s );
+}
+
+std::string getHeapProfile() {
+	std::vector<HeapSite> sites;
+	int64_t sampleBytes;
+	{
+		HeapProfilerHolder holder;
+		sampleBytes = g_heapSampleBytes.load( std::memory_order_relaxed );
+		sites.reserve( heapProfiler().sites.size() );
+		for(auto& s : heapProfiler().sites)
+			sites.push_back( s.second );
+	}
+
+	HeapSite total;
+	for(auto& s : sites) {
+		total.liveCount += s.liveCount;
+		total.liveBytes += s.liveBytes;
+		total.allocCount += s.allocCount;
+		total.allocBytes += s.allocBytes;
+	}
+	std::sort( sites.begin(), sites.end(), [](HeapSite const& a, HeapSite const& b) { return a.liveBytes > b.liveBytes; } );
+
+	// The format of gperftools' heap profiles, which pprof unsamples using the heap_v2 sampling period
+	std::string report = format( "heap profile: %6lld: %8lld [%6lld: %8lld] @ heap_v2/%lld\n", (long long)total.liveCount,
+		(long long)total.liveBytes, (long long)total.allocCount, (long long)total.allocBytes, (long long)sampleBytes );
+	for(auto& s : sites) {
+		report += format( "%6lld: %8lld [%6lld: %8lld] @", (long long)s.liveCount, (long long)s.liveBytes,
+			(long long)s.allocCount, (long long)s.allocBytes );
+		for(void* a : s.stack)
+			report += format( " %p", a );
+		report += "\n";
+	}
+
+	// Lets pprof map the addresses to symbols
+	report += "\nMAPPED_LIBRARIES:\n";
+	FILE* maps = fopen( "/proc/self/maps", "r" );
+	if (maps) {
+		char buf[4096];
+		size_t n;
+		while ((n = fread( buf, 1, sizeof(buf), maps )) > 0)
+			report.append( buf, n );
+		fclose( maps );
+	}
+	return report;
+}
+
+static void writeHeapProfile( std::string const& filename ) {
+	std::string report = getHeapProfile();
+	FILE* f = fopen( filename.c_str(), "wb" );
+	if (!f || fwrite( report.data(), 1, report.size(), f ) != report.size()) {
+		TraceEvent(SevWarn, "HeapProfileWriteFailed").detail("Filename", filename).GetLastError();
+	} else {
+		TraceEvent("HeapProfileWritten").detail("Filename", filename).detail("LiveSamples", g_heapLiveSamples.load());
+	}
+	if (f) fclose( f );
+}
+
+ACTOR static Future<Void> heapProfileReports( std::string prefix ) {
+	state int n = 0;
+	loop {
+		wait( delay( FLOW_KNOBS->HEAP_PROFILER_INTERVAL, TaskLowPriority ) );
+		writeHeapProfile( format( "%s.%d.heap", prefix.c_str(), n++ ) );
+	}
+}
+
+void startHeapProfiling( Optional<int64_t> maybeSampleBytes /*= {}*/, Optional<std::string> maybeOutputPrefix /*= {}*/ ) {
+	int64_t sampleBytes = maybeSampleBytes.present() ? maybeSampleBytes.get() : FLOW_KNOBS->HEAP_PROFILER_SAMPLE_BYTES;
+	std::string prefix;
+	if (maybeOutputPrefix.present()) {
+		prefix = maybeOutputPrefix.get();
+	} else {
+		const char* outfn = getenv("FLOW_HEAP_PROFILER_OUTPUT");
+		prefix = (outfn ? outfn : "heap.%PID%");
+	}
+	auto pid = prefix.find( "%PID%" );
+	if (pid != std::string::npos)
+		prefix.replace( pid, 5, format("%d", getpid()) );
+
+	HeapProfiler& profiler = heapProfiler();
+	profiler.maxStackDepth = std::min<int>( FLOW_KNOBS->HEAP_PROFILER_MAX_STACK_DEPTH, HeapProfiler::MAX_STACK_DEPTH );
+	g_heapSampleBytes = std::max<int64_t>( sampleBytes, 1 );
+	profiler.reports = Future<Void>();
+	if (prefix.size() && FLOW_KNOBS->HEAP_PROFILER_INTERVAL > 0)
+		profiler.reports = heapProfileReports( prefix );
+	TraceEvent("HeapProfilerStarted").detail("SampleBytes", g_heapSampleBytes.load()).detail("OutputPrefix", prefix);
+}
+
+void stopHeapProfiling() {
+	HeapProfiler& profiler = heapProfiler();
+	profiler.reports = Future<Void>();
+	{
+		HeapProfilerHolder holder;
+		g_heapSampleBytes = 0;
+		g_heapLiveSamples = 0;
+		if (HeapSampleTable* t = g_heapSampleTable.load( std::memory_order_relaxed )) {
+			HeapSampleTableChange change;
+			for(size_t i = 0; i < ((size_t)1 << t->bits); i++)
+				t->slots[i].store( 0, std::memory_order_relaxed );
+		}
+		profiler.samples.clear();
+		profiler.sites.clear();
+	}
+	TraceEvent("HeapProfilerStopped");
+}
+
+TEST_CASE("/flow/HeapProfiler/sample") {
+	if (g_heapSampleBytes.load()) return Void();  // Leave a profiler someone started alone
+
+	startHeapProfiling( 1, std::string() );
+	void* p = FastAllocator<128>::allocate();
+	int64_t live = g_heapLiveSamples.load();
+	ASSERT( live > 0 );
+	std::string report = getHeapProfile();
+	ASSERT( report.find( "heap profile:" ) == 0 && report.find( "@ heap_v2/1\n" ) != std::string::npos );
+	ASSERT( heapSampleTableContains( p ) );
+	FastAllocator<128>::release( p );
+	ASSERT( g_heapLiveSamples.load() < live && !heapSampleTableContains( p ) );
+	stopHeapProfiling();
+	ASSERT( g_heapLiveSamples.load() == 0 );
+	return Void();
+}
+
+TEST_CASE("/flow/HeapProfiler/table") {
+	if (g_heapSampleBytes.load()) return Void();
+
+	// Sample everything, for more live samples than the smallest table holds
+	startHeapProfiling( 1, std::string() );
+	std::vector<void*> ps;
+	for(int i = 0; i < 3 << MIN_SAMPLE_TABLE_BITS; i++)
+		ps.push_back( FastAllocator<64>::allocate() );
+	HeapSampleTable* t = g_heapSampleTable.load();
+	ASSERT( t->bits > MIN_SAMPLE_TABLE_BITS && g_heapLiveSamples.load() >= (int64_t)ps.size() );
+	for(void* p : ps)
+		ASSERT( heapSampleTableContains( p ) );
+	ASSERT( !heapSampleTableContains( (uint8_t*)ps[0] + 1 ) );
+
+	// Free every other one, and the rest must still be found despite the holes that leaves
+	for(int i = 0; i < ps.size(); i += 2)
+		FastAllocator<64>::release( ps[i] );
+	for(int i = 0; i < ps.size(); i++)
+		ASSERT( heapSampleTableContains( ps[i] ) == (i % 2 == 1) );
+
+	// Stopping forgets the rest, so their releases don't look any further
+	stopHeapProfiling();
+	ASSERT( g_heapLiveSamples.load() == 0 && !heapSampleTableContains( ps[1] ) );
+	for(int i = 1; i < ps.size(); i += 2)
+		FastAllocator<64>::release( ps[i] );
+	return Void();
+}
+
+#else
+
+void heapProfileAllocation( void* ptr, size_t size ) { g_heapBytesUntilSample = std::numeric_limits<int64_t>::max(); }
+void heapProfileRelease( void* ptr ) {}
+void startHeapProfiling( Optional<int64_t> sampleBytes, Optional<std::string> outputPrefix ) {}
+void stopHeapProfiling() {}
+std::string getHeapProfile() { return std::string(); }
+
+#endif
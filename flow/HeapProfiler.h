@@ -0,0 +1,39 @@
+/*
+ * HeapProfiler.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef FLOW_HEAPPROFILER_H
+#define FLOW_HEAPPROFILER_H
+#pragma once
+
+#include "flow/flow.h"
+
+// Starts the sampling heap profiler, or changes its settings if it is running.  Each thread samples one allocation
+// roughly every sampleBytes bytes allocated through FastAllocator, allocateFast() and huge ArenaBlocks, with its
+// backtrace.  Every HEAP_PROFILER_INTERVAL seconds a report is written to <outputPrefix>.<n>.heap; an empty prefix
+// writes none.  Reports are in the text heap profile format that pprof reads, e.g. `pprof --text fdbserver x.0.heap`.
+void startHeapProfiling( Optional<int64_t> sampleBytes = {}, Optional<std::string> outputPrefix = {} );
+// Stops sampling and forgets every sample
+void stopHeapProfiling();
+// A report of the allocation sites of the sampled allocations that are still live, and of every one since profiling
+// started
+std::string getHeapProfile();
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * IAsyncFile.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOW_IASYNCFILE_H
+#define FLOW_IASYNCFILE_H
+#pragma once
+
+#include "flow/flow.h"
+
+// IAsyncFile is a file which may be read and written without blocking the run loop.  Files must only be used from
+// the primary run loop, which is where their operations are submitted and completed.
+class IAsyncFile {
+public:
+	virtual ~IAsyncFile() {}
+	enum {
+		OPEN_READONLY = 0x1,
+		OPEN_READWRITE = 0x2,
+		OPEN_CREATE = 0x4,
+		OPEN_EXCLUSIVE = 0x10,
+		// Bypasses the process's page cache and the OS page cache (O_DIRECT): buffers, offsets and lengths must be
+		// multiples of 4096.  Other files are kept in the process's page cache, over an uncached file.
+		OPEN_UNCACHED = 0x20000,
+		// Caches the file in 64KB pages rather than 4KB pages
+		OPEN_LARGE_PAGES = 0x100000,
+		// Does every operation on the file I/O thread pool, even if kernel AIO or io_uring is available
+		OPEN_NO_AIO = 0x200000
+	};
+
+	virtual void addref() = 0;
+	virtual void delref() = 0;
+
+	// The buffer given to read() or write() must stay valid until the returned future is ready.  Cancelling the future
+	// does not cancel the operation, which may still use the buffer.
+
+	// Returns the number of bytes read, which is less than length only at the end of the file
+	virtual Future<int> read( void* data, int length, int64_t offset ) = 0;
+	virtual Future<Void> write( void const* data, int length, int64_t offset ) = 0;
+	virtual Future<Void> truncate( int64_t size ) = 0;
+	// Makes every completed write durable
+	virtual Future<Void> sync() = 0;
+	virtual Future<int64_t> size() = 0;
+	virtual std::string getFilename() = 0;
+};
+
+class IAsyncFileSystem {
+public:
+	// Opens a file for asynchronous I/O.  flags are IAsyncFile::OPEN_*, and mode is the permissions of a created file.
+	virtual Future<Reference<IAsyncFile>> open( std::string filename, int64_t flags, int64_t mode ) = 0;
+	// Deletes the given file.  If mustBeDurable, the returned future is not ready until the deletion is durable.
+	virtual Future<Void> deleteFile( std::string filename, bool mustBeDurable ) = 0;
+
+	virtual ~IAsyncFileSystem() {}
+
+	static IAsyncFileSystem* filesystem() { return filesystem(g_network); }
+	static IAsyncFileSystem* filesystem( INetwork* networkPtr ) { return static_cast<IAsyncFileSystem*>((void*) networkPtr->global(INetwork::enFileSystem)); }
+};
+
+// The file system used by Net2.  On Linux, uncached files are read and written with io_uring when the reactor has a
+// ring, or with kernel AIO otherwise, in batches submitted once per run loop iteration.  Everything else is done on a
+// pool of FILE_IO_THREADS threads.  Files opened without OPEN_UNCACHED are wrapped in the page cache.  Installs the run cycle function that submits the batches on net.
+IAsyncFileSystem* newNet2FileSystem( INetwork* net );
+// Called by Net2 once net has stopped.  Releases the kernel AIO context of its file system, and drops the requests
+// still queued or in flight, breaking their futures.
+void shutdownNet2FileSystem( INetwork* net );
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * IoUring.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/IoUring.h"
+
+#ifdef FLOW_HAVE_IO_URING
+
+#include "flow/Trace.h"
+#include "flow/UnitTest.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+IoUring* IoUring::create( unsigned entries ) {
+	io_uring_params params;
+	memset( &params, 0, sizeof(params) );
+	int fd = syscall( __NR_io_uring_setup, entries, &params );
+	if (fd < 0) {
+		TraceEvent(SevWarn, "IoUringSetupFailed").GetLastError();
+		return NULL;
+	}
+	if (!(params.features & IORING_FEAT_FAST_POLL)) {
+		// Without fast poll, every socket operation that would block is punted to a kernel worker thread
+		TraceEvent(SevWarn, "IoUringNoFastPoll").detail("Features", params.features);
+		::close(fd);
+		return NULL;
+	}
+
+	IoUring* ring = new IoUring;
+	ring->fd = fd;
+	ring->sqEntries = params.sq_entries;
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMmap)
+		ring->sqRingSize = ring->cqRingSize = std::max( ring->sqRingSize, ring->cqRingSize );
+
+	ring->sqRing = mmap( NULL, ring->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+	ring->cqRing = singleMmap ? ring->sqRing : mmap( NULL, ring->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+	ring->sqes = (io_uring_sqe*)mmap( NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES );
+	if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		TraceEvent(SevWarn, "IoUringMmapFailed").GetLastError();
+		if (ring->sqRing != MAP_FAILED) munmap( ring->sqRing, ring->sqRingSize );
+		if (!singleMmap && ring->cqRing != MAP_FAILED) munmap( ring->cqRing, ring->cqRingSize );
+		if (ring->sqes != MAP_FAILED) munmap( ring->sqes, params.sq_entries * sizeof(io_uring_sqe) );
+		::close(fd);
+		delete ring;
+		return NULL;
+	}
+
+	uint8_t* sq = (uint8_t*)ring->sqRing;
+	ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+	uint8_t* cq = (uint8_t*)ring->cqRing;
+	ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+	ring->sqeHead = ring->sqeTail = 0;
+
+	TraceEvent("IoUringCreated").detail("SQEntries", params.sq_entries).detail("CQEntries", params.cq_entries).detail("Features", params.features);
+	return ring;
+}
+
+IoUring::~IoUring() {
+	munmap( sqes, sqEntries * sizeof(io_uring_sqe) );
+	if (cqRing != sqRing) munmap( cqRing, cqRingSize );
+	munmap( sqRing, sqRingSize );
+	::close(fd);
+}
+
+io_uring_sqe* IoUring::prepare( Completion* c ) {
+	if (pending() == sqEntries)
+		submit();
+	ASSERT( pending() < sqEntries );
+	io_uring_sqe* sqe = &sqes[ sqeTail & *sqMask ];
+	sqeTail++;
+	memset( sqe, 0, sizeof(*sqe) );
+	sqe->user_data = (uint64_t)c;
+	return sqe;
+}
+
+int IoUring::submit() {
+	unsigned tail = *sqTail;
+	for(; sqeHead != sqeTail; sqeHead++, tail++)
+		sqArray[ tail & *sqMask ] = sqeHead & *sqMask;
+	__atomic_store_n( sqTail, tail, __ATOMIC_RELEASE );
+
+	// The kernel may not have consumed everything the last call handed it, and those entries are still on the ring
+	unsigned toSubmit = tail - __atomic_load_n( sqHead, __ATOMIC_ACQUIRE );
+	if (!toSubmit) return 0;
+
+	int submitted;
+	while (true) {
+		submitted = syscall( __NR_io_uring_enter, fd, toSubmit, 0, 0, NULL, 0 );
+		if (submitted >= 0) break;
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN || errno == EBUSY) {
+			// The completion ring is backed up; draining it lets the kernel accept more work
+			if (reap()) continue;
+			threadYield();
+			continue;
+		}
+		TraceEvent(SevError, "IoUringEnterError").GetLastError();
+		throw platform_error();
+	}
+	return submitted;
+}
+
+int IoUring::reap() {
+	int count = 0;
+	unsigned head = *cqHead;
+	while (head != __atomic_load_n( cqTail, __ATOMIC_ACQUIRE )) {
+		io_uring_cqe* cqe = &cqes[ head & *cqMask ];
+		Completion* c = (Completion*)cqe->user_data;
+		int result = cqe->res;
+		// The slot is released before complete() runs, since the completion may queue more work
+		__atomic_store_n( cqHead, ++head, __ATOMIC_RELEASE );
+		if (c) c->complete( result );
+		count++;
+	}
+	return count;
+}
+
+void IoUring::registerEventFD( int eventFD ) {
+	if (syscall( __NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &eventFD, 1 ) < 0) {
+		TraceEvent(SevError, "IoUringRegisterEventFDError").GetLastError();
+		throw platform_error();
+	}
+}
+
+namespace {
+
+struct TestCompletion : IoUring::Completion {
+	int result = 0, count = 0;
+	virtual void complete( int r ) { result = r; count++; }
+};
+
+}
+
+TEST_CASE("/flow/IoUring/pipe") {
+	IoUring* ring = IoUring::create( 8 );
+	if (!ring) return Void();  // Not supported by this kernel
+
+	int fds[2];
+	ASSERT( pipe(fds) == 0 );
+	ASSERT( ::write( fds[1], "hello", 5 ) == 5 );
+
+	TestCompletion reads[10];
+	char buf[10][5];
+	for(int i = 0; i < 10; i++) {
+		// More reads than the ring holds, so prepare() has to submit on its own
+		io_uring_sqe* sqe = ring->prepare( &reads[i] );
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fds[0];
+		sqe->addr = (uint64_t)buf[i];
+		sqe->len = i ? 5 : 1;
+	}
+	ring->submit();
+	ASSERT( ring->pending() == 0 );
+
+	// The first read completes right away, since the data is already there
+	for(int tries = 0; tries < 1000 && !reads[0].count; tries++) {
+		ring->reap();
+		threadSleep( 0.001 );
+	}
+	ASSERT( reads[0].count == 1 && reads[0].result == 1 && buf[0][0] == 'h' );
+
+	::close( fds[1] );
+	int completed = 0;
+	for(int tries = 0; tries < 1000 && completed < 10; tries++) {
+		ring->reap();
+		threadSleep( 0.001 );
+		completed = 0;
+		for(auto& r : reads) completed += r.count;
+	}
+	ASSERT( completed == 10 );
+	// One read gets the rest of the data, and the others see end of file
+	int bytes = 0;
+	for(int i = 1; i < 10; i++) {
+		ASSERT( reads[i].count == 1 && reads[i].result >= 0 );
+		bytes += reads[i].result;
+	}
+	ASSERT( bytes == 4 );
+
+	::close( fds[0] );
+	delete ring;
+	return Void();
+}
+
+#endif
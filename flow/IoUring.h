@@ -0,0 +1,96 @@
+/*
+ * IoUring.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOW_IOURING_H
+#define FLOW_IOURING_H
+#pragma once
+
+#include "flow/Platform.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_FAST_POLL
+#define FLOW_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef FLOW_HAVE_IO_URING
+
+// A Linux io_uring instance, driven through the raw system calls.  Operations are queued with prepare() and handed to
+// the kernel in one batch by submit(); reap() delivers their results by reading the completion ring, without a system
+// call.  Not thread safe: each run loop owns its own ring.
+class IoUring {
+public:
+	struct Completion {
+		// result is what the equivalent system call would have returned, or -errno
+		virtual void complete( int result ) = 0;
+	};
+
+	// Returns NULL if the kernel does not support io_uring
+	static IoUring* create( unsigned entries );
+	~IoUring();
+
+	// Returns a zeroed submission queue entry whose completion will be delivered to c.  If the submission queue is
+	// full, the queued entries are submitted first.
+	io_uring_sqe* prepare( Completion* c );
+
+	// Submits every prepared entry the kernel has not yet consumed, including any a previous submit() left behind,
+	// with a single io_uring_enter(), and returns the number the kernel consumed
+	int submit();
+	// Entries prepared but not yet consumed by the kernel
+	unsigned pending() const { return sqeTail - __atomic_load_n( sqHead, __ATOMIC_ACQUIRE ); }
+
+	// Calls complete() for every posted completion and returns how many there were
+	int reap();
+	// Whether reap() has completions to deliver, read from the completion ring without a system call
+	bool hasCompletions() const { return *cqHead != __atomic_load_n( cqTail, __ATOMIC_ACQUIRE ); }
+
+	// Has the kernel signal the given eventfd whenever it posts a completion, so that a reactor sleeping in epoll can
+	// wait for the ring alongside its other file descriptors
+	void registerEventFD( int eventFD );
+
+	int getFD() const { return fd; }
+
+private:
+	IoUring() {}
+	IoUring( IoUring const& ) = delete;
+	void operator=( IoUring const& ) = delete;
+
+	int fd;
+	void* sqRing;
+	void* cqRing;
+	size_t sqRingSize, cqRingSize;
+	io_uring_sqe* sqes;
+	unsigned sqEntries;
+
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	io_uring_cqe* cqes;
+
+	// Entries [sqeHead, sqeTail) have been prepared but not yet put on the submission ring.  Those before sqeHead are on
+	// it, and their sqes[] slots stay in use until the kernel's *sqHead passes them.
+	unsigned sqeHead, sqeTail;
+};
+
+#endif
+
+#endif
@@ -38,6 +38,8 @@ FlowKnobs::FlowKnobs(bool randomize, bool isSimulated) {
 	init( SERVER_REQUEST_INTERVAL,                             0.1 ); if( randomize && BUGGIFY ) SERVER_REQUEST_INTERVAL = 1.0;
 
 	init( REACTOR_FLAGS,                                         0 );
+	init( REACTOR_SPIN_MAX,                                      0 ); // >0 polls for up to this long, instead of sleeping, when the next event is predicted to arrive that soon
+	init( REACTOR_SPIN_QUANTILE,                               0.5 ); // ...which is when at least this fraction of recent idle periods ended that soon
 
 	init( DISABLE_ASSERTS,                                       0 );
 	init( QUEUE_MODEL_SMOOTHING_AMOUNT,                        2.0 );
@@ -48,8 +50,16 @@ FlowKnobs::FlowKnobs(bool randomize, bool isSimulated) {
 
 	init( RANDOMSEED_RETRY_LIMIT,                                4 );
 	init( FAST_ALLOC_LOGGING_BYTES,                           10e6 );
+	init( FAST_ALLOC_IDLE_MAGAZINE_BYTES,                    8<<20 ); // Per size class, before idle magazines of 16KB+ objects are given back to the system
+	init( FAST_ALLOC_HUGE_PAGES,                                 0 ); // 1 carves magazines, and arena blocks of 2MB or more, out of huge pages
 	init( HUGE_ARENA_LOGGING_BYTES,                          100e6 );
 	init( HUGE_ARENA_LOGGING_INTERVAL,                         5.0 );
+	init( ARENA_FREE_BYTES_PER_TASK,                             0 ); // >0 makes a run loop free this much of an arena at a time, leaving the rest to later tasks (e.g. 16 << 20); 0 frees it all at once
+	init( SCRATCH_ARENA_BYTES,  FLOW_ARENA_THREAD_SAFE ? 1 << 20 : 0 ); // Initial size of each run loop's scratchArena(), at least 8KB; 0 makes it an ordinary Arena (and must with FLOW_ARENA_THREAD_SAFE 0)
+	init( SCRATCH_ARENA_MAX_BYTES,                        64 << 20 ); // A scratch arena that overflows doubles in size up to this
+	init( HEAP_PROFILER_SAMPLE_BYTES,                    512 << 10 ); // The heap profiler samples one allocation in about this many bytes
+	init( HEAP_PROFILER_INTERVAL,                             60.0 ); // ...and writes a report of the live samples this often
+	init( HEAP_PROFILER_MAX_STACK_DEPTH,                        64 );
 
 	//connectionMonitor
 	init( CONNECTION_MONITOR_LOOP_TIME,   isSimulated ? 0.75 : 1.0 ); if( randomize && BUGGIFY ) CONNECTION_MONITOR_LOOP_TIME = 6.0;
@@ -96,13 +106,40 @@ FlowKnobs::FlowKnobs(bool randomize, bool isSimulated) {
 	//IAsyncFile
 	init( INCREMENTAL_DELETE_TRUNCATE_AMOUNT,                  5e8 ); //500MB
 	init( INCREMENTAL_DELETE_INTERVAL,                         1.0 ); //every 1 second
+	init( FILE_IO_THREADS,                                       4 ); // Blocking file operations that cannot use kernel AIO or io_uring
 		
 	//Net2 and FlowTransport
 	init( MIN_COALESCE_DELAY,                                10e-6 ); if( randomize && BUGGIFY ) MIN_COALESCE_DELAY = 0;
 	init( MAX_COALESCE_DELAY,                                20e-6 ); if( randomize && BUGGIFY ) MAX_COALESCE_DELAY = 0;
+	init( COALESCE_FLUSH_BYTES,                          16 << 10 ); // CoalescingWriter writes at once, without a coalescing delay, when this many bytes are queued
+	init( DELAY_SLACK,                                           0 ); // >0 (e.g. 0.001) makes delay()s of at least MIN_COALESCED_DELAY end at a multiple of this, sharing a timer per TaskID whose waiters run in one task
+	init( MIN_COALESCED_DELAY,                                0.02 );
 	init( SLOW_LOOP_CUTOFF,                          15.0 / 1000.0 );
 	init( SLOW_LOOP_SAMPLING_RATE,                             0.1 );
+	init( FLIGHT_RECORDER_TASKS,                               256 ); // Each run loop keeps the last this many tasks, traced with SlowTask and Net2SlowTaskTrace; 0 disables
+	init( FLIGHT_RECORDER_SIGNAL,                                0 ); // >0 makes this signal (e.g. 10, SIGUSR1) trace every run loop's flight recorder
 	init( TSC_YIELD_TIME,                                  1000000 );
+	init( TSC_CLOCK,                                             1 ); // 1 times run loop tasks, and now(), from the TSC when it is invariant
+	init( TSC_CALIBRATION_INTERVAL,                            1.0 ); // ...re-measuring its rate against the monotonic clock this often
+	init( THREAD_READY_TSC_INTERVAL,                         20000 ); // check_yield() drains cross-thread tasks at most this often
+	init( MAX_THREAD_READY_TSC_WAIT,                        200000 ); // ...backing off to this while no cross-thread tasks arrive
+	init( VIRTUAL_NETWORK_LATENCY,                           50e-6 ); // newVirtualNetwork() delays each message by half to one and a half times this
+	init( VIRTUAL_CONNECTION_WINDOW,                       1 << 20 ); // ...and lets this many unread bytes be in flight each way on a connection
+	init( RUN_LOOPS,                                             1 ); // >1 runs that many Net2 run loops, each on its own thread; needs FLOW_ARENA_THREAD_SAFE
+	init( PIN_RUN_LOOPS,                                         0 ); // 1 pins run loop i to core i
+	init( RUN_LOOP_METRICS_INTERVAL,                           1.0 ); // Secondary run loops publish their NetworkMetrics for SystemMonitor this often
+	init( REACTOR_IO_URING,                                      0 ); // 1 does socket I/O through io_uring (Linux); falls back to epoll
+	init( IO_URING_ENTRIES,                                    256 );
+	init( IO_URING_BUFFER_SIZE,                             65536 ); // Per connection, for each of receive and send
+	init( ZERO_COPY_MIN_BYTES,                              65536 ); // PacketWriter::serializeBytesZeroCopy() refers to values this large instead of copying them
+	init( SEND_ZERO_COPY,                                        1 ); // 1 sends those values with MSG_ZEROCOPY (Linux)
+	init( ZERO_COPY_CLOSE_TIMEOUT,                             5.0 ); // Closing a connection waits at most this long for the kernel to finish reading its zero-copy sends
+	init( RECEIVE_BUFFER_BYTES,                                  0 ); // 0 sizes a ReceiveBuffer to its connection's socket receive buffer
+	init( RECEIVE_BUFFER_POOL_SIZE,                             64 ); // Retired receive buffers each run loop keeps for reuse
+	init( EDF_MIN_TASKID,                                        0 ); // Tasks with TaskIDs in [EDF_MIN_TASKID, EDF_MAX_TASKID] run earliest deadline first...
+	init( EDF_MAX_TASKID,                                       -1 );
+	init( EDF_BAND_SIZE,                                   1000000 ); // ...within bands of this many TaskIDs
+	init( EDF_DEADLINE_PER_TASKID,                            1e-6 ); // A task's deadline is this much later per TaskID it is below the top of its band
 
 	//Network
 	init( PACKET_LIMIT,                                  100LL<<20 );
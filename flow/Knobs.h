@@ -62,8 +62,16 @@ public:
 
 	int RANDOMSEED_RETRY_LIMIT;
 	double FAST_ALLOC_LOGGING_BYTES;
+	int64_t FAST_ALLOC_IDLE_MAGAZINE_BYTES;
+	int FAST_ALLOC_HUGE_PAGES;
 	double HUGE_ARENA_LOGGING_BYTES;
 	double HUGE_ARENA_LOGGING_INTERVAL;
+	int64_t ARENA_FREE_BYTES_PER_TASK;
+	int64_t SCRATCH_ARENA_BYTES;
+	int64_t SCRATCH_ARENA_MAX_BYTES;
+	int64_t HEAP_PROFILER_SAMPLE_BYTES;
+	double HEAP_PROFILER_INTERVAL;
+	int HEAP_PROFILER_MAX_STACK_DEPTH;
 
 	//slow task profiling
 	double SLOWTASK_PROFILING_INTERVAL;
@@ -115,14 +123,43 @@ public:
 	//IAsyncFile
 	int64_t INCREMENTAL_DELETE_TRUNCATE_AMOUNT;
 	double INCREMENTAL_DELETE_INTERVAL;
+	int FILE_IO_THREADS;
 
 	//Net2
 	double MIN_COALESCE_DELAY;
 	double MAX_COALESCE_DELAY;
+	int COALESCE_FLUSH_BYTES;
+	double DELAY_SLACK;
+	double MIN_COALESCED_DELAY;
 	double SLOW_LOOP_CUTOFF;
 	double SLOW_LOOP_SAMPLING_RATE;
+	int FLIGHT_RECORDER_TASKS;
+	int FLIGHT_RECORDER_SIGNAL;
 	int64_t TSC_YIELD_TIME;
+	int TSC_CLOCK;
+	double TSC_CALIBRATION_INTERVAL;
+	int64_t THREAD_READY_TSC_INTERVAL;
+	int64_t MAX_THREAD_READY_TSC_WAIT;
+	double VIRTUAL_NETWORK_LATENCY;
+	int64_t VIRTUAL_CONNECTION_WINDOW;
 	int64_t REACTOR_FLAGS;
+	double REACTOR_SPIN_MAX;
+	double REACTOR_SPIN_QUANTILE;
+	int RUN_LOOPS;
+	int PIN_RUN_LOOPS;
+	double RUN_LOOP_METRICS_INTERVAL;
+	int REACTOR_IO_URING;
+	int IO_URING_ENTRIES;
+	int IO_URING_BUFFER_SIZE;
+	int ZERO_COPY_MIN_BYTES;
+	int SEND_ZERO_COPY;
+	double ZERO_COPY_CLOSE_TIMEOUT;
+	int RECEIVE_BUFFER_BYTES;
+	int RECEIVE_BUFFER_POOL_SIZE;
+	int EDF_MIN_TASKID;
+	int EDF_MAX_TASKID;
+	int EDF_BAND_SIZE;
+	double EDF_DEADLINE_PER_TASKID;
 
 	//Network
 	int64_t PACKET_LIMIT;
@@ -32,10 +32,25 @@
 
 #include "flow/ActorCollection.h"
 #include "flow/ThreadSafeQueue.h"
+#include "flow/TaskQueue.h"
+#include "flow/DeterministicRandom.h"
 #include "flow/ThreadHelper.actor.h"
 #include "flow/TDMetric.actor.h"
+#include "flow/IoUring.h"
+#include "flow/IAsyncFile.h"
 #include "flow/AsioReactor.h"
+#include "flow/FlightRecorder.h"
+#include "flow/TscClock.h"
 #include "flow/Profiler.h"
+#include "flow/HeapProfiler.h"
+#include "flow/UnitTest.h"
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define FLOW_HAVE_ZERO_COPY 1
+#endif
+#endif
 
 #ifdef WIN32
 #include <mmsystem.h>
@@ -102,19 +117,24 @@ namespace N2 {  // No indent, it's the whole file
 class Net2;
 class Peer;
 class Connection;
+struct DelayTimer;
 
 Net2 *g_net2 = 0;
 
 class Task {
 public:
 	virtual void operator()() = 0;
+	// For the flight recorder, before the task runs
+	virtual const std::type_info& type() { return typeid(*this); }
 };
 
 struct OrderedTask {
 	int64_t priority;
 	int taskID;
 	Task *task;
-	OrderedTask(int64_t priority, int taskID, Task* task) : priority(priority), taskID(taskID), task(task) {}
+	int64_t readyTsc;  // When it was put in the ready queue
+	double deadline;   // For tasks scheduled earliest deadline first
+	OrderedTask(int64_t priority, int taskID, Task* task) : priority(priority), taskID(taskID), task(task), readyTsc(0), deadline(0) {}
 	bool operator < (OrderedTask const& rhs) const { return priority < rhs.priority; }
 };
 
@@ -123,9 +143,10 @@ thread_local INetwork* thread_network = 0;
 class Net2 sealed : public INetwork, public INetworkConnections {
 
 public:
-	Net2(bool useThreadPool, bool useMetrics);
+	Net2(bool useThreadPool, bool useMetrics, Net2* primary = nullptr, int runLoopIndex = 0);
 	void run();
 	void initMetrics();
+	void initLoopMetrics();
 
 	// INetworkConnections interface
 	virtual Future<Reference<IConnection>> connect( NetworkAddress toAddr, std::string host );
@@ -133,13 +154,18 @@ public:
 	virtual Reference<IListener> listen( NetworkAddress localAddr );
 
 	// INetwork interface
-	virtual double now() { return currentTime; };
+	virtual double now() { return local()->currentTime; };
 	virtual Future<Void> delay( double seconds, int taskId );
 	virtual Future<class Void> yield( int taskID );
 	virtual bool check_yield(int taskId);
-	virtual int getCurrentTask() { return currentTaskID; }
-	virtual void setCurrentTask(int taskID ) { priorityMetric = currentTaskID = taskID; }
+	virtual int getCurrentTask() { return local()->currentTaskID; }
+	virtual void setCurrentTask(int taskID ) { Net2* n = local(); n->priorityMetric = n->currentTaskID = taskID; }
 	virtual void onMainThread( Promise<Void>&& signal, int taskID );
+	virtual int getRunLoopCount() { return std::max<int>(1, primary->runLoops.size()); }
+	virtual int getCurrentRunLoop() { return local()->runLoopIndex; }
+	virtual void onRunLoop( int runLoop, Promise<Void>&& signal, int taskID );
+	virtual void onAnyRunLoop( Promise<Void>&& signal, int taskID );
+	virtual bool getRunLoopMetrics( int runLoop, NetworkMetrics& metrics );
 	virtual void stop() {
 		if ( thread_network == this )
 			stopImmediately();
@@ -153,7 +179,11 @@ public:
 
 	virtual void getDiskBytes( std::string const& directory, int64_t& free, int64_t& total );
 	virtual bool isAddressOnThisHost( NetworkAddress const& addr );
-	void updateNow(){ currentTime = timer_monotonic(); }
+	void updateNow() {
+		int64_t tsc = __rdtsc();
+		tscClock.maybeRecalibrate(tsc);
+		currentTime = tscClock.time(tsc);
+	}
 
 	virtual flowGlobalType global(int id) { return (globals.size() > id) ? globals[id] : NULL; }
 	virtual void setGlobal(size_t id, flowGlobalType v) { globals.resize(std::max(globals.size(),id+1)); globals[id] = v; }
@@ -166,38 +196,90 @@ public:
 	INetworkConnections *network;  // initially this, but can be changed
 
 	int64_t tsc_begin, tsc_end;
+	TscClock tscClock;  // Times from the TSC readings taken for tsc_begin and the like
 	double taskBegin;
 	int currentTaskID;
 	uint64_t tasksIssued;
 	TDMetricCollection tdmetrics;
 	double currentTime;
-	bool stopped;
+	volatile bool stopped;
 	std::map<IPAddress, bool> addressOnHostCache;
 
 	uint64_t numYields;
+	FlightRecorder flightRecorder;
 
 	double lastPriorityTrackTime;
 	int lastMinTaskID;
 	double priorityTimer[NetworkMetrics::PRIORITY_BINS];
 
-	std::priority_queue<OrderedTask, std::vector<OrderedTask>> ready;
-	ThreadSafeQueue<OrderedTask> threadReady;
+	ReadyQueue<OrderedTask> ready;
+	struct ThreadReadyTask : OrderedTask {
+		int64_t tsc;  // When it was pushed
+		ThreadReadyTask(int64_t priority, int taskID, Task* task) : OrderedTask(priority, taskID, task), tsc(__rdtsc()) {}
+	};
+	ThreadSafeRingQueue<ThreadReadyTask> threadReady;
+	int64_t nextThreadReadyDrain;  // check_yield() drains threadReady once the TSC passes this
+	int64_t threadReadyDrainInterval;
 
 	struct DelayedTask : OrderedTask {
 		double at;
 		DelayedTask(double at, int64_t priority, int taskID, Task* task) : at(at), OrderedTask(priority, taskID, task) {}
-		bool operator < (DelayedTask const& rhs) const { return at > rhs.at; } // Ordering is reversed for priority_queue
+		int* wheelIndex() const;
 	};
-	std::priority_queue<DelayedTask, std::vector<DelayedTask>> timers;
+	TimerWheel<DelayedTask> timers;  // Of DelayTimers
+	std::unordered_map<int64_t, DelayTimer*> timerSlots;  // Coalesced DelayTimers by (slot<<TASKID_BITS) | taskID
+	double timerSlotBase;  // Slots are numbered from here, so that small DELAY_SLACKs don't overflow their keys
 
 	void checkForSlowTask(int64_t tscBegin, int64_t tscEnd, double duration, int64_t priority);
 	bool check_yield(int taskId, bool isRunLoop);
 	void processThreadReady();
+	void pushReady( OrderedTask t, double readyAt );
+	int readyKey( int taskID ) const;
 	void trackMinPriority( int minTaskID, double now );
 	void stopImmediately() {
-		stopped=true; decltype(ready) _1; ready.swap(_1); decltype(timers) _2; timers.swap(_2);
+		stopped=true; ready.clear(); timers.clear(); timerSlots.clear();
+		for(auto other : runLoops) {
+			if (other != this) {
+				other->stopped = true;
+				other->reactor.wake();
+			}
+		}
 	}
 
+	// Run loops.  With FLOW_KNOBS->RUN_LOOPS > 1, the Net2 returned by newNet2() is the primary run loop and run() starts
+	// a secondary Net2 on its own thread for each additional loop, with its own ready queue, timers and reactor.
+	// Calls made through g_network (the primary) from a secondary's thread are forwarded to that secondary by local().
+	Net2* primary;
+	int runLoopIndex;
+	std::vector<Net2*> runLoops;  // On the primary only: every run loop, starting with the primary.  Empty if there is just one.
+	std::vector<std::unique_ptr<Net2>> secondaries;  // On the primary only: owns runLoops[1..], until run() returns
+	std::vector<THREAD_HANDLE> runLoopThreads;
+	bool metricsInitialized;  // initMetrics() was called, so secondaries initialize theirs too
+
+	// A secondary's networkMetrics, copied at most every RUN_LOOP_METRICS_INTERVAL for getRunLoopMetrics()
+	ThreadSpinLock publishedMetricsLock;
+	NetworkMetrics publishedMetrics;
+	double nextMetricsPublish;
+	void publishMetrics( double now );
+	IRandom* random;  // g_nondeterministic_random on the primary; secondaries have their own
+
+	// Tasks from onAnyRunLoop().  The owning loop takes its share from the front, and idle loops steal from the back.
+	ThreadSpinLock migratableLock;
+	Deque<OrderedTask> migratable;
+	volatile int32_t migratableCount;
+	volatile int32_t idle;  // Set while this loop is (about to be) asleep with nothing to run
+
+	Net2* local() {
+		Net2* n = static_cast<Net2*>(thread_network);
+		return (n && n->primary == this) ? n : this;
+	}
+	void runLoop();
+	void startRunLoops( int count );
+	void stopRunLoops();
+	void takeMigratable();
+	bool stealMigratable();
+	THREAD_FUNC runLoopThread(void* arg);
+
 	Future<Void> timeOffsetLogger;
 	Future<Void> logTimeOffset();
 
@@ -211,6 +293,8 @@ public:
 	Int64MetricHandle countCantSleep;
 	Int64MetricHandle countWontSleep;
 	Int64MetricHandle countTimers;
+	Int64MetricHandle countTimersCoalesced;
+	Int64MetricHandle countTimersCancelled;
 	Int64MetricHandle countTasks;
 	Int64MetricHandle countYields;
 	Int64MetricHandle countYieldBigStack;
@@ -218,6 +302,15 @@ public:
 	Int64MetricHandle countYieldCallsTrue;
 	Int64MetricHandle countASIOEvents;
 	Int64MetricHandle countSlowTaskSignals;
+	Int64MetricHandle countSteals;
+	Int64MetricHandle countThreadReadyDrains;
+	Int64MetricHandle countThreadReadyTasks;
+	Int64MetricHandle threadReadyLatency;
+	Int64MetricHandle countIoUringEnters;
+	Int64MetricHandle countIoUringSubmits;
+	Int64MetricHandle countIoUringCompletions;
+	Int64MetricHandle countZeroCopySends;
+	Int64MetricHandle countZeroCopyCopied;
 	Int64MetricHandle priorityMetric;
 	BoolMetricHandle awakeMetric;
 
@@ -265,6 +358,153 @@ public:
 	}
 };
 
+#ifdef FLOW_HAVE_IO_URING
+// The io_uring side of a Connection, used when the run loop's reactor has a ring.  A receive into recvBuffer is kept in
+// flight whenever the buffer is empty, and read() copies out of it; write() copies into sendBuffer, which is sent by one
+// send at a time.  Each operation holds a reference while it is in flight, so the buffers outlive the Connection.
+// Operations are submitted once per run loop iteration.  The reactor still sleeps in epoll, which the ring wakes through
+// an eventfd, at the cost of an eventfd read per batch of completions (the echo benchmark counts them).
+class UringSocket : public ReferenceCounted<UringSocket>, NonCopyable {
+public:
+	UringSocket( IoUring* ring, int fd, int bufferSize )
+		: ring(ring), fd(fd), bufferSize(bufferSize), recvBuffer(new uint8_t[bufferSize]), sendBuffer(new uint8_t[bufferSize]),
+		  recvBegin(0), recvEnd(0), sendEnd(0), sendInFlight(0), recvInFlight(false), recvError(0), sendError(0), closed(false)
+	{
+		recvOp.self = sendOp.self = this;
+		startRecv();
+	}
+	~UringSocket() {
+		delete[] recvBuffer;
+		delete[] sendBuffer;
+	}
+
+	Future<Void> onReadable() {
+		if (recvBegin != recvEnd || recvError) return Void();
+		startRecv();
+		if (readable.isSet()) readable = Promise<Void>();
+		return readable.getFuture();
+	}
+
+	Future<Void> onWritable() {
+		if (sendEnd < bufferSize || sendError) return Void();
+		if (writable.isSet()) writable = Promise<Void>();
+		return writable.getFuture();
+	}
+
+	// Returns the number of bytes read (might be 0), or the -errno that ended the connection
+	int read( uint8_t* begin, uint8_t* end ) {
+		int size = std::min<int>( end-begin, recvEnd-recvBegin );
+		if (size) {
+			memcpy( begin, recvBuffer + recvBegin, size );
+			recvBegin += size;
+			if (recvBegin == recvEnd) {
+				recvBegin = recvEnd = 0;
+				startRecv();
+			}
+			return size;
+		}
+		return recvError;
+	}
+
+	// Returns the number of bytes buffered for sending (might be 0), or the -errno that ended the connection
+	int write( SendBuffer const* data, int limit ) {
+		if (sendError) return sendError;
+		int size = 0;
+		for(auto p = data; p && size < limit && sendEnd < bufferSize; p = p->next) {
+			int n = std::min( { p->bytes_written - p->bytes_sent, limit - size, bufferSize - sendEnd } );
+			memcpy( sendBuffer + sendEnd, p->data + p->bytes_sent, n );
+			sendEnd += n;
+			size += n;
+		}
+		startSend();
+		return size;
+	}
+
+	void close() {
+		if (closed) return;
+		closed = true;
+		// Queued operations name the fd, so they have to reach the kernel before it can be closed and reused.  Shutting
+		// the socket down then completes everything in flight.
+		ring->submit();
+		::shutdown( fd, SHUT_RDWR );
+	}
+
+private:
+	struct RecvOp : IoUring::Completion {
+		UringSocket* self;
+		virtual void complete( int result ) { self->onRecv( result ); }
+	};
+	struct SendOp : IoUring::Completion {
+		UringSocket* self;
+		virtual void complete( int result ) { self->onSend( result ); }
+	};
+
+	IoUring* ring;
+	int fd;
+	int bufferSize;
+	uint8_t* recvBuffer;
+	uint8_t* sendBuffer;
+	int recvBegin, recvEnd;  // Received data not yet read
+	int sendEnd;             // Bytes buffered for sending, starting with the sendInFlight bytes of the current send
+	int sendInFlight;
+	bool recvInFlight;
+	int recvError, sendError;
+	bool closed;
+	Promise<Void> readable, writable;
+	RecvOp recvOp;
+	SendOp sendOp;
+
+	void startRecv() {
+		if (recvInFlight || recvEnd || recvError || closed) return;
+		io_uring_sqe* sqe = ring->prepare( &recvOp );
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)recvBuffer;
+		sqe->len = bufferSize;
+		recvInFlight = true;
+		addref();
+	}
+
+	void startSend() {
+		if (sendInFlight || !sendEnd || sendError || closed) return;
+		io_uring_sqe* sqe = ring->prepare( &sendOp );
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)sendBuffer;
+		sqe->len = sendEnd;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sendInFlight = sendEnd;
+		addref();
+	}
+
+	void onRecv( int result ) {
+		recvInFlight = false;
+		if (result > 0)
+			recvEnd = result;
+		else if (result == -EAGAIN || result == -EINTR)
+			startRecv();
+		else
+			recvError = result ? result : -ECONNRESET;  // Like asio's eof error, end of file fails the connection
+		if (!readable.isSet() && (recvEnd || recvError)) readable.send( Void() );
+		delref();
+	}
+
+	void onSend( int result ) {
+		sendInFlight = 0;
+		if (result > 0) {
+			sendEnd -= result;
+			memmove( sendBuffer, sendBuffer + result, sendEnd );
+			startSend();
+		} else if (result == -EAGAIN || result == -EINTR)
+			startSend();
+		else
+			sendError = result ? result : -EPIPE;
+		if (!writable.isSet() && (sendEnd < bufferSize || sendError)) writable.send( Void() );
+		delref();
+	}
+};
+#endif
+
 class Connection : public IConnection, ReferenceCounted<Connection> {
 public:
 	virtual void addref() { ReferenceCounted<Connection>::addref(); }
@@ -276,8 +516,19 @@ public:
 
 	explicit Connection( boost::asio::io_service& io_service )
 		: id(g_nondeterministic_random->randomUniqueID()), socket(io_service)
+#ifdef FLOW_HAVE_ZERO_COPY
+		  , zeroCopy(false), zeroCopyReaping(false), zeroCopyClosing(false), zeroCopyFirst(0)
+#endif
 	{
 	}
+	~Connection() {
+#ifdef FLOW_HAVE_IO_URING
+		if (uring) uring->close();
+#endif
+#ifdef FLOW_HAVE_ZERO_COPY
+		releaseZeroCopy();
+#endif
+	}
 
 	// This is not part of the IConnection interface, because it is wrapped by INetwork::connect()
 	ACTOR static Future<Reference<IConnection>> connect( boost::asio::io_service* ios, NetworkAddress addr ) {
@@ -308,7 +559,10 @@ public:
 
 	// returns when write() can write at least one byte
 	virtual Future<Void> onWritable() {
-		++g_net2->countWriteProbes;
+		++g_net2->local()->countWriteProbes;
+#ifdef FLOW_HAVE_IO_URING
+		if (uring) return uring->onWritable();
+#endif
 		BindPromise p("N2_WriteProbeError", id);
 		auto f = p.getFuture();
 		socket.async_write_some( boost::asio::null_buffers(), std::move(p) );
@@ -317,7 +571,10 @@ public:
 
 	// returns when read() can read at least one byte
 	virtual Future<Void> onReadable() {
-		++g_net2->countReadProbes;
+		++g_net2->local()->countReadProbes;
+#ifdef FLOW_HAVE_IO_URING
+		if (uring) return uring->onReadable();
+#endif
 		BindPromise p("N2_ReadProbeError", id);
 		auto f = p.getFuture();
 		socket.async_read_some( boost::asio::null_buffers(), std::move(p) );
@@ -327,14 +584,26 @@ public:
 	// Reads as many bytes as possible from the read buffer into [begin,end) and returns the number of bytes read (might be 0)
 	virtual int read( uint8_t* begin, uint8_t* end ) {
 		boost::system::error_code err;
-		++g_net2->countReads;
+		++g_net2->local()->countReads;
+#ifdef FLOW_HAVE_IO_URING
+		if (uring) {
+			int size = uring->read( begin, end );
+			if (size < 0) {
+				onUringError( "N2_ReadError", size );
+				throw connection_failed();
+			}
+			if (!size) ++g_net2->local()->countWouldBlock;
+			g_net2->local()->bytesReceived += size;
+			return size;
+		}
+#endif
 		size_t toRead = end-begin;
 		size_t size = socket.read_some( boost::asio::mutable_buffers_1(begin, toRead), err );
-		g_net2->bytesReceived += size;
+		g_net2->local()->bytesReceived += size;
 		//TraceEvent("ConnRead", this->id).detail("Bytes", size);
 		if (err) {
 			if (err == boost::asio::error::would_block) {
-				++g_net2->countWouldBlock;
+				++g_net2->local()->countWouldBlock;
 				return 0;
 			}
 			onReadError(err);
@@ -348,7 +617,37 @@ public:
 	// Writes as many bytes as possible from the given SendBuffer chain into the write buffer and returns the number of bytes written (might be 0)
 	virtual int write( SendBuffer const* data, int limit ) {
 		boost::system::error_code err;
-		++g_net2->countWrites;
+		++g_net2->local()->countWrites;
+#ifdef FLOW_HAVE_IO_URING
+		if (uring) {
+			ASSERT( limit > 0 );
+			int sent = uring->write( data, limit );
+			if (sent < 0) {
+				onUringError( "N2_WriteError", sent );
+				throw connection_failed();
+			}
+			if (!sent) ++g_net2->local()->countWouldBlock;
+			return sent;
+		}
+#endif
+#ifdef FLOW_HAVE_ZERO_COPY
+		if (zeroCopy) {
+			// External buffers are sent by themselves with MSG_ZEROCOPY, and the buffers between them as usual
+			reapZeroCopy();
+			while (data->bytes_sent == data->bytes_written && data->next)
+				data = data->next;
+			if (data->external)
+				return writeZeroCopy( data, limit );
+			int copied = 0;
+			for(auto p = data; p && copied < limit; p = p->next) {
+				if (p->external) {
+					limit = copied;
+					break;
+				}
+				copied += p->bytes_written - p->bytes_sent;
+			}
+		}
+#endif
 
 		size_t sent = socket.write_some( boost::iterator_range<SendBufferIterator>(SendBufferIterator(data, limit), SendBufferIterator()), err );
 
@@ -364,7 +663,7 @@ public:
 			ASSERT(notEmpty);
 
 			if (err == boost::asio::error::would_block) {
-				++g_net2->countWouldBlock;
+				++g_net2->local()->countWouldBlock;
 				return 0;
 			}
 			onWriteError(err);
@@ -379,11 +678,35 @@ public:
 
 	virtual UID getDebugID() { return id; }
 
+	virtual int getReceiveBufferSize() {
+		boost::system::error_code err;
+		boost::asio::socket_base::receive_buffer_size option;
+		socket.get_option(option, err);
+		return err ? 0 : option.value();
+	}
+
 	tcp::socket& getSocket() { return socket; }
 private:
 	UID id;
 	tcp::socket socket;
 	NetworkAddress peer_address;
+#ifdef FLOW_HAVE_IO_URING
+	Reference<UringSocket> uring;
+#endif
+#ifdef FLOW_HAVE_ZERO_COPY
+	// MSG_ZEROCOPY sends whose pages the kernel may still be reading, in the order the kernel numbers them starting
+	// from zeroCopyFirst.  Each holds a reference to its external PacketBuffer, and so to the Arena owning the pages.
+	struct ZeroCopySend {
+		PacketBuffer* buffer;
+		bool done;
+	};
+	bool zeroCopy;  // SO_ZEROCOPY is set on the socket
+	bool zeroCopyReaping;  // waitForZeroCopy() is running, and holds a reference to this
+	bool zeroCopyClosing;  // closeSocket() was called with sends pending, so waitForZeroCopy() closes the socket
+	Promise<Void> zeroCopyClose;  // Sent when zeroCopyClosing is set
+	Deque<ZeroCopySend> zeroCopyPending;
+	uint32_t zeroCopyFirst;
+#endif
 
 	struct SendBufferIterator {
 		typedef boost::asio::const_buffer value_type;
@@ -416,11 +739,40 @@ private:
 
 	void init() {
 		// Socket settings that have to be set after connect or accept succeeds
-		socket.non_blocking(true);
+		bool nonBlocking = true;
+#ifdef FLOW_HAVE_IO_URING
+		IoUring* ring = g_net2->local()->reactor.ring;
+		if (ring) {
+			uring = Reference<UringSocket>( new UringSocket( ring, socket.native_handle(), FLOW_KNOBS->IO_URING_BUFFER_SIZE ) );
+			nonBlocking = false;  // io_uring polls for readiness itself, but could return EAGAIN for a non-blocking socket
+		}
+#endif
+		socket.non_blocking(nonBlocking);
 		socket.set_option(boost::asio::ip::tcp::no_delay(true));
+#ifdef FLOW_HAVE_ZERO_COPY
+		int one = 1;
+		zeroCopy = FLOW_KNOBS->SEND_ZERO_COPY && nonBlocking && setsockopt( socket.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one) ) == 0;
+#endif
 	}
 
 	void closeSocket() {
+#ifdef FLOW_HAVE_IO_URING
+		if (uring) uring->close();
+#endif
+#ifdef FLOW_HAVE_ZERO_COPY
+		if (!zeroCopyPending.empty() && socket.is_open()) {
+			// The kernel may still be reading the pages of pending sends, so the socket is only shut down here, and
+			// waitForZeroCopy() closes it once they complete
+			boost::system::error_code error;
+			socket.shutdown(tcp::socket::shutdown_both, error);
+			if (!zeroCopyClosing) {
+				zeroCopyClosing = true;
+				zeroCopyClose.send( Void() );
+			}
+			return;
+		}
+		releaseZeroCopy();
+#endif
 		boost::system::error_code error;
 		socket.close(error);
 		if (error)
@@ -435,6 +787,114 @@ private:
 		TraceEvent(SevWarn, "N2_WriteError", id).suppressFor(1.0).detail("Message", error.value());
 		closeSocket();
 	}
+#ifdef FLOW_HAVE_ZERO_COPY
+	int writeZeroCopy( SendBuffer const* data, int limit ) {
+		int size = std::min( limit, data->bytes_written - data->bytes_sent );
+		ssize_t sent = ::send( socket.native_handle(), data->data + data->bytes_sent, size, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL );
+		if (sent < 0 && errno == ENOBUFS) {
+			// Out of the socket's option memory for pinning pages; copying works regardless
+			sent = ::send( socket.native_handle(), data->data + data->bytes_sent, size, MSG_DONTWAIT | MSG_NOSIGNAL );
+			if (sent >= 0) return sent;
+		}
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				++g_net2->local()->countWouldBlock;
+				return 0;
+			}
+			onWriteError( boost::system::error_code( errno, boost::system::system_category() ) );
+			throw connection_failed();
+		}
+
+		PacketBuffer* buffer = const_cast<PacketBuffer*>( static_cast<PacketBuffer const*>(data) );
+		buffer->addref();
+		zeroCopyPending.push_back( ZeroCopySend{ buffer, false } );
+		++g_net2->local()->countZeroCopySends;
+		if (!zeroCopyReaping)
+			waitForZeroCopy( Reference<Connection>::addRef(this) );
+		return sent;
+	}
+
+	// Releases the buffers of the sends the kernel has reported complete on the socket's error queue
+	void reapZeroCopy() {
+		while (!zeroCopyPending.empty()) {
+			char control[128];
+			msghdr msg = {};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg( socket.native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) < 0)
+				break;
+
+			for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+					continue;
+				sock_extended_err* err = (sock_extended_err*)CMSG_DATA(cm);
+				if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+					continue;
+				// The kernel reports the inclusive range [ee_info, ee_data] of completed sends
+				if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					++g_net2->local()->countZeroCopyCopied;
+				for(uint32_t i = err->ee_info - zeroCopyFirst; i <= err->ee_data - zeroCopyFirst; i++) {
+					ASSERT( i < zeroCopyPending.size() );
+					zeroCopyPending[i].done = true;
+				}
+			}
+
+			while (!zeroCopyPending.empty() && zeroCopyPending.front().done) {
+				zeroCopyPending.front().buffer->delref();
+				zeroCopyPending.pop_front();
+				zeroCopyFirst++;
+			}
+		}
+	}
+
+	// Reaps completions while sends are pending, keeping the Connection and so their buffers alive.  After
+	// closeSocket(), waits at most ZERO_COPY_CLOSE_TIMEOUT for the rest before closing the socket.
+	ACTOR static void waitForZeroCopy( Reference<Connection> self ) {
+		state Future<Void> onError;
+		state Future<Void> closeTimeout;
+		self->zeroCopyReaping = true;
+		try {
+			loop {
+				self->reapZeroCopy();
+				if (self->zeroCopyPending.empty()) break;
+
+				BindPromise p("N2_ZeroCopyWaitError", self->id);
+				onError = p.getFuture();
+				self->socket.async_wait( tcp::socket::wait_error, std::move(p) );
+				choose {
+					when( wait( onError ) ) {}
+					when( wait( self->zeroCopyClosing ? Never() : self->zeroCopyClose.getFuture() ) ) {}
+					when( wait( closeTimeout.isValid() ? closeTimeout : Never() ) ) {
+						TraceEvent(SevWarnAlways, "N2_ZeroCopyCloseTimeout", self->id).suppressFor(1.0).detail("PendingSends", self->zeroCopyPending.size());
+						break;
+					}
+				}
+				if (self->zeroCopyClosing && !closeTimeout.isValid())
+					closeTimeout = delay( FLOW_KNOBS->ZERO_COPY_CLOSE_TIMEOUT );
+			}
+		} catch (Error&) {
+			// The socket failed, so no more completions will be reported
+			self->releaseZeroCopy();
+		}
+		self->zeroCopyReaping = false;
+		if (self->zeroCopyClosing) {
+			self->releaseZeroCopy();
+			self->closeSocket();
+		}
+	}
+
+	void releaseZeroCopy() {
+		for(int i = 0; i < zeroCopyPending.size(); i++)
+			zeroCopyPending[i].buffer->delref();
+		zeroCopyPending.clear();
+	}
+#endif
+#ifdef FLOW_HAVE_IO_URING
+	void onUringError( const char* context, int error ) {
+		TraceEvent(SevWarn, context, id).suppressFor(1.0).detail("Message", -error);
+		closeSocket();
+	}
+#endif
 };
 
 class Listener : public IListener, ReferenceCounted<Listener> {
@@ -487,9 +947,57 @@ struct PromiseTask : public Task, public FastAllocated<PromiseTask> {
 		promise.send(Void());
 		delete this;
 	}
+	virtual const std::type_info& type() {
+		Callback<Void>* waiter = promise.getFirstCallback();
+		return waiter ? typeid(*waiter) : typeid(*this);
+	}
 };
 
-Net2::Net2(bool useThreadPool, bool useMetrics)
+// The timer for delay(), which is also the SAV of the Futures it returns, so a delay is one allocation.  Net2 holds
+// its promise reference.  Dropping every Future (e.g. a timeout() that lost its race) cancels it in O(1): it is
+// taken out of the timer wheel and timerSlots and freed at once.
+struct DelayTimer : SAV<Void>, Task, FastAllocated<DelayTimer> {
+	using FastAllocated<DelayTimer>::operator new;
+	using FastAllocated<DelayTimer>::operator delete;
+
+	Net2* net;
+	double at;
+	int64_t slot;  // Its key in Net2::timerSlots, or -1 if it is not shared
+	int wheelIndex;  // Kept by Net2::timers; -1 once it has expired
+
+	DelayTimer( Net2* net, double at, int64_t slot ) : SAV<Void>(0, 1), net(net), at(at), slot(slot), wheelIndex(-1) {}
+
+	Future<Void> getFuture() {
+		addFutureRef();
+		return Future<Void>( this );
+	}
+
+	virtual void operator()() {
+		// A shared timer's waiters all run in this task; wake them in the order they waited, as separate delays would
+		if (slot >= 0)
+			reverseCallbacks();
+		sendAndDelPromiseRef( Void() );
+	}
+	virtual const std::type_info& type() {
+		::Callback<Void>* waiter = getFirstCallback();
+		return waiter ? typeid(*waiter) : typeid(*this);
+	}
+	virtual void destroy() { delete this; }
+	virtual void cancel() {
+		// Only once the last Future is dropped, since other holders may still be waiting.  Once it has expired it is
+		// in the ready queue, which runs and frees it.
+		if (wheelIndex < 0 || getFutureReferenceCount() > 0) return;
+		if (slot >= 0)
+			net->timerSlots.erase( slot );
+		net->timers.remove( Net2::DelayedTask( at, 0, 0, this ) );
+		++net->countTimersCancelled;
+		delPromiseRef();
+	}
+};
+
+int* Net2::DelayedTask::wheelIndex() const { return &static_cast<DelayTimer*>(task)->wheelIndex; }
+
+Net2::Net2(bool useThreadPool, bool useMetrics, Net2* primary, int runLoopIndex)
 	: useThreadPool(useThreadPool),
 	  network(this),
 	  reactor(this),
@@ -498,9 +1006,28 @@ Net2::Net2(bool useThreadPool, bool useMetrics)
 	  // Until run() is called, yield() will always yield
 	  tsc_begin(0), tsc_end(0), taskBegin(0), currentTaskID(TaskDefaultYield),
 	  lastMinTaskID(0),
-	  numYields(0)
+	  numYields(0),
+	  flightRecorder(FLOW_KNOBS->FLIGHT_RECORDER_TASKS),
+	  primary(primary ? primary : this),
+	  runLoopIndex(runLoopIndex),
+	  metricsInitialized(false),
+	  nextMetricsPublish(0),
+	  random(nullptr),
+	  migratableCount(0),
+	  idle(0),
+	  nextThreadReadyDrain(0),
+	  threadReadyDrainInterval(FLOW_KNOBS->THREAD_READY_TSC_INTERVAL)
 {
+	if (primary) {
+		// Secondary run loops share the primary's globals
+		updateNow();
+		timerSlotBase = currentTime;
+		return;
+	}
+
 	TraceEvent("Net2Starting");
+	if (FLOW_KNOBS->FLIGHT_RECORDER_SIGNAL > 0)
+		FlightRecorder::installSignalHandler( FLOW_KNOBS->FLIGHT_RECORDER_SIGNAL );
 
 	// Set the global members
 	if(useMetrics) {
@@ -513,6 +1040,11 @@ Net2::Net2(bool useThreadPool, bool useMetrics)
 #ifdef __linux__
 	setGlobal(INetwork::enEventFD, (flowGlobalType) N2::ASIOReactor::newEventFD(reactor));
 #endif
+#ifdef FLOW_HAVE_IO_URING
+	if (reactor.ring)
+		setGlobal(INetwork::enIoUring, (flowGlobalType) reactor.ring);
+#endif
+	setGlobal(INetwork::enFileSystem, (flowGlobalType) newNet2FileSystem(this));
 
 
 	int priBins[] = { 1, 2050, 3050, 4050, 4950, 5050, 7050, 8050, 10050 };
@@ -520,6 +1052,7 @@ Net2::Net2(bool useThreadPool, bool useMetrics)
 	for(int i=0; i<NetworkMetrics::PRIORITY_BINS; i++)
 		networkMetrics.priorityBins[i] = priBins[i];
 	updateNow();
+	timerSlotBase = currentTime;
 
 }
 
@@ -533,26 +1066,48 @@ ACTOR Future<Void> Net2::logTimeOffset() {
 }
 
 void Net2::initMetrics() {
-	bytesReceived.init(LiteralStringRef("Net2.BytesReceived"));
-	countWriteProbes.init(LiteralStringRef("Net2.CountWriteProbes"));
-	countReadProbes.init(LiteralStringRef("Net2.CountReadProbes"));
-	countReads.init(LiteralStringRef("Net2.CountReads"));
-	countWouldBlock.init(LiteralStringRef("Net2.CountWouldBlock"));
-	countWrites.init(LiteralStringRef("Net2.CountWrites"));
-	countRunLoop.init(LiteralStringRef("Net2.CountRunLoop"));
-	countCantSleep.init(LiteralStringRef("Net2.CountCantSleep"));
-	countWontSleep.init(LiteralStringRef("Net2.CountWontSleep"));
-	countTimers.init(LiteralStringRef("Net2.CountTimers"));
-	countTasks.init(LiteralStringRef("Net2.CountTasks"));
-	countYields.init(LiteralStringRef("Net2.CountYields"));
-	countYieldBigStack.init(LiteralStringRef("Net2.CountYieldBigStack"));
-	countYieldCalls.init(LiteralStringRef("Net2.CountYieldCalls"));
-	countASIOEvents.init(LiteralStringRef("Net2.CountASIOEvents"));
-	countYieldCallsTrue.init(LiteralStringRef("Net2.CountYieldCallsTrue"));
-	countSlowTaskSignals.init(LiteralStringRef("Net2.CountSlowTaskSignals"));
-	priorityMetric.init(LiteralStringRef("Net2.Priority"));
-	awakeMetric.init(LiteralStringRef("Net2.Awake"));
-	slowTaskMetric.init(LiteralStringRef("Net2.SlowTask"));
+	metricsInitialized = true;
+	initLoopMetrics();
+	// Secondary run loops initialize theirs as run() starts them, before their threads can use them
+	if (secondaries.size())
+		TraceEvent(SevWarnAlways, "Net2MetricsInitializedLate").detail("RunLoops", runLoops.size());
+}
+
+void Net2::initLoopMetrics() {
+	// A secondary run loop's metrics have the primary's names, with its index as their ID
+	std::string runLoop = runLoopIndex ? format("%d", runLoopIndex) : std::string();
+	StringRef id( runLoop );
+	bytesReceived.init(LiteralStringRef("Net2.BytesReceived"), id);
+	countWriteProbes.init(LiteralStringRef("Net2.CountWriteProbes"), id);
+	countReadProbes.init(LiteralStringRef("Net2.CountReadProbes"), id);
+	countReads.init(LiteralStringRef("Net2.CountReads"), id);
+	countWouldBlock.init(LiteralStringRef("Net2.CountWouldBlock"), id);
+	countWrites.init(LiteralStringRef("Net2.CountWrites"), id);
+	countRunLoop.init(LiteralStringRef("Net2.CountRunLoop"), id);
+	countCantSleep.init(LiteralStringRef("Net2.CountCantSleep"), id);
+	countWontSleep.init(LiteralStringRef("Net2.CountWontSleep"), id);
+	countTimers.init(LiteralStringRef("Net2.CountTimers"), id);
+	countTimersCoalesced.init(LiteralStringRef("Net2.CountTimersCoalesced"), id);
+	countTimersCancelled.init(LiteralStringRef("Net2.CountTimersCancelled"), id);
+	countTasks.init(LiteralStringRef("Net2.CountTasks"), id);
+	countYields.init(LiteralStringRef("Net2.CountYields"), id);
+	countYieldBigStack.init(LiteralStringRef("Net2.CountYieldBigStack"), id);
+	countYieldCalls.init(LiteralStringRef("Net2.CountYieldCalls"), id);
+	countASIOEvents.init(LiteralStringRef("Net2.CountASIOEvents"), id);
+	countYieldCallsTrue.init(LiteralStringRef("Net2.CountYieldCallsTrue"), id);
+	countSlowTaskSignals.init(LiteralStringRef("Net2.CountSlowTaskSignals"), id);
+	countSteals.init(LiteralStringRef("Net2.CountSteals"), id);
+	countThreadReadyDrains.init(LiteralStringRef("Net2.CountThreadReadyDrains"), id);
+	countThreadReadyTasks.init(LiteralStringRef("Net2.CountThreadReadyTasks"), id);
+	threadReadyLatency.init(LiteralStringRef("Net2.ThreadReadyLatencyClocks"), id);
+	countIoUringEnters.init(LiteralStringRef("Net2.CountIoUringEnters"), id);
+	countIoUringSubmits.init(LiteralStringRef("Net2.CountIoUringSubmits"), id);
+	countIoUringCompletions.init(LiteralStringRef("Net2.CountIoUringCompletions"), id);
+	countZeroCopySends.init(LiteralStringRef("Net2.CountZeroCopySends"), id);
+	countZeroCopyCopied.init(LiteralStringRef("Net2.CountZeroCopyCopied"), id);
+	priorityMetric.init(LiteralStringRef("Net2.Priority"), id);
+	awakeMetric.init(LiteralStringRef("Net2.Awake"), id);
+	slowTaskMetric.init(LiteralStringRef("Net2.SlowTask"), id);
 }
 
 void Net2::run() {
@@ -560,6 +1115,7 @@ void Net2::run() {
 	TraceEvent("Net2Running");
 
 	thread_network = this;
+	g_arenaFreeIncrementally = FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK > 0;
 
 #ifdef WIN32
 	if (timeBeginPeriod(1) != TIMERR_NOERROR)
@@ -572,23 +1128,111 @@ void Net2::run() {
 		// The empty string check is to allow running `FLOW_PROFILER_ENABLED= ./fdbserver` to force disabling flow profiling at startup.
 		startProfiling(this);
 	}
+	const char *heap_profiler_enabled = getenv("FLOW_HEAP_PROFILER_ENABLED");
+	if (heap_profiler_enabled != nullptr && *heap_profiler_enabled != '\0') {
+		startHeapProfiling();
+	}
+
+	random = g_nondeterministic_random;
+	startRunLoops( FLOW_KNOBS->RUN_LOOPS );
+
+	runLoop();
+	// No task will run to free arenas later, so free them at once from now on
+	g_arenaFreeIncrementally = false;
+
+	stopRunLoops();
+	shutdownNet2FileSystem(this);
+
+	#ifdef WIN32
+	timeEndPeriod(1);
+	#endif
+}
+
+// Called by run(), or by a task on the primary while it runs alone (as the runLoops test does).  Other threads read
+// runLoops without a lock, so it must not change while any of them could be calling onAnyRunLoop().
+void Net2::startRunLoops( int count ) {
+	ASSERT( primary == this && runLoops.empty() );
+	if (FLOW_KNOBS->PIN_RUN_LOOPS)
+		setAffinity(0);
+#if !FLOW_ARENA_THREAD_SAFE
+	// Tasks steal between run loops along with the arenas they hold, which non-atomic reference counts do not allow
+	if (count > 1) {
+		TraceEvent(SevWarnAlways, "Net2RunLoopsUnsupported").detail("RunLoops", count).detail("Reason", "FLOW_ARENA_THREAD_SAFE is off");
+		count = 1;
+	}
+#endif
+	if (count <= 1)
+		return;
+
+	runLoops.push_back(this);
+	for(int i = 1; i < count; i++) {
+		secondaries.emplace_back( new Net2(false, false, this, i) );
+		Net2* secondary = secondaries.back().get();
+		secondary->random = new DeterministicRandom(g_nondeterministic_random->randomInt(0, 1<<30));
+		if (metricsInitialized)
+			secondary->initLoopMetrics();
+		runLoops.push_back(secondary);
+	}
+	// Every loop must be in runLoops before any of them starts stealing
+	for(int i = 1; i < runLoops.size(); i++)
+		runLoopThreads.push_back( ::startThread(&Net2::runLoopThread, runLoops[i]) );
+	TraceEvent("Net2RunLoopsStarted").detail("RunLoops", runLoops.size()).detail("Pinned", FLOW_KNOBS->PIN_RUN_LOOPS);
+}
+
+void Net2::stopRunLoops() {
+	for(auto& secondary : secondaries) {
+		secondary->stopped = true;
+		secondary->reactor.wake();
+	}
+	for(auto thread : runLoopThreads)
+		waitThread(thread);
+	// The secondaries have stopped, so free them and go back to a single run loop
+	for(auto& secondary : secondaries)
+		delete secondary->random;
+	secondaries.clear();
+	runLoops.clear();
+	runLoopThreads.clear();
+}
+
+THREAD_FUNC_RETURN Net2::runLoopThread(void* arg) {
+	Net2* self = (Net2*)arg;
+	if (FLOW_KNOBS->PIN_RUN_LOOPS)
+		setAffinity(self->runLoopIndex);
+	thread_network = self;
+	g_arenaFreeIncrementally = FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK > 0;
+	self->runLoop();
+	g_arenaFreeIncrementally = false;
+	self->publishMetrics( self->currentTime );
+	self->ready.clear();
+	self->timers.clear();
+	self->timerSlots.clear();
+	THREAD_RETURN;
+}
+
+void Net2::runLoop() {
+	bool isPrimary = primary == this;
 
 	// Get the address to the launch function
 	typedef void (*runCycleFuncPtr)();
-	runCycleFuncPtr runFunc = reinterpret_cast<runCycleFuncPtr>(reinterpret_cast<flowGlobalType>(g_network->global(INetwork::enRunCycleFunc)));
+	runCycleFuncPtr runFunc = isPrimary ? reinterpret_cast<runCycleFuncPtr>(reinterpret_cast<flowGlobalType>(g_network->global(INetwork::enRunCycleFunc))) : nullptr;
 
-	double nnow = timer_monotonic();
+	double nnow = tscClock.now();
+	resetScratchArena();
 
 	while(!stopped) {
 		++countRunLoop;
+		if (flightRecorder.dumpRequested()) flightRecorder.dump("Signal");
 
 		if (runFunc) {
 			tsc_begin = __rdtsc();
-			taskBegin = timer_monotonic();
+			taskBegin = tscClock.time(tsc_begin);
 			runFunc();
-			checkForSlowTask(tsc_begin, __rdtsc(), timer_monotonic() - taskBegin, TaskRunCycleFunction);
+			int64_t tsc = __rdtsc();
+			checkForSlowTask(tsc_begin, tsc, tscClock.time(tsc) - taskBegin, TaskRunCycleFunction);
 		}
 
+		// Only the primary's thread changes runLoops, and only while the secondaries aren't running
+		bool isGroup = primary->runLoops.size() > 1;
 		double sleepTime = 0;
 		bool b = ready.empty();
 		if (b) {
@@ -596,10 +1240,19 @@ void Net2::run() {
 			if (!b) ++countCantSleep;
 		} else
 			++countWontSleep;
+		if (b && isGroup) {
+			// Advertise idleness before looking for migratable work, so that a concurrent onAnyRunLoop() either
+			// sees this loop as idle and wakes it, or its task is found here
+			interlockedCompareExchange(&idle, 1, 0);
+			if (migratableCount || stealMigratable()) {
+				idle = 0;
+				b = false;
+			}
+		}
 		if (b) {
 			sleepTime = 1e99;
 			if (!timers.empty())
-				sleepTime = timers.top().at - timer_monotonic();  // + 500e-6?
+				sleepTime = timers.nextExpiry() - tscClock.now();  // + 500e-6?
 		}
 
 		awakeMetric = false;
@@ -607,27 +1260,32 @@ void Net2::run() {
 			priorityMetric = 0;
 		reactor.sleepAndReact(sleepTime);
 		awakeMetric = true;
+		idle = 0;
 
 		updateNow();
 		double now = this->currentTime;
 
-		if ((now-nnow) > FLOW_KNOBS->SLOW_LOOP_CUTOFF && g_nondeterministic_random->random01() < (now-nnow)*FLOW_KNOBS->SLOW_LOOP_SAMPLING_RATE)
+		if ((now-nnow) > FLOW_KNOBS->SLOW_LOOP_CUTOFF && random->random01() < (now-nnow)*FLOW_KNOBS->SLOW_LOOP_SAMPLING_RATE)
 			TraceEvent("SomewhatSlowRunLoopTop").detail("Elapsed", now - nnow);
 
 		if (sleepTime) trackMinPriority( 0, now );
-		while (!timers.empty() && timers.top().at < now) {
+		timers.expire( now, [this](DelayedTask const& t) {
+			DelayTimer* timer = static_cast<DelayTimer*>(t.task);
+			if (timer->slot >= 0)
+				timerSlots.erase( timer->slot );
 			++countTimers;
-			ready.push( timers.top() );
-			timers.pop();
-		}
+			pushReady( t, t.at );
+		} );
 
 		processThreadReady();
+		if (isGroup) takeMigratable();
 
 		tsc_begin = __rdtsc();
 		tsc_end = tsc_begin + FLOW_KNOBS->TSC_YIELD_TIME;
-		taskBegin = timer_monotonic();
+		taskBegin = tscClock.time(tsc_begin);
 		numYields = 0;
 		int minTaskID = TaskMaxPriority;
+		int64_t taskTsc = tsc_begin;
 
 		while (!ready.empty()) {
 			++countTasks;
@@ -635,7 +1293,11 @@ void Net2::run() {
 			priorityMetric = currentTaskID;
 			minTaskID = std::min(minTaskID, currentTaskID);
 			Task* task = ready.top().task;
+			int taskID = currentTaskID;
+			int64_t readyTsc = ready.top().readyTsc;
 			ready.pop();
+			uint64_t yields = numYields;
+			const std::type_info* type = flightRecorder.enabled() ? &task->type() : NULL;
 
 			try {
 				(*task)();
@@ -645,13 +1307,20 @@ void Net2::run() {
 				TraceEvent(SevError, "TaskError").error(unknown_error());
 			}
 
+			int64_t tsc = __rdtsc();
+			networkMetrics.countTask( taskID, tsc - taskTsc, taskTsc - readyTsc );
+			if (type) flightRecorder.record( taskID, task, type, taskTsc, tsc - taskTsc, numYields - yields );
+			taskTsc = tsc;
+
 			if (check_yield(TaskMaxPriority, true)) { ++countYields; break; }
 		}
 
-		nnow = timer_monotonic();
+		resetScratchArena();
+		nnow = tscClock.now();
+		if (!isPrimary && nnow >= nextMetricsPublish) publishMetrics( nnow );
 
 #if defined(__linux__)
-		if(FLOW_KNOBS->SLOWTASK_PROFILING_INTERVAL > 0) {
+		if(FLOW_KNOBS->SLOWTASK_PROFILING_INTERVAL > 0 && isPrimary) {
 			sigset_t orig_set;
 			pthread_sigmask(SIG_BLOCK, &sigprof_set, &orig_set);
 
@@ -686,6 +1355,7 @@ void Net2::run() {
 					TraceEvent(SevWarn, "Net2SlowTaskTrace").detailf("TraceTime", "%.6f", ps->timestamp).detail("Trace", platform::format_backtrace(ps->frames, ps->length));
 					iter_offset += ps->length + 2;
 				}
+				flightRecorder.dump("Net2SlowTaskTrace");
 			}
 
 			// to keep the thread liveness check happy
@@ -693,15 +1363,11 @@ void Net2::run() {
 		}
 #endif
 
-		if ((nnow-now) > FLOW_KNOBS->SLOW_LOOP_CUTOFF && g_nondeterministic_random->random01() < (nnow-now)*FLOW_KNOBS->SLOW_LOOP_SAMPLING_RATE)
+		if ((nnow-now) > FLOW_KNOBS->SLOW_LOOP_CUTOFF && random->random01() < (nnow-now)*FLOW_KNOBS->SLOW_LOOP_SAMPLING_RATE)
 			TraceEvent("SomewhatSlowRunLoopBottom").detail("Elapsed", nnow - now); // This includes the time spent running tasks
 
 		trackMinPriority( minTaskID, nnow );
 	}
-
-	#ifdef WIN32
-	timeEndPeriod(1);
-	#endif
 }
 
 void Net2::trackMinPriority( int minTaskID, double now ) {
@@ -720,14 +1386,48 @@ void Net2::trackMinPriority( int minTaskID, double now ) {
 	lastPriorityTrackTime = now;
 }
 
-void Net2::processThreadReady() {
-	while (true) {
-		Optional<OrderedTask> t = threadReady.pop();
-		if (!t.present()) break;
-		t.get().priority -= ++tasksIssued;
-		ASSERT( t.get().task != 0 );
-		ready.push( t.get() );
+// Tasks with TaskIDs in [EDF_MIN_TASKID, EDF_MAX_TASKID] are scheduled earliest deadline first within bands of
+// EDF_BAND_SIZE TaskIDs, each of which takes the place of its highest TaskID in the strict priority order.  A task's
+// deadline is EDF_DEADLINE_PER_TASKID for each TaskID it is below the top of its band after it becomes ready, so a
+// waiting task ages: it can only be overtaken by tasks of its band that became ready less than that long after it.
+int Net2::readyKey( int taskID ) const {
+	if (taskID > FLOW_KNOBS->EDF_MAX_TASKID || taskID < FLOW_KNOBS->EDF_MIN_TASKID) return taskID;
+	int band = (taskID - FLOW_KNOBS->EDF_MIN_TASKID) / FLOW_KNOBS->EDF_BAND_SIZE;
+	return std::min<int64_t>( FLOW_KNOBS->EDF_MAX_TASKID, FLOW_KNOBS->EDF_MIN_TASKID + (band+1) * FLOW_KNOBS->EDF_BAND_SIZE - 1 );
+}
+
+void Net2::pushReady( OrderedTask t, double readyAt ) {
+	t.readyTsc = __rdtsc();
+	if (t.taskID > FLOW_KNOBS->EDF_MAX_TASKID || t.taskID < FLOW_KNOBS->EDF_MIN_TASKID) {
+		ready.push( t );
+		return;
 	}
+	// Tasks that become ready in the same iteration can share a deadline, and keep their priority's FIFO order
+	int band = readyKey( t.taskID );
+	t.deadline = readyAt + (band + 1 - t.taskID) * FLOW_KNOBS->EDF_DEADLINE_PER_TASKID;
+	ready.pushByDeadline( t, band );
+}
+
+void Net2::processThreadReady() {
+	int64_t tsc = __rdtsc();
+	int64_t count = 0, latency = 0;
+	threadReady.popAll( [this, tsc, &count, &latency](ThreadReadyTask& t) {
+		t.priority -= ++tasksIssued;
+		ASSERT( t.task != 0 );
+		pushReady( t, currentTime );
+		++count;
+		latency += tsc - t.tsc;
+	} );
+
+	// Drain often while other threads are sending work, and back off towards MAX_THREAD_READY_TSC_WAIT while they are not
+	if (count) {
+		++countThreadReadyDrains;
+		countThreadReadyTasks += count;
+		threadReadyLatency += latency;
+		threadReadyDrainInterval = FLOW_KNOBS->THREAD_READY_TSC_INTERVAL;
+	} else
+		threadReadyDrainInterval = std::min( threadReadyDrainInterval*2, FLOW_KNOBS->MAX_THREAD_READY_TSC_WAIT );
+	nextThreadReadyDrain = tsc + threadReadyDrainInterval;
 }
 
 void Net2::checkForSlowTask(int64_t tscBegin, int64_t tscEnd, double duration, int64_t priority) {
@@ -750,8 +1450,10 @@ void Net2::checkForSlowTask(int64_t tscBegin, int64_t tscEnd, double duration, i
 			sampleRate = 1; // Always include slow task events that could show up in our slow task profiling.
 		}
 
-		if ( !DEBUG_DETERMINISM && (g_nondeterministic_random->random01() < sampleRate ))
+		if ( !DEBUG_DETERMINISM && (random->random01() < sampleRate )) {
 			TraceEvent(elapsed > warnThreshold ? SevWarnAlways : SevInfo, "SlowTask").detail("TaskID", priority).detail("MClocks", elapsed/1e6).detail("Duration", duration).detail("SampleRate", sampleRate).detail("NumYields", numYields);
+			flightRecorder.dump("SlowTask");
+		}
 	}
 }
 
@@ -766,16 +1468,18 @@ bool Net2::check_yield( int taskID, bool isRunLoop ) {
 		return true;
 	}
 
-	processThreadReady();
+	// Cross-thread tasks are drained in batches; the run loop also drains them once per iteration
+	int64_t tsc_now = __rdtsc();
+	if (tsc_now >= nextThreadReadyDrain)
+		processThreadReady();
 
 	if (taskID == TaskDefaultYield) taskID = currentTaskID;
-	if (!ready.empty() && ready.top().priority > (int64_t(taskID)<<32))  {
+	if (!ready.empty() && ready.topKey() > readyKey(taskID))  {
 		return true;
 	}
 
 	// SOMEDAY: Yield if there are lots of higher priority tasks queued?
-	int64_t tsc_now = __rdtsc();
-	double newTaskBegin = timer_monotonic();
+	double newTaskBegin = tscClock.time(tsc_now);
 	if (tsc_now < tsc_begin) {
 		return true;
 	}
@@ -795,10 +1499,13 @@ bool Net2::check_yield( int taskID, bool isRunLoop ) {
 }
 
 bool Net2::check_yield( int taskID ) {
-	return check_yield(taskID, false);
+	return local()->check_yield(taskID, false);
 }
 
 Future<class Void> Net2::yield( int taskID ) {
+	Net2* n = local();
+	if (n != this) return n->yield(taskID);
+
 	++countYieldCalls;
 	if (taskID == TaskDefaultYield) taskID = currentTaskID;
 	if (check_yield(taskID, false)) {
@@ -810,18 +1517,118 @@ Future<class Void> Net2::yield( int taskID ) {
 }
 
 Future<Void> Net2::delay( double seconds, int taskId ) {
+	Net2* n = local();
+	if (n != this) return n->delay(seconds, taskId);
+
 	if (seconds <= 0.) {
 		PromiseTask* t = new PromiseTask;
-		this->ready.push( OrderedTask( (int64_t(taskId)<<32)-(++tasksIssued), taskId, t) );
+		pushReady( OrderedTask( (int64_t(taskId)<<32)-(++tasksIssued), taskId, t), currentTime );
 		return t->promise.getFuture();
 	}
 	if (seconds >= 4e12)  // Intervals that overflow an int64_t in microseconds (more than 100,000 years) are treated as infinite
 		return Never();
 
 	double at = now() + seconds;
-	PromiseTask* t = new PromiseTask;
-	this->timers.push( DelayedTask( at, (int64_t(taskId)<<32)-(++tasksIssued), taskId, t ) );
-	return t->promise.getFuture();
+	int64_t slot = -1;
+	if (FLOW_KNOBS->DELAY_SLACK > 0 && seconds >= FLOW_KNOBS->MIN_COALESCED_DELAY) {
+		// Round up to the end of a slot, and share the timer of any other delay with this taskID ending there.  Delays
+		// so far off that the slot's key would overflow are not coalesced.
+		double slotNumber = ceil( (at - timerSlotBase) / FLOW_KNOBS->DELAY_SLACK );
+		if (slotNumber < double(int64_t(1) << (63 - ReadyQueue<OrderedTask>::TASKID_BITS))) {
+			at = timerSlotBase + slotNumber * FLOW_KNOBS->DELAY_SLACK;
+			slot = (int64_t(slotNumber) << ReadyQueue<OrderedTask>::TASKID_BITS) | taskId;
+			auto s = timerSlots.find( slot );
+			if (s != timerSlots.end()) {
+				++countTimersCoalesced;
+				return s->second->getFuture();
+			}
+		}
+	}
+	DelayTimer* t = new DelayTimer( this, at, slot );
+	if (slot >= 0)
+		timerSlots[slot] = t;
+	this->timers.add( DelayedTask( at, (int64_t(taskId)<<32)-(++tasksIssued), taskId, t ) );
+	return t->getFuture();
+}
+
+ACTOR static Future<Void> recordWake( Future<Void> f, std::vector<int>* order, int i ) {
+	wait( f );
+	order->push_back( i );
+	return Void();
+}
+
+TEST_CASE("/flow/Net2/delayTimers") {
+	// Only Net2 coalesces timers, and only with a DELAY_SLACK, which is turned on for the delays made here if it is off
+	if (g_network != g_net2) return Void();
+	state bool slackOff = FLOW_KNOBS->DELAY_SLACK <= 0;
+	if (slackOff) const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob( "delay_slack", "0.001" );
+	state Net2* net = g_net2->local();
+	state int64_t coalesced = net->countTimersCoalesced;
+	state int64_t cancelled = net->countTimersCancelled;
+
+	// now() doesn't advance within a task, so these all end in the same slot, and share a timer if their TaskIDs match
+	state Future<Void> a = delay( FLOW_KNOBS->MIN_COALESCED_DELAY, TaskDefaultDelay );
+	state Future<Void> b = delay( FLOW_KNOBS->MIN_COALESCED_DELAY, TaskDefaultDelay );
+	state Future<Void> other = delay( FLOW_KNOBS->MIN_COALESCED_DELAY, TaskLowPriority );
+	ASSERT( a == b && a != other && a.getFutureReferenceCount() == 2 );
+	ASSERT( net->countTimersCoalesced == coalesced + 1 );
+
+	// Dropping every Future for a timer takes it out of the wheel and frees it at once
+	state size_t timers = net->timers.size();
+	delay( FLOW_KNOBS->MIN_COALESCED_DELAY, TaskDefaultYield );
+	ASSERT( net->countTimersCancelled == cancelled + 1 && net->timers.size() == timers );
+
+	// A shared timer wakes its waiters in the order they waited
+	state std::vector<int> order;
+	state std::vector<Future<Void>> waiters;
+	for(int i = 0; i < 10; i++)
+		waiters.push_back( recordWake( delay( FLOW_KNOBS->MIN_COALESCED_DELAY, TaskDefaultDelay ), &order, i ) );
+	ASSERT( net->countTimersCoalesced == coalesced + 11 );
+	if (slackOff) const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob( "delay_slack", "0" );
+	wait( a );
+	ASSERT( b.isReady() );
+	wait( waitForAll( waiters ) );
+	for(int i = 0; i < order.size(); i++)
+		ASSERT( order[i] == i );
+	wait( other );
+	return Void();
+}
+
+TEST_CASE("/flow/Net2/delayTimers/cancel") {
+	if (g_network != g_net2) return Void();
+	Net2* net = g_net2->local();
+	size_t timers = net->timers.size();
+	size_t slots = net->timerSlots.size();
+	int64_t cancelled = net->countTimersCancelled;
+
+	// Like timeout()s that lost their races: far enough apart not to be coalesced, and all dropped before they expire
+	{
+		std::vector<Future<Void>> delays;
+		double spacing = 2 * std::max( FLOW_KNOBS->DELAY_SLACK, 1e-3 );
+		for(int i = 0; i < 100000; i++)
+			delays.push_back( delay( 100 + i * spacing, i % 2 ? TaskDefaultDelay : TaskLowPriority ) );
+		ASSERT( net->timers.size() == timers + delays.size() );
+		for(int i = 0; i < delays.size(); i += 2)
+			delays[i] = Future<Void>();
+		ASSERT( net->timers.size() == timers + delays.size() / 2 );
+	}
+	ASSERT( net->timers.size() == timers && net->timerSlots.size() == slots );
+	ASSERT( net->countTimersCancelled == cancelled + 100000 );
+
+	// Future::cancel() on one of a timer's Futures leaves it in the wheel for the others
+	state bool slackOff = FLOW_KNOBS->DELAY_SLACK <= 0;
+	if (slackOff) const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob( "delay_slack", "0.001" );
+	state Future<Void> single = delay( 0.01 );
+	state Future<Void> b = delay( FLOW_KNOBS->MIN_COALESCED_DELAY );
+	state Future<Void> c = delay( FLOW_KNOBS->MIN_COALESCED_DELAY );
+	if (slackOff) const_cast<FlowKnobs*>(FLOW_KNOBS)->setKnob( "delay_slack", "0" );
+	ASSERT( b == c );
+	single.cancel();
+	b.cancel();
+	wait( single );
+	wait( c );
+	ASSERT( b.isReady() && !b.isError() );
+	return Void();
 }
 
 void Net2::onMainThread(Promise<Void>&& signal, int taskID) {
@@ -832,20 +1639,147 @@ void Net2::onMainThread(Promise<Void>&& signal, int taskID) {
 	if ( thread_network == this )
 	{
 		processThreadReady();
-		this->ready.push( OrderedTask( priority-(++tasksIssued), taskID, p ) );
+		pushReady( OrderedTask( priority-(++tasksIssued), taskID, p ), currentTime );
 	} else {
-		if (threadReady.push( OrderedTask( priority, taskID, p ) ))
+		if (threadReady.push( ThreadReadyTask( priority, taskID, p ) ))
 			reactor.wake();
 	}
 }
 
+void Net2::onRunLoop( int runLoop, Promise<Void>&& signal, int taskID ) {
+	auto const& loops = primary->runLoops;
+	Net2* target = loops.empty() ? primary : loops[runLoop % loops.size()];
+	target->onMainThread( std::move(signal), taskID );
+}
+
+void Net2::onAnyRunLoop( Promise<Void>&& signal, int taskID ) {
+	auto const& loops = primary->runLoops;
+	if (loops.size() <= 1) {
+		onMainThread( std::move(signal), taskID );
+		return;
+	}
+
+	Net2* target = local();
+	if (target->stopped) return;
+	PromiseTask* p = new PromiseTask( std::move(signal) );
+	{
+		ThreadSpinLockHolder holder( target->migratableLock );
+		target->migratable.push_back( OrderedTask( int64_t(taskID)<<32, taskID, p ) );
+		target->migratableCount = target->migratable.size();
+	}
+
+	// Wake one idle loop to take the task, preferring the target unless it is the calling thread
+	if (thread_network != target && interlockedCompareExchange( &target->idle, 0, 1 ) == 1) {
+		target->reactor.wake();
+		return;
+	}
+	for(auto other : loops) {
+		if (other != target && other->idle && interlockedCompareExchange( &other->idle, 0, 1 ) == 1) {
+			other->reactor.wake();
+			return;
+		}
+	}
+}
+
+bool Net2::getRunLoopMetrics( int runLoop, NetworkMetrics& metrics ) {
+	auto const& loops = primary->runLoops;
+	if (runLoop == 0) {
+		metrics = primary->networkMetrics;
+		return true;
+	}
+	if (runLoop >= loops.size()) return false;
+	Net2* n = loops[runLoop];
+	ThreadSpinLockHolder holder( n->publishedMetricsLock );
+	metrics = n->publishedMetrics;
+	return true;
+}
+
+void Net2::publishMetrics( double now ) {
+	ThreadSpinLockHolder holder( publishedMetricsLock );
+	publishedMetrics = networkMetrics;
+	nextMetricsPublish = now + FLOW_KNOBS->RUN_LOOP_METRICS_INTERVAL;
+}
+
+void Net2::takeMigratable() {
+	// Take this loop's share of its migratable tasks, leaving the rest for idle loops to steal
+	if (!migratableCount) return;
+	ThreadSpinLockHolder holder( migratableLock );
+	int loops = primary->runLoops.size();
+	int n = (migratable.size() + loops - 1) / loops;
+	for(int i = 0; i < n; i++) {
+		OrderedTask t = migratable.front();
+		migratable.pop_front();
+		t.priority -= ++tasksIssued;
+		pushReady( t, currentTime );
+	}
+	migratableCount = migratable.size();
+}
+
+bool Net2::stealMigratable() {
+	// Steal the newest half of the tasks of the loop with the most migratable tasks
+	Net2* victim = nullptr;
+	int most = 0;
+	for(auto other : primary->runLoops) {
+		if (other != this && other->migratableCount > most) {
+			victim = other;
+			most = other->migratableCount;
+		}
+	}
+	if (!victim) return false;
+
+	ThreadSpinLockHolder holder( victim->migratableLock );
+	int n = (victim->migratable.size() + 1) / 2;
+	for(int i = victim->migratable.size() - n; i < victim->migratable.size(); i++) {
+		OrderedTask t = victim->migratable[i];
+		t.priority -= ++tasksIssued;
+		pushReady( t, currentTime );
+	}
+	for(int i = 0; i < n; i++)
+		victim->migratable.pop_back();
+	victim->migratableCount = victim->migratable.size();
+	countSteals += n;
+	return n > 0;
+}
+
+TEST_CASE("/flow/Net2/runLoops") {
+	// Starts run loops of its own, so only on a Net2 running just one
+	if (g_network != g_net2 || thread_network != g_net2 || g_net2->runLoops.size() || !FLOW_ARENA_THREAD_SAFE) return Void();
+	state int loops = 4;
+	g_net2->startRunLoops( loops );
+
+	// Enough spinning for the other loops to wake and steal some of these
+	state std::vector<Future<int>> hops;
+	for(int i = 0; i < 64; i++)
+		hops.push_back( onAnyRunLoop( []() -> Future<int> {
+			double end = timer() + 1e-3;
+			while (timer() < end) {}
+			return g_network->getCurrentRunLoop();
+		}, TaskDefaultYield ) );
+	for(int i = 0; i < loops; i++)
+		hops.push_back( onRunLoop( i, []() -> Future<int> { return g_network->getCurrentRunLoop(); }, TaskDefaultYield ) );
+	wait( waitForAll( hops ) );
+
+	// Every result comes back to this loop
+	ASSERT( g_network->getCurrentRunLoop() == 0 && g_network->getRunLoopCount() == loops );
+	int migrated = 0;
+	for(int i = 0; i < 64; i++)
+		if (hops[i].get()) ++migrated;
+	ASSERT( migrated > 0 );
+	for(int i = 0; i < loops; i++)
+		ASSERT( hops[64 + i].get() == i );
+
+	g_net2->stopRunLoops();
+	ASSERT( g_network->getRunLoopCount() == 1 );
+	return Void();
+}
+
 THREAD_HANDLE Net2::startThread( THREAD_FUNC_RETURN (*func) (void*), void *arg ) {
 	return ::startThread(func, arg);
 }
 
 
 Future< Reference<IConnection> > Net2::connect( NetworkAddress toAddr, std::string host ) {
-	return Connection::connect(&this->reactor.ios, toAddr);
+	return Connection::connect(&local()->reactor.ios, toAddr);
 }
 
 ACTOR static Future<std::vector<NetworkAddress>> resolveTCPEndpoint_impl( Net2 *self, std::string host, std::string service) {
@@ -888,7 +1822,7 @@ ACTOR static Future<std::vector<NetworkAddress>> resolveTCPEndpoint_impl( Net2 *
 }
 
 Future<std::vector<NetworkAddress>> Net2::resolveTCPEndpoint( std::string host, std::string service) {
-	return resolveTCPEndpoint_impl(this, host, service);
+	return resolveTCPEndpoint_impl(local(), host, service);
 }
 
 bool Net2::isAddressOnThisHost( NetworkAddress const& addr ) {
@@ -918,7 +1852,7 @@ bool Net2::isAddressOnThisHost( NetworkAddress const& addr ) {
 
 Reference<IListener> Net2::listen( NetworkAddress localAddr ) {
 	try {
-		return Reference<IListener>( new Listener( reactor.ios, localAddr ) );
+		return Reference<IListener>( new Listener( local()->reactor.ios, localAddr ) );
 	} catch (boost::system::system_error const& e) {
 		Error x;
 		if(e.code().value() == EADDRINUSE)
@@ -951,8 +1885,27 @@ void Net2::getDiskBytes( std::string const& directory, int64_t& free, int64_t& t
 #endif
 
 ASIOReactor::ASIOReactor(Net2* net)
-	: network(net), firstTimer(ios), do_not_stop(ios)
+	: network(net), firstTimer(ios), do_not_stop(ios), woken(false)
+#ifdef FLOW_HAVE_IO_URING
+	, ring(NULL), ringEvents(ios)
+#endif
 {
+#ifdef FLOW_HAVE_IO_URING
+	if (FLOW_KNOBS->REACTOR_IO_URING) {
+		ring = IoUring::create(FLOW_KNOBS->IO_URING_ENTRIES);
+		if (ring) {
+			int fd = eventfd(0, EFD_NONBLOCK);
+			if (fd<0) {
+				TraceEvent(SevError, "EventfdError").GetLastError();
+				throw platform_error();
+			}
+			ringEvents.assign(fd);
+			ring->registerEventFD(fd);
+			waitForRingEvents();
+		} else
+			TraceEvent(SevWarnAlways, "IoUringUnavailable").detail("Fallback", "epoll");
+	}
+#endif
 #ifdef __linux__
 	// Reactor flags are used only for experimentation, and are platform-specific
 	if (FLOW_KNOBS->REACTOR_FLAGS & 1) {
@@ -974,37 +1927,140 @@ ASIOReactor::ASIOReactor(Net2* net)
 }
 
 void ASIOReactor::sleepAndReact(double sleepTime) {
+#ifdef FLOW_HAVE_IO_URING
+	// Whatever the tasks of this iteration queued goes to the kernel in one system call
+	if (ring && ring->pending()) {
+		++network->countIoUringEnters;
+		++network->networkMetrics.countRingEnters;
+		network->countIoUringSubmits += ring->submit();
+	}
+#endif
 	if (sleepTime > FLOW_KNOBS->BUSY_WAIT_THRESHOLD) {
-		if (FLOW_KNOBS->REACTOR_FLAGS & 4) {
+		double idleStart = timer_monotonic();
+		double wakeTime = idleStart + sleepTime - FLOW_KNOBS->BUSY_WAIT_THRESHOLD;
+		bool event = false;
+
+		// Poll instead of sleeping when an event is likely to arrive before the kernel could wake us for it
+		if (FLOW_KNOBS->REACTOR_SPIN_MAX > 0) {
+			double spinTime = idleHistogram.quantile( FLOW_KNOBS->REACTOR_SPIN_QUANTILE );
+			if (spinTime <= FLOW_KNOBS->REACTOR_SPIN_MAX)
+				event = spin( std::min( spinTime, wakeTime - idleStart ) );
+		}
+
+		if (!event) {
+			double sleepStart = timer_monotonic();
+			if (FLOW_KNOBS->REACTOR_FLAGS & 4) {
 #ifdef __linux
-			timespec tv;
-			tv.tv_sec = 0;
-			tv.tv_nsec = 20000;
-			nanosleep(&tv, NULL);
+				timespec tv;
+				tv.tv_sec = 0;
+				tv.tv_nsec = 20000;
+				nanosleep(&tv, NULL);
 #endif
-		}
-		else
-		{
-			sleepTime -= FLOW_KNOBS->BUSY_WAIT_THRESHOLD;
-			if (sleepTime < 4e12) {
-				this->firstTimer.expires_from_now(boost::posix_time::microseconds(int64_t(sleepTime*1e6)));
-				this->firstTimer.async_wait(&nullWaitHandler);
 			}
-			setProfilingEnabled(0); // The following line generates false positives for slow task profiling
-			ios.run_one();
-			setProfilingEnabled(1);
-			this->firstTimer.cancel();
+			else
+			{
+				sleepTime = std::max( wakeTime - sleepStart, 0.0 );
+				if (sleepTime < 4e12) {
+					this->firstTimer.expires_from_now(boost::posix_time::microseconds(int64_t(sleepTime*1e6)));
+					this->firstTimer.async_wait(&nullWaitHandler);
+				}
+				setProfilingEnabled(0); // The following line generates false positives for slow task profiling
+				ios.run_one();
+				setProfilingEnabled(1);
+				this->firstTimer.cancel();
+			}
+			++network->countASIOEvents;
+			network->networkMetrics.secSleeping += timer_monotonic() - sleepStart;
+		}
+
+		if (FLOW_KNOBS->REACTOR_SPIN_MAX > 0) {
+			// Waking at the timer only says that the next event, if any, comes later; that is worth recording only
+			// when it is already later than we would poll for
+			double idleTime = timer_monotonic() - idleStart;
+			if (event || idleTime < wakeTime - idleStart || idleTime > FLOW_KNOBS->REACTOR_SPIN_MAX)
+				idleHistogram.add( idleTime );
 		}
-		++network->countASIOEvents;
 	} else if (sleepTime > 0) {
 		if (!(FLOW_KNOBS->REACTOR_FLAGS & 8))
 			threadYield();
 	}
 	while (ios.poll_one()) ++network->countASIOEvents;  // Make this a task?
+#ifdef FLOW_HAVE_IO_URING
+	if (ring) reapRing();
+#endif
+}
+
+bool ASIOReactor::spin(double limit) {
+	double start = timer_monotonic(), t = start;
+	bool event = false;
+	// Cross-thread tasks wake a sleeping loop through wake(), and ring completions appear in the completion ring, both
+	// seen here without a system call.  poll_one() does an epoll_wait when nothing is queued, so it is only called for
+	// sockets every SPIN_POLL_INTERVAL iterations, or to run what wake() posted.
+	for (int i = 0; ; i++) {
+#ifdef FLOW_HAVE_IO_URING
+		if (ring && ring->hasCompletions()) {
+			reapRing();
+			event = true;
+			break;
+		}
+#endif
+		bool wakeups = woken.load( std::memory_order_relaxed ) && woken.exchange( false, std::memory_order_acquire );
+		if ((wakeups || i % SPIN_POLL_INTERVAL == 0) && (event = ios.poll_one()))
+			break;
+		if (t - start >= limit) break;
+		_mm_pause();
+		t = timer_monotonic();
+	}
+	if (event) {
+		++network->countASIOEvents;
+		++network->networkMetrics.countSpinWakeups;
+	}
+	network->networkMetrics.secSpinning += timer_monotonic() - start;
+	return event;
 }
 
+void ASIOReactor::IdleHistogram::add(double seconds) {
+	int b = 0;
+	for (int64_t us = int64_t(seconds * 1e6); us && b < BUCKETS-1; us >>= 1)
+		++b;
+	++counts[b];
+	if (++total >= HISTORY) {
+		total = 0;
+		for (int i = 0; i < BUCKETS; i++)
+			total += counts[i] >>= 1;
+	}
+}
+
+double ASIOReactor::IdleHistogram::quantile(double q) const {
+	int needed = std::max( 1, int(ceil(q * total)) );
+	for (int b = 0, seen = 0; b < BUCKETS-1; b++) {
+		seen += counts[b];
+		if (seen >= needed) return (int64_t(1) << b) * 1e-6;
+	}
+	return 1e99;
+}
+
+#ifdef FLOW_HAVE_IO_URING
+void ASIOReactor::waitForRingEvents() {
+	ringEvents.async_read_some( boost::asio::mutable_buffers_1( &ringEventsValue, sizeof(ringEventsValue) ),
+		[this]( const boost::system::error_code& ec, std::size_t ) {
+			if (ec) return;
+			++network->networkMetrics.countRingEventFDReads;
+			reapRing();
+			waitForRingEvents();
+		} );
+}
+
+void ASIOReactor::reapRing() {
+	int completions = ring->reap();
+	network->countIoUringCompletions += completions;
+	network->networkMetrics.countRingCompletions += completions;
+}
+#endif
+
 void ASIOReactor::wake() {
 	ios.post( nullCompletionHandler );
+	woken.store( true, std::memory_order_release );
 }
 
 } // namespace net2
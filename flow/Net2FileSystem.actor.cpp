@@ -0,0 +1,612 @@
+/*
+ * Net2FileSystem.actor.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/IAsyncFile.h"
+#include "flow/AsyncFileCached.h"
+#include "flow/IThreadPool.h"
+#include "flow/IoUring.h"
+#include "flow/Knobs.h"
+#include "flow/TDMetric.actor.h"
+#include "flow/UnitTest.h"
+#include "flow/genericactors.actor.h"
+#include <deque>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+#endif
+#include "flow/actorcompiler.h"  // This must be the last #include.
+
+namespace {
+
+struct FileIOMetrics {
+	Int64MetricHandle countLogicalWrites;
+	Int64MetricHandle countLogicalReads;
+	Int64MetricHandle countAIOSubmit;
+	Int64MetricHandle countAIOCollect;
+	bool initialized = false;
+
+	// Metrics are registered with g_network, which is not yet set when the file system is created
+	void init() {
+		if (initialized) return;
+		initialized = true;
+		countLogicalWrites.init(LiteralStringRef("AsyncFile.CountLogicalWrites"));
+		countLogicalReads.init(LiteralStringRef("AsyncFile.CountLogicalReads"));
+		countAIOSubmit.init(LiteralStringRef("AsyncFile.CountAIOSubmit"));
+		countAIOCollect.init(LiteralStringRef("AsyncFile.CountAIOCollect"));
+	}
+};
+
+FileIOMetrics fileIOMetrics;
+
+Error fileError( const char* context, std::string const& filename, int err ) {
+	Error e = err == ENOENT ? file_not_found() : err == EFBIG ? file_too_large() : io_error();
+	TraceEvent(SevWarn, context).detail("Filename", filename).detail("Errno", err).detail("Message", strerror(err)).error(e);
+	return e;
+}
+
+int64_t preadFully( int fd, void* data, int length, int64_t offset ) {
+	int64_t done = 0;
+	while (done < length) {
+		ssize_t r = ::pread( fd, (uint8_t*)data + done, length - done, offset + done );
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		if (r == 0) break;
+		done += r;
+	}
+	return done;
+}
+
+int64_t pwriteFully( int fd, void const* data, int length, int64_t offset ) {
+	int64_t done = 0;
+	while (done < length) {
+		ssize_t r = ::pwrite( fd, (uint8_t const*)data + done, length - done, offset + done );
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		done += r;
+	}
+	return 0;
+}
+
+int64_t syncFile( int fd ) {
+#ifdef __linux__
+	int r = ::fdatasync( fd );
+#else
+	int r = ::fsync( fd );
+#endif
+	return r < 0 ? -errno : 0;
+}
+
+Future<int64_t> fileSize( int fd, std::string const& filename ) {
+	// fstat() only reads the inode, which is already in memory for an open file
+	struct stat s;
+	if (::fstat( fd, &s ) < 0)
+		return fileError( "AsyncFileSizeError", filename, errno );
+	return int64_t(s.st_size);
+}
+
+struct FileIOReceiver : IThreadPoolReceiver {
+	virtual void init() {}
+
+	struct Op : TypedAction<FileIOReceiver, Op> {
+		std::function<int64_t()> run;  // Returns a result, or -errno
+		ThreadReturnPromise<int64_t> result;
+		explicit Op( std::function<int64_t()> const& run ) : run(run) {}
+		virtual double getTimeEstimate() { return 0; }
+	};
+
+	void action( Op& op ) {
+		op.result.send( op.run() );
+	}
+};
+
+// Runs run() on the file I/O thread pool, and converts the -errno it may return into an Error
+ACTOR Future<int64_t> runFileOp( Reference<IThreadPool> pool, std::function<int64_t()> run, const char* context, std::string filename ) {
+	state FileIOReceiver::Op* op = new FileIOReceiver::Op( run );
+	state Future<int64_t> result = op->result.getFuture();
+	pool->post( op );
+	int64_t r = wait( result );
+	if (r < 0)
+		throw fileError( context, filename, -r );
+	return r;
+}
+
+// A file whose every operation is a blocking system call on the file I/O thread pool.  The pool threads only see fd;
+// each operation holds a reference to the file on the run loop until it completes, which keeps fd open.
+class AsyncFileThreaded : public IAsyncFile, public ReferenceCounted<AsyncFileThreaded> {
+public:
+	AsyncFileThreaded( int fd, std::string const& filename, Reference<IThreadPool> pool ) : fd(fd), filename(filename), pool(pool) {}
+	virtual ~AsyncFileThreaded() { ::close(fd); }
+
+	virtual void addref() { ReferenceCounted<AsyncFileThreaded>::addref(); }
+	virtual void delref() { ReferenceCounted<AsyncFileThreaded>::delref(); }
+
+	virtual Future<int> read( void* data, int length, int64_t offset ) {
+		++fileIOMetrics.countLogicalReads;
+		int fd = this->fd;
+		Reference<AsyncFileThreaded> self = Reference<AsyncFileThreaded>::addRef(this);
+		return holdWhile( self, map( runFileOp( pool, [fd, data, length, offset]() { return preadFully( fd, data, length, offset ); }, "AsyncFileReadError", filename ),
+		                             [](int64_t r) { return int(r); } ) );
+	}
+	virtual Future<Void> write( void const* data, int length, int64_t offset ) {
+		++fileIOMetrics.countLogicalWrites;
+		int fd = this->fd;
+		Reference<AsyncFileThreaded> self = Reference<AsyncFileThreaded>::addRef(this);
+		return holdWhile( self, success( runFileOp( pool, [fd, data, length, offset]() { return pwriteFully( fd, data, length, offset ); }, "AsyncFileWriteError", filename ) ) );
+	}
+	virtual Future<Void> truncate( int64_t size ) {
+		int fd = this->fd;
+		Reference<AsyncFileThreaded> self = Reference<AsyncFileThreaded>::addRef(this);
+		return holdWhile( self, success( runFileOp( pool, [fd, size]() { return ::ftruncate( fd, size ) < 0 ? -errno : 0; }, "AsyncFileTruncateError", filename ) ) );
+	}
+	virtual Future<Void> sync() {
+		int fd = this->fd;
+		Reference<AsyncFileThreaded> self = Reference<AsyncFileThreaded>::addRef(this);
+		return holdWhile( self, success( runFileOp( pool, [fd]() { return syncFile( fd ); }, "AsyncFileSyncError", filename ) ) );
+	}
+	virtual Future<int64_t> size() { return fileSize( fd, filename ); }
+	virtual std::string getFilename() { return filename; }
+
+private:
+	int fd;
+	std::string filename;
+	Reference<IThreadPool> pool;
+};
+
+#ifdef __linux__
+
+// Reads and writes with io_uring when the primary reactor has a ring, and with kernel AIO otherwise.  Requests are
+// queued, and launch() submits them once per run loop iteration, so every request made by the tasks of one iteration
+// goes to the kernel in a single batch.  sync() and truncate() go to the thread pool: kernel AIO has no working fsync,
+// and io_uring has no truncate.
+class AsyncFileKAIO : public IAsyncFile, public ReferenceCounted<AsyncFileKAIO> {
+public:
+	// Returns false if neither io_uring nor kernel AIO is available
+	static bool init() {
+		if (ctx.initialized) return ctx.available();
+		ctx.initialized = true;
+#ifdef FLOW_HAVE_IO_URING
+		ctx.ring = (IoUring*)g_network->global(INetwork::enIoUring);
+		if (ctx.ring) return true;
+#endif
+		IEventFD* ev = (IEventFD*)g_network->global(INetwork::enEventFD);
+		if (!ev) return false;
+		if (syscall( __NR_io_setup, FLOW_KNOBS->MAX_OUTSTANDING, &ctx.aio ) < 0) {
+			TraceEvent(SevWarnAlways, "KAIOSetupFailed").GetLastError();
+			ctx.aio = 0;
+			return false;
+		}
+		ctx.ev = Reference<IEventFD>::addRef(ev);
+		ctx.poller = poll( ctx.ev );
+		return true;
+	}
+
+	// Submits queued requests.  Called at the start of each iteration of the primary run loop.
+	static void launch() {
+		if (ctx.queue.empty() || ctx.outstanding > FLOW_KNOBS->MAX_OUTSTANDING - FLOW_KNOBS->MIN_SUBMIT)
+			return;
+
+		int n = std::min<int>( ctx.queue.size(), FLOW_KNOBS->MAX_OUTSTANDING - ctx.outstanding );
+		double begin = timer_monotonic();
+		for(int i = 0; i < n; i++) {
+			double lag = begin - ctx.queue[i]->queuedAt;
+			g_network->networkMetrics.secSquaredSubmit += lag*lag;
+		}
+		++fileIOMetrics.countAIOSubmit;
+
+#ifdef FLOW_HAVE_IO_URING
+		if (ctx.ring) {
+			// The reactor submits these along with its own operations before it sleeps
+			for(int i = 0; i < n; i++) {
+				IOBlock* io = ctx.queue.front();
+				ctx.queue.pop_front();
+				io_uring_sqe* sqe = ctx.ring->prepare( io );
+				sqe->opcode = io->aio_lio_opcode == IOCB_CMD_PREAD ? IORING_OP_READ : IORING_OP_WRITE;
+				sqe->fd = io->aio_fildes;
+				sqe->addr = io->aio_buf;
+				sqe->len = io->aio_nbytes;
+				sqe->off = io->aio_offset;
+			}
+			ctx.outstanding += n;
+			return;
+		}
+#endif
+
+		ctx.toSubmit.clear();
+		for(int i = 0; i < n; i++) {
+			IOBlock* io = ctx.queue[i];
+			io->aio_flags = IOCB_FLAG_RESFD;
+			io->aio_resfd = ctx.ev->getFD();
+			ctx.toSubmit.push_back( io );
+		}
+		int r = syscall( __NR_io_submit, ctx.aio, n, ctx.toSubmit.data() );
+		int err = errno;
+		// io_submit() blocks when the device queue is full, or for metadata it has to read
+		double stall = timer_monotonic() - begin;
+		g_network->networkMetrics.secSquaredDiskStall += stall*stall;
+
+		if (r < 0) {
+			// Nothing was submitted.  The first request is bad unless the kernel is just out of resources for now.
+			if (err == EAGAIN) return;
+			IOBlock* io = ctx.queue.front();
+			ctx.queue.pop_front();
+			io->result.sendError( fileError( "KAIOSubmitError", io->owner->filename, err ) );
+			delete io;
+			return;
+		}
+		ctx.outstanding += r;
+		ctx.queue.erase( ctx.queue.begin(), ctx.queue.begin() + r );
+	}
+
+	// Called once the network has stopped, so no task will wait for the requests still queued or in flight
+	static void shutdown() {
+		if (!ctx.initialized) return;
+		// Cancelled first, so that it does not reap from this context, or from one a later network sets up
+		ctx.poller = Future<Void>();
+		std::deque<IOBlock*> queued;
+		queued.swap( ctx.queue );
+		for(IOBlock* io : queued)
+			delete io;
+		if (ctx.aio) {
+			// Reaps what is in flight first, so that the kernel is done with those buffers before they are freed
+			io_event events[64];
+			while (ctx.outstanding > 0) {
+				int n = syscall( __NR_io_getevents, ctx.aio, 1, 64, events, NULL );
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					TraceEvent(SevWarnAlways, "KAIOGetEventsError").GetLastError();
+					break;
+				}
+				for(int i = 0; i < n; i++)
+					delete (IOBlock*)events[i].data;
+				ctx.outstanding -= n;
+			}
+			if (syscall( __NR_io_destroy, ctx.aio ) < 0)
+				TraceEvent(SevWarnAlways, "KAIODestroyFailed").GetLastError();
+		}
+		ctx = Context();
+	}
+
+	// Whether requests go through io_uring rather than kernel AIO
+	static bool usesRing() {
+#ifdef FLOW_HAVE_IO_URING
+		return ctx.ring != NULL;
+#else
+		return false;
+#endif
+	}
+
+	AsyncFileKAIO( int fd, int64_t flags, std::string const& filename, Reference<IThreadPool> pool )
+		: fd(fd), flags(flags), filename(filename), pool(pool) {}
+	virtual ~AsyncFileKAIO() { ::close(fd); }
+
+	virtual void addref() { ReferenceCounted<AsyncFileKAIO>::addref(); }
+	virtual void delref() { ReferenceCounted<AsyncFileKAIO>::delref(); }
+
+	virtual Future<int> read( void* data, int length, int64_t offset ) {
+		++fileIOMetrics.countLogicalReads;
+		return enqueue( IOCB_CMD_PREAD, data, length, offset );
+	}
+	virtual Future<Void> write( void const* data, int length, int64_t offset ) {
+		++fileIOMetrics.countLogicalWrites;
+		return success( enqueue( IOCB_CMD_PWRITE, (void*)data, length, offset ) );
+	}
+	virtual Future<Void> truncate( int64_t size ) {
+		int fd = this->fd;
+		Reference<AsyncFileKAIO> self = Reference<AsyncFileKAIO>::addRef(this);
+		// The file is not referenced from the pool thread, since it is not thread safe; holding it in the actor keeps fd open
+		return holdWhile( self, success( runFileOp( pool, [fd, size]() { return ::ftruncate( fd, size ) < 0 ? -errno : 0; }, "AsyncFileTruncateError", filename ) ) );
+	}
+	virtual Future<Void> sync() {
+		int fd = this->fd;
+		Reference<AsyncFileKAIO> self = Reference<AsyncFileKAIO>::addRef(this);
+		return holdWhile( self, success( runFileOp( pool, [fd]() { return syncFile( fd ); }, "AsyncFileSyncError", filename ) ) );
+	}
+	virtual Future<int64_t> size() { return fileSize( fd, filename ); }
+	virtual std::string getFilename() { return filename; }
+
+private:
+	struct IOBlock : iocb,
+#ifdef FLOW_HAVE_IO_URING
+	                 IoUring::Completion,
+#endif
+	                 FastAllocated<IOBlock> {
+		Promise<int> result;
+		Reference<AsyncFileKAIO> owner;
+		double queuedAt;
+
+		IOBlock( int opcode, Reference<AsyncFileKAIO> const& owner, void* data, int length, int64_t offset ) : owner(owner), queuedAt(timer_monotonic()) {
+			memset( (iocb*)this, 0, sizeof(iocb) );
+			aio_data = (uint64_t)this;
+			aio_lio_opcode = opcode;
+			aio_fildes = owner->fd;
+			aio_buf = (uint64_t)data;
+			aio_nbytes = length;
+			aio_offset = offset;
+		}
+#ifdef FLOW_HAVE_IO_URING
+		virtual void complete( int r ) { AsyncFileKAIO::complete( this, r ); }
+#endif
+	};
+
+	struct Context {
+		bool initialized = false;
+		aio_context_t aio = 0;
+		Reference<IEventFD> ev;
+		Future<Void> poller;  // poll(), while aio is set
+#ifdef FLOW_HAVE_IO_URING
+		IoUring* ring = NULL;
+#endif
+		std::deque<IOBlock*> queue;
+		std::vector<iocb*> toSubmit;
+		int outstanding = 0;
+
+		bool available() const {
+#ifdef FLOW_HAVE_IO_URING
+			if (ring) return true;
+#endif
+			return aio != 0;
+		}
+	};
+	static Context ctx;
+
+	int fd;
+	int64_t flags;
+	std::string filename;
+	Reference<IThreadPool> pool;
+
+	Future<int> enqueue( int opcode, void* data, int length, int64_t offset ) {
+		if (flags & OPEN_UNCACHED)
+			ASSERT( (intptr_t)data % 4096 == 0 && length % 4096 == 0 && offset % 4096 == 0 );
+		IOBlock* io = new IOBlock( opcode, Reference<AsyncFileKAIO>::addRef(this), data, length, offset );
+		ctx.queue.push_back( io );
+		return io->result.getFuture();
+	}
+
+	static void complete( IOBlock* io, int64_t r ) {
+		--ctx.outstanding;
+		bool isRead = io->aio_lio_opcode == IOCB_CMD_PREAD;
+		if (r < 0)
+			io->result.sendError( fileError( isRead ? "AsyncFileReadError" : "AsyncFileWriteError", io->owner->filename, -r ) );
+		else if (!isRead && r != (int64_t)io->aio_nbytes)
+			// A short write means the disk is full, and retrying it would only report that
+			io->result.sendError( fileError( "AsyncFileWriteError", io->owner->filename, ENOSPC ) );
+		else
+			io->result.send( r );
+		delete io;
+	}
+
+	// Kernel AIO signals the network's eventfd when requests complete
+	ACTOR static Future<Void> poll( Reference<IEventFD> ev ) {
+		loop {
+			wait( success( ev->read() ) );
+			wait( delay( 0, TaskDiskIOComplete ) );
+
+			io_event events[64];
+			loop {
+				int n = syscall( __NR_io_getevents, ctx.aio, 0, 64, events, NULL );
+				++fileIOMetrics.countAIOCollect;
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					TraceEvent(SevError, "KAIOGetEventsError").GetLastError();
+					throw platform_error();
+				}
+				for(int i = 0; i < n; i++)
+					complete( (IOBlock*)events[i].data, events[i].res );
+				if (n < 64) break;
+			}
+		}
+	}
+};
+
+AsyncFileKAIO::Context AsyncFileKAIO::ctx;
+
+#endif
+
+class Net2FileSystem : public IAsyncFileSystem {
+public:
+	explicit Net2FileSystem( INetwork* net ) {
+#ifdef __linux__
+		net->setGlobal( INetwork::enRunCycleFunc, (flowGlobalType) &AsyncFileKAIO::launch );
+#endif
+	}
+
+	virtual Future<Reference<IAsyncFile>> open( std::string filename, int64_t flags, int64_t mode ) {
+		fileIOMetrics.init();
+		// open() may have to read directories from disk, so it is done on the pool too.  A cached file is over an
+		// uncached one, so its data is not cached twice.
+		Future<int64_t> fd = runFileOp( threadPool(), [filename, flags, mode]() -> int64_t {
+			int oflags = openFlags( flags | IAsyncFile::OPEN_UNCACHED );
+			int fd = ::open( filename.c_str(), oflags, (mode_t)mode );
+#ifdef O_DIRECT
+			// Some file systems, such as tmpfs, do not support O_DIRECT
+			if (fd < 0 && errno == EINVAL)
+				fd = ::open( filename.c_str(), oflags & ~O_DIRECT, (mode_t)mode );
+#endif
+			return fd < 0 ? -errno : fd;
+		}, "AsyncFileOpenError", filename );
+		return open_impl( fd, flags, filename, threadPool() );
+	}
+
+	// Files opened after this, if the network runs again, set up a new context
+	void shutdown() {
+#ifdef __linux__
+		AsyncFileKAIO::shutdown();
+#endif
+	}
+
+	virtual Future<Void> deleteFile( std::string filename, bool mustBeDurable ) {
+		return success( runFileOp( threadPool(), [filename, mustBeDurable]() -> int64_t {
+			if (::unlink( filename.c_str() ) < 0) return -errno;
+			if (!mustBeDurable) return 0;
+			// The directory entry is durable once the directory is synced
+			int dir = ::open( parentDirectory( filename ).c_str(), O_RDONLY | O_CLOEXEC );
+			if (dir < 0) return -errno;
+			int64_t r = ::fsync( dir ) < 0 ? -errno : 0;
+			::close( dir );
+			return r;
+		}, "AsyncFileDeleteError", filename ) );
+	}
+
+private:
+	Reference<IThreadPool> pool;
+
+	Reference<IThreadPool> threadPool() {
+		if (!pool) {
+			// Their operations only take fds, raw buffers and strings, so no ArenaBlock reference crosses threads
+			pool = createGenericThreadPool();
+			for(int i = 0; i < FLOW_KNOBS->FILE_IO_THREADS; i++)
+				pool->addThread( new FileIOReceiver );
+		}
+		return pool;
+	}
+
+	static int openFlags( int64_t flags ) {
+		int oflags = O_CLOEXEC;
+		if (flags & IAsyncFile::OPEN_READONLY) oflags |= O_RDONLY;
+		if (flags & IAsyncFile::OPEN_READWRITE) oflags |= O_RDWR;
+		if (flags & IAsyncFile::OPEN_CREATE) oflags |= O_CREAT;
+		if (flags & IAsyncFile::OPEN_EXCLUSIVE) oflags |= O_EXCL;
+#ifdef O_DIRECT
+		if (flags & IAsyncFile::OPEN_UNCACHED) oflags |= O_DIRECT;
+#endif
+		return oflags;
+	}
+
+	static Reference<IAsyncFile> newFile( int fd, int64_t flags, std::string const& filename, Reference<IThreadPool> const& pool ) {
+#ifdef O_DIRECT
+		if (!(::fcntl( fd, F_GETFL ) & O_DIRECT)) {
+			TraceEvent("AsyncFileNoDirectIO").detail("Filename", filename);
+			flags &= ~(int64_t)IAsyncFile::OPEN_UNCACHED;
+		} else
+			flags |= IAsyncFile::OPEN_UNCACHED;
+#endif
+#ifdef __linux__
+		// Buffered kernel AIO blocks in io_submit(), so it is only used for uncached files; io_uring handles both
+		bool useRing = false;
+#ifdef FLOW_HAVE_IO_URING
+		useRing = g_network->global(INetwork::enIoUring) != NULL;
+#endif
+		if (!FLOW_KNOBS->DISABLE_POSIX_KERNEL_AIO && !(flags & IAsyncFile::OPEN_NO_AIO) && ((flags & IAsyncFile::OPEN_UNCACHED) || useRing) && AsyncFileKAIO::init())
+			return Reference<IAsyncFile>( new AsyncFileKAIO( fd, flags, filename, pool ) );
+#endif
+		return Reference<IAsyncFile>( new AsyncFileThreaded( fd, filename, pool ) );
+	}
+
+	ACTOR static Future<Reference<IAsyncFile>> open_impl( Future<int64_t> fd, int64_t flags, std::string filename, Reference<IThreadPool> pool ) {
+		int64_t f = wait( fd );
+		state Reference<IAsyncFile> file = newFile( f, flags, filename, pool );
+		if (!(flags & IAsyncFile::OPEN_UNCACHED)) {
+			Reference<IAsyncFile> cached = wait( openCachedFile( file, flags ) );
+			return cached;
+		}
+		return file;
+	}
+};
+
+}
+
+IAsyncFileSystem* newNet2FileSystem( INetwork* net ) {
+	return new Net2FileSystem( net );
+}
+
+void shutdownNet2FileSystem( INetwork* net ) {
+	static_cast<Net2FileSystem*>( IAsyncFileSystem::filesystem( net ) )->shutdown();
+}
+
+// Writes, syncs and reads back a few pages of file, then truncates it
+ACTOR static Future<Void> checkFileOps( Reference<IAsyncFile> file ) {
+	state int pages = 4;
+	// Held by the actor, so it is freed however the test ends
+	state Standalone<StringRef> buffer = makeAlignedString( 4096, pages * 4096 );
+	state uint8_t* buf = mutateString( buffer );
+	state std::vector<Future<Void>> writes;
+	state std::vector<Future<int>> reads;
+	state int i;
+	for(i = 0; i < pages; i++) {
+		memset( buf + i * 4096, i + 1, 4096 );
+		writes.push_back( file->write( buf + i * 4096, 4096, i * 4096 ) );
+	}
+	wait( waitForAll( writes ) );
+	wait( file->sync() );
+	int64_t size = wait( file->size() );
+	ASSERT( size == pages * 4096 );
+
+	memset( buf, 0, pages * 4096 );
+	for(i = 0; i < pages; i++)
+		reads.push_back( file->read( buf + i * 4096, 4096, i * 4096 ) );
+	wait( waitForAll( reads ) );
+	for(i = 0; i < pages; i++)
+		ASSERT( reads[i].get() == 4096 && buf[i * 4096] == i + 1 && buf[i * 4096 + 4095] == i + 1 );
+
+	wait( file->truncate( 4096 ) );
+	int64_t truncated = wait( file->size() );
+	ASSERT( truncated == 4096 );
+	// A read past the end of the file is short
+	int n = wait( file->read( buf, 4096, 4096 ) );
+	ASSERT( n == 0 );
+	wait( file->sync() );
+	return Void();
+}
+
+// Runs checkFileOps() on a new temporary file opened with flags, if the file system gives it the path isPath() looks for
+ACTOR static Future<Void> testFilePath( std::string filename, int64_t flags, std::function<bool(IAsyncFile*)> isPath ) {
+	// Not every network has a file system
+	state IAsyncFileSystem* fs = IAsyncFileSystem::filesystem();
+	if (!fs) return Void();
+	state Reference<IAsyncFile> file = wait( fs->open( filename, flags | IAsyncFile::OPEN_READWRITE | IAsyncFile::OPEN_CREATE, 0600 ) );
+	if (isPath( file.getPtr() ))
+		wait( checkFileOps( file ) );
+	file = Reference<IAsyncFile>();
+	wait( fs->deleteFile( filename, false ) );
+	return Void();
+}
+
+TEST_CASE("/flow/AsyncFile/threaded") {
+	wait( testFilePath( "flow_asyncfile_threaded.dat", IAsyncFile::OPEN_UNCACHED | IAsyncFile::OPEN_NO_AIO, [](IAsyncFile* f) {
+		ASSERT( dynamic_cast<AsyncFileThreaded*>( f ) );
+		return true;
+	} ) );
+	return Void();
+}
+
+#ifdef __linux__
+// Uncached files only get kernel AIO when the reactor has no ring, and the file system supports O_DIRECT
+TEST_CASE("/flow/AsyncFile/KAIO") {
+	wait( testFilePath( "flow_asyncfile_kaio.dat", IAsyncFile::OPEN_UNCACHED, [](IAsyncFile* f) {
+		return dynamic_cast<AsyncFileKAIO*>( f ) && !AsyncFileKAIO::usesRing();
+	} ) );
+	return Void();
+}
+
+// With a ring, uncached files get io_uring even where the file system does not support O_DIRECT
+TEST_CASE("/flow/AsyncFile/io_uring") {
+	wait( testFilePath( "flow_asyncfile_io_uring.dat", IAsyncFile::OPEN_UNCACHED, [](IAsyncFile* f) {
+		return dynamic_cast<AsyncFileKAIO*>( f ) && AsyncFileKAIO::usesRing();
+	} ) );
+	return Void();
+}
+#endif
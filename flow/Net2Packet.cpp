@@ -19,6 +19,8 @@
  */
 
 #include "flow/Net2Packet.h"
+#include "flow/Knobs.h"
+#include "flow/UnitTest.h"
 
 void PacketWriter::init(PacketBuffer* buf, ReliablePacket* reliable) {
 	this->buffer = buf;
@@ -53,6 +55,33 @@ void PacketWriter::serializeBytesAcrossBoundary(const void* data, int bytes) {
 	}
 }
 
+void PacketWriter::serializeBytesZeroCopy( StringRef bytes, Arena const& arena ) {
+	if (bytes.size() < FLOW_KNOBS->ZERO_COPY_MIN_BYTES) {
+		serializeBytes(bytes);
+		return;
+	}
+
+	// The current buffer is left partly filled, followed by the external buffer and then a new one for what comes next
+	PacketBuffer* external = new PacketBuffer(bytes, arena);
+	external->next = new PacketBuffer;
+	buffer->next = external;
+	length += buffer->bytes_written + bytes.size();
+
+	if (reliable) {
+		reliable->end = buffer->bytes_written;
+		reliable->cont = new ReliablePacket;
+		reliable = reliable->cont;
+		reliable->buffer = external; external->addref();
+		reliable->begin = 0;
+		reliable->end = bytes.size();
+		reliable->cont = new ReliablePacket;
+		reliable = reliable->cont;
+		reliable->buffer = external->nextPacketBuffer(); reliable->buffer->addref();
+		reliable->begin = 0;
+	}
+	buffer = external->nextPacketBuffer();
+}
+
 void PacketWriter::nextBuffer() {
 	ASSERT( buffer->bytes_written == PacketBuffer::DATA_SIZE );
 	length += PacketBuffer::DATA_SIZE;
@@ -142,14 +171,14 @@ void UnsentPacketQueue::sent(int bytes) {
 
 		if (b->bytes_sent + bytes <= b->bytes_written && (b->bytes_sent + bytes != b->bytes_written || (!b->next && b->bytes_unwritten()))) {
 			b->bytes_sent += bytes;
-			ASSERT( b->bytes_sent <= PacketBuffer::DATA_SIZE );
+			ASSERT( b->bytes_sent <= PacketBuffer::DATA_SIZE || b->external );
 			break;
 		}
 
 		// We've sent an entire buffer
 		bytes -= b->bytes_written - b->bytes_sent;
 		b->bytes_sent = b->bytes_written;
-		ASSERT( b->bytes_written <= PacketBuffer::DATA_SIZE );
+		ASSERT( b->bytes_written <= PacketBuffer::DATA_SIZE || b->external );
 		unsent_first = b->nextPacketBuffer();
 		if (!unsent_first) unsent_last = NULL;
 		b->delref();
@@ -176,7 +205,7 @@ PacketBuffer* ReliablePacketList::compact(PacketBuffer* into, PacketBuffer* end)
 				into = into->nextPacketBuffer();
 			}
 
-			uint8_t* data = &c->buffer->data[c->begin];
+			uint8_t const* data = c->buffer->SendBuffer::data + c->begin;
 			int len = c->end-c->begin;
 
 			if (len > into->bytes_unwritten()) {
@@ -206,3 +235,209 @@ void ReliablePacketList::discardAll() {
 	while (reliable.next != &reliable)
 		reliable.next->remove();
 }
+
+bool ReceiveBuffer::Buffer::unreferenced() const {
+	// Nothing else was allocated in the block either, so all of it but the buffer is unused.  If the reference count
+	// is 1 no other thread can add one, and the fence orders its last reads of the memory before our writes.
+	bool result = arena.impl->isSoleOwnerUnsafe() && arena.impl->used() == data + size - (uint8_t const*)arena.impl->getData();
+	std::atomic_thread_fence( std::memory_order_acquire );
+	return result;
+}
+
+namespace {
+
+struct ReceiveBufferPool {
+	std::vector<ReceiveBuffer::Buffer> retired;  // Oldest first; some may still be referenced
+
+	ReceiveBuffer::Buffer get( int size ) {
+		for(int i = 0; i < retired.size(); i++) {
+			if (retired[i].size >= size && retired[i].unreferenced()) {
+				ReceiveBuffer::Buffer b = std::move( retired[i] );
+				retired.erase( retired.begin() + i );
+				return b;
+			}
+		}
+		ReceiveBuffer::Buffer b;
+		b.data = new (b.arena) uint8_t[size];
+		b.size = size;
+		return b;
+	}
+
+	void retire( ReceiveBuffer::Buffer&& b ) {
+		if (retired.size() >= FLOW_KNOBS->RECEIVE_BUFFER_POOL_SIZE) {
+			if (retired.empty()) return;
+			retired.erase( retired.begin() );
+		}
+		retired.push_back( std::move(b) );
+	}
+};
+
+// Run loop threads live as long as the process, so each thread's pool is never freed
+thread_local ReceiveBufferPool* threadReceiveBufferPool = NULL;
+
+ReceiveBufferPool& receiveBufferPool() {
+	if (!threadReceiveBufferPool) threadReceiveBufferPool = new ReceiveBufferPool;
+	return *threadReceiveBufferPool;
+}
+
+}
+
+ReceiveBuffer::ReceiveBuffer( Reference<IConnection> const& conn, int size ) : conn(conn), size(size) {
+	if (!this->size) this->size = FLOW_KNOBS->RECEIVE_BUFFER_BYTES;
+	if (!this->size) this->size = conn->getReceiveBufferSize();
+	this->size = std::max( 16<<10, std::min( this->size, 1<<20 ) );
+	buffer = receiveBufferPool().get( this->size );
+	begin = end = buffer.data;
+}
+
+ReceiveBuffer::~ReceiveBuffer() {
+	receiveBufferPool().retire( std::move(buffer) );
+}
+
+int ReceiveBuffer::read() {
+	if (begin == end && buffer.unreferenced())
+		begin = end = buffer.data;
+	else if (end == buffer.data + buffer.size)
+		nextBuffer();
+	int bytes = conn->read( end, buffer.data + buffer.size );
+	end += bytes;
+	return bytes;
+}
+
+void ReceiveBuffer::nextBuffer() {
+	// A partial message that fills the buffer needs a bigger one
+	int unconsumedBytes = end - begin;
+	Buffer next = receiveBufferPool().get( std::max( size, unconsumedBytes * 2 ) );
+	memcpy( next.data, begin, unconsumedBytes );
+	receiveBufferPool().retire( std::move(buffer) );
+	buffer = std::move(next);
+	begin = buffer.data;
+	end = begin + unconsumedBytes;
+}
+
+static std::string packetChainBytes( PacketBuffer* first, PacketBuffer* last ) {
+	std::string bytes;
+	for(PacketBuffer* b = first; b; b = b == last ? NULL : b->nextPacketBuffer())
+		bytes.append( (const char*)b->SendBuffer::data + b->bytes_sent, b->bytes_written - b->bytes_sent );
+	return bytes;
+}
+
+TEST_CASE("/flow/Net2Packet/zeroCopy") {
+	UnsentPacketQueue unsent;
+	ReliablePacketList reliable;
+	BinaryWriter expected(AssumeVersion(currentProtocolVersion));
+	uint8_t const* bigBytes = NULL;
+
+	for(int i = 0; i < 4; i++) {
+		Standalone<StringRef> value = makeString( i & 1 ? 10 : FLOW_KNOBS->ZERO_COPY_MIN_BYTES + 1000 );
+		for(int j = 0; j < value.size(); j++)
+			mutateString(value)[j] = uint8_t(i*7 + j);
+		if (!(i & 1)) bigBytes = value.begin();
+
+		ReliablePacket* rp = new ReliablePacket;
+		PacketWriter wr( unsent.getWriteBuffer(), rp, AssumeVersion(currentProtocolVersion) );
+		wr << i;
+		SerializeSourceZeroCopy( value ).serializePacketWriter( wr );
+		wr << i;
+		unsent.setWriteBuffer( wr.finish() );
+		reliable.insert( rp );
+		ASSERT( wr.size() == 2*sizeof(i) + sizeof(uint32_t) + value.size() );
+
+		expected << i;
+		SerializeSourceZeroCopy( value ).serializeBinaryWriter( expected );
+		expected << i;
+	}
+	std::string bytes( (const char*)expected.getData(), expected.getLength() );
+
+	// The large values are referenced in place, and kept alive by the packets after the Standalones are gone
+	bool referenced = false;
+	for(PacketBuffer* b = unsent.getUnsent(); b; b = b->nextPacketBuffer())
+		referenced = referenced || (b->external && b->SendBuffer::data == bigBytes);
+	ASSERT( referenced );
+	ASSERT( packetChainBytes( unsent.getUnsent(), NULL ) == bytes );
+
+	int sent = 0;
+	while (!unsent.empty()) {
+		int n = std::min<int>( g_random->randomInt(1, 10000), bytes.size() - sent );
+		unsent.sent( n );
+		sent += n;
+	}
+	ASSERT( sent == bytes.size() );
+
+	// Reliable packets are copied when they have to be resent
+	PacketBuffer* compacted = new PacketBuffer;
+	PacketBuffer* last = reliable.compact( compacted, NULL );
+	ASSERT( packetChainBytes( compacted, last ) == bytes );
+	for(PacketBuffer* b = compacted; b; ) {
+		PacketBuffer* n = b == last ? NULL : b->nextPacketBuffer();
+		b->delref();
+		b = n;
+	}
+	reliable.discardAll();
+	return Void();
+}
+
+namespace {
+
+// Delivers a fixed byte stream in random sized pieces
+struct TestConnection : IConnection, ReferenceCounted<TestConnection> {
+	std::string stream;
+	int position = 0;
+
+	virtual void addref() { ReferenceCounted<TestConnection>::addref(); }
+	virtual void delref() { ReferenceCounted<TestConnection>::delref(); }
+	virtual void close() {}
+	virtual Future<Void> onWritable() { return Void(); }
+	virtual Future<Void> onReadable() { return Void(); }
+	virtual int read( uint8_t* begin, uint8_t* end ) {
+		int size = std::min<int>( { int(end-begin), g_random->randomInt(0, 50000), int(stream.size()) - position } );
+		memcpy( begin, stream.data() + position, size );
+		position += size;
+		return size;
+	}
+	virtual int write( SendBuffer const* buffer, int limit ) { ASSERT(false); return 0; }
+	virtual NetworkAddress getPeerAddress() { return NetworkAddress(); }
+	virtual UID getDebugID() { return UID(); }
+};
+
+}
+
+TEST_CASE("/flow/Net2Packet/ReceiveBuffer") {
+	Reference<TestConnection> conn( new TestConnection );
+	BinaryWriter wr(AssumeVersion(currentProtocolVersion));
+	std::vector<std::string> expected;
+	for(int i = 0; i < 1000; i++) {
+		// Mostly small messages, with a few larger than the buffer
+		int size = g_random->random01() < 0.01 ? g_random->randomInt(20000, 100000) : g_random->randomInt(0, 2000);
+		expected.push_back( std::string( size, char(i) ) );
+		wr << StringRef( expected.back() );
+	}
+	conn->stream = std::string( (const char*)wr.getData(), wr.getLength() );
+
+	ReceiveBuffer rb( Reference<IConnection>(conn), 16<<10 );
+	std::vector<Standalone<StringRef>> received;
+	int inPlace = 0;
+	while (received.size() < expected.size()) {
+		rb.read();
+		ArenaReader reader( rb.arena(), rb.unconsumed(), AssumeVersion(currentProtocolVersion) );
+		while (true) {
+			StringRef remaining = reader.remaining();
+			uint32_t length;
+			if (remaining.size() < sizeof(length) || remaining.size() < sizeof(length) + *(uint32_t*)remaining.begin())
+				break;
+			StringRef message;
+			reader >> message;
+			inPlace += message.begin() >= remaining.begin() && message.end() <= remaining.end();
+			// Every other message is kept, which keeps its buffer from being reused
+			if (received.size() % 2 == 0)
+				received.push_back( Standalone<StringRef>( message, reader.arena() ) );
+			else
+				received.push_back( Standalone<StringRef>( message.toString() ) );
+		}
+		rb.consume( rb.unconsumed().size() - reader.remaining().size() );
+	}
+	ASSERT( inPlace == expected.size() );
+	for(int i = 0; i < expected.size(); i++)
+		ASSERT( received[i] == StringRef( expected[i] ) );
+	return Void();
+}
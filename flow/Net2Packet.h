@@ -84,4 +84,41 @@ private:
 	ReliablePacket reliable;  // Head/tail of a circularly linked list of reliable packets to be resent after a close
 };
 
+// Receives from an IConnection directly into pooled, reference counted Arena memory, so that messages can be
+// deserialized in place: an ArenaReader over arena() and unconsumed() hands out StringRefs that point into the
+// received bytes, and anything that depends on arena() keeps them alive.  The unconsumed bytes are always contiguous;
+// when the buffer fills, only they are copied to a new one.  Buffers are reused once nothing references them, either
+// in place or from a per-thread pool of retired buffers.
+class ReceiveBuffer : NonCopyable {
+public:
+	// size 0 means FLOW_KNOBS->RECEIVE_BUFFER_BYTES, or if that is 0 too, the connection's receive window
+	explicit ReceiveBuffer( Reference<IConnection> const& conn, int size = 0 );
+	~ReceiveBuffer();
+
+	// Reads whatever the connection has available (might be nothing) after the unconsumed bytes, and returns the number
+	// of bytes read.  Throws whatever IConnection::read() throws.
+	int read();
+
+	StringRef unconsumed() const { return StringRef( begin, end-begin ); }
+	Arena const& arena() const { return buffer.arena; }
+	void consume( int bytes ) { ASSERT( bytes <= end-begin ); begin += bytes; }
+
+	struct Buffer {
+		Arena arena;
+		uint8_t* data;
+		int size;
+
+		// True if the only reference to the memory is this one
+		bool unreferenced() const;
+	};
+
+private:
+	Reference<IConnection> conn;
+	int size;
+	Buffer buffer;
+	uint8_t *begin, *end;
+
+	void nextBuffer();
+};
+
 #endif
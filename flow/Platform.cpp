@@ -38,6 +38,7 @@
 #include <sstream>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
 
 #include <sys/types.h>
 #include <time.h>
@@ -101,6 +102,8 @@
 #include <signal.h>
 /* Needed for gnu_dev_{major,minor} */
 #include <sys/sysmacros.h>
+/* Needed for NUMA placement */
+#include <linux/mempolicy.h>
 #endif
 
 #ifdef __APPLE__
@@ -1545,35 +1548,126 @@ void *allocate(size_t length, bool allowLargePages) {
 	return block;
 }
 
-#if 0
-void* numaAllocate(size_t size) {
-	void* thePtr = (void*)0xA00000000LL;
-	enableLargePages();
+static std::atomic<bool> hugetlbFail(false);  // Any thread may allocate large pages
+void *allocateLargePages(size_t length) {
+	const size_t largePageSize = 2<<20;
+	ASSERT(length % largePageSize == 0);
+#ifdef __linux__
+	if (!hugetlbFail.load(std::memory_order_relaxed)) {
+		void* block = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED)
+			return block;
+		hugetlbFail.store(true, std::memory_order_relaxed);  // None are reserved, so don't keep asking
+	}
 
-	size_t vaPageSize = 2<<20;//64<<10;
-	int nVAPages = size / vaPageSize;
+	// Map one more page than needed, so that the block can be trimmed to start on a 2MB boundary
+	uint8_t* region = (uint8_t*)mmap(NULL, length + largePageSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED)
+		platform::outOfMemory();
+	uint8_t* block = (uint8_t*)(((uintptr_t)region + largePageSize - 1) & ~(uintptr_t)(largePageSize - 1));
+	if (block != region)
+		munmap(region, block - region);
+	if (region + largePageSize != block)
+		munmap(block + length, region + largePageSize - block);
+	madvise(block, length, MADV_HUGEPAGE);
+	return block;
+#else
+	return allocate(length, true);
+#endif
+}
 
-	int nodes;
-	if (!GetNumaHighestNodeNumber((PULONG)&nodes)) {
-		TraceEvent(SevError, "GetNumaHighestNodeNumber").getLastError();
-		throw platform_error();
+void freeLargePages(void* block, size_t length) {
+#ifdef _WIN32
+	VirtualFree(block, 0, MEM_RELEASE);
+#else
+	munmap(block, length);
+#endif
+}
+
+#ifdef __linux__
+static int readNumaNodeCount() {
+	// The online nodes are listed like "0-1,3"; the count is one more than the highest of them
+	int fd = open("/sys/devices/system/node/online", O_RDONLY);
+	if (fd < 0) return 1;
+	char buf[256];
+	int len = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	int highest = 0, n = 0;
+	for(int i = 0; i < len; i++) {
+		if (buf[i] >= '0' && buf[i] <= '9') {
+			n = n*10 + buf[i] - '0';
+			highest = std::max(highest, n);
+		} else
+			n = 0;
 	}
-	++nodes;
+	return highest + 1;
+}
+#endif
 
-	for(int i=0; i<nodes; i++) {
-		char* p = (char*)thePtr + i*nVAPages/nodes*vaPageSize;
-		char* e = (char*)thePtr + (i+1)*nVAPages/nodes*vaPageSize;
-		//printf("  %p + %lld\n", p, e-p);
-		// SOMEDAY: removed NUMA extensions for compatibity with Windows Server 2003 -- make execution dynamic
-		if (!VirtualAlloc/*ExNuma*/(/*GetCurrentProcess(),*/ p, e-p, MEM_COMMIT|MEM_RESERVE|MEM_LARGE_PAGES, PAGE_READWRITE/*, i*/)) {
-			Error e = platform_error();
-			TraceEvent(e, "VirtualAlloc").GetLastError();
-			throw e;
+int getNumaNodeCount() {
+#ifdef __linux__
+	static int nodes = readNumaNodeCount();
+	return nodes;
+#else
+	return 1;
+#endif
+}
+
+int getCurrentNumaNode() {
+#ifdef __linux__
+	unsigned cpu, node;
+	if (getNumaNodeCount() > 1 && syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return node;
+#endif
+	return 0;
+}
+
+int getNumaNodeOfAddress(const void* address) {
+#ifdef __linux__
+	int node = -1;
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, address, MPOL_F_NODE|MPOL_F_ADDR) == 0)
+		return node;
+	return -1;
+#else
+	return 0;
+#endif
+}
+
+bool bindToNumaNode(void* address, size_t length, int node) {
+#ifdef __linux__
+	unsigned long mask[16] = {};
+	const int bits = 8*sizeof(mask[0]);
+	if (node < 0 || node >= (int)(8*sizeof(mask)))
+		return false;
+	mask[node / bits] = 1UL << (node % bits);
+	return syscall(SYS_mbind, address, length, MPOL_PREFERRED, mask, 8*sizeof(mask), 0) == 0;
+#else
+	return false;
+#endif
+}
+
+void* numaAllocate(size_t size) {
+	const size_t pageSize = 4096;
+	uint8_t* block = (uint8_t*)allocate(size, false);
+	int nodes = getNumaNodeCount();
+	size_t pages = (size + pageSize - 1) / pageSize;
+	for(int i = 0; i < nodes; i++) {
+		size_t begin = pages * i / nodes * pageSize, end = pages * (i+1) / nodes * pageSize;
+		if (end > begin && !bindToNumaNode(block + begin, end - begin, i)) {
+			TraceEvent(SevWarnAlways, "NumaBindFailed").GetLastError().detail("Node", i);
+			break;
 		}
 	}
-	return thePtr;
+	return block;
 }
+
+void numaFree(void* block, size_t length) {
+#ifdef _WIN32
+	VirtualFree(block, 0, MEM_RELEASE);
+#else
+	munmap(block, length);
 #endif
+}
 
 void setAffinity(int proc) {
 #if defined(_WIN32)
@@ -2485,6 +2579,9 @@ void outOfMemory() {
 	TRACEALLOCATOR(2048);
 	TRACEALLOCATOR(4096);
 	TRACEALLOCATOR(8192);
+	TRACEALLOCATOR(16384);
+	TRACEALLOCATOR(32768);
+	TRACEALLOCATOR(65536);
 	g_traceBatch.dump();
 #endif
 
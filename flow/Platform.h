@@ -284,6 +284,28 @@ void setMemoryQuota(size_t limit);
 
 void *allocate(size_t length, bool allowLargePages);
 
+// Allocates length bytes, a multiple of 2MB, aligned to 2MB and backed by huge pages where the system allows it:
+// reserved huge pages if there are any, or else transparent huge pages.  Falls back to normal pages.
+void *allocateLargePages(size_t length);
+void freeLargePages(void* block, size_t length);
+
+// Allocates length bytes split into one contiguous range per NUMA node, in node order
+void *numaAllocate(size_t length);
+void numaFree(void* block, size_t length);
+
+// Returns the number of NUMA nodes in the system, or 1 if it cannot be determined
+int getNumaNodeCount();
+
+// Returns the NUMA node that the calling thread is running on
+int getCurrentNumaNode();
+
+// Returns the NUMA node holding the page at the given address, or -1 if it cannot be determined
+int getNumaNodeOfAddress(const void* address);
+
+// Asks the system to place the pages of [address, address+length) on the given NUMA node.  Returns false if it
+// can't, in which case pages are placed on the node of the thread that first touches them.
+bool bindToNumaNode(void* address, size_t length, int node);
+
 void setAffinity(int proc);
 
 void threadSleep( double seconds );
@@ -558,8 +580,16 @@ inline static int ctzll( uint64_t value ) {
     }
     return 64;
 }
+inline static int clzll( uint64_t value ) {
+    unsigned long index = 0;
+    if( _BitScanReverse64( &index, value ) ) {
+        return 63 - index;
+    }
+    return 64;
+}
 #else
 #define ctzll __builtin_ctzll
+#define clzll __builtin_clzll
 #endif
 
 #include <boost/config.hpp>
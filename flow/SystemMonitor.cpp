@@ -50,6 +50,46 @@ SystemStatistics getSystemStatistics() {
 
 #define TRACEALLOCATOR( size ) TraceEvent("MemSample").detail("Count", FastAllocator<size>::getApproximateMemoryUnused()/size).detail("TotalSize", FastAllocator<size>::getApproximateMemoryUnused()).detail("SampleCount", 1).detail("Hash", "FastAllocatedUnused" #size ).detail("Bt", "na")
 #define DETAILALLOCATORMEMUSAGE( size ) detail("TotalMemory"#size, FastAllocator<size>::getTotalMemory()).detail("ApproximateUnusedMemory"#size, FastAllocator<size>::getApproximateMemoryUnused()).detail("ActiveThreads"#size, FastAllocator<size>::getActiveThreads())
+#define DETAILALLOCATORPOOLUSAGE( size ) detail("ReclaimedMemory"#size, FastAllocator<size>::getReclaimedMemory()).detail("CrossNodeFrees"#size, FastAllocator<size>::getCrossNodeFrees()).detail("RemoteMagazines"#size, FastAllocator<size>::getRemoteMagazines())
+
+// The cycles within which fraction p of the given queueing delays fall, as the start of the bin that reaches p
+static int64_t queuedPercentile( uint32_t const* queued, uint64_t tasks, double p ) {
+	uint64_t seen = 0;
+	for (int b = 0; b < NetworkMetrics::QUEUED_BINS; b++) {
+		seen += queued[b];
+		if (seen >= p * tasks) return NetworkMetrics::queuedBinStart(b);
+	}
+	return NetworkMetrics::queuedBinStart(NetworkMetrics::QUEUED_BINS-1);
+}
+
+// One TaskMetrics event for each TaskID that ran tasks on the given run loop since the last one
+static void traceTaskMetrics(NetworkMetrics const& current, NetworkMetrics const& last, int runLoop, double cyclesPerSecond) {
+	uint64_t totalCycles = 0;
+	for (int i = 0; i < NetworkMetrics::TASK_STATS_SLOTS; i++)
+		totalCycles += current.taskStats[i].cycles - last.taskStats[i].cycles;
+
+	for (int i = 0; i < NetworkMetrics::TASK_STATS_SLOTS; i++) {
+		NetworkMetrics::TaskStats const& s = current.taskStats[i];
+		uint64_t tasks = s.tasks - last.taskStats[i].tasks;
+		if (!tasks) continue;
+		uint32_t queued[NetworkMetrics::QUEUED_BINS];
+		int maxBin = 0;
+		for (int b = 0; b < NetworkMetrics::QUEUED_BINS; b++) {
+			queued[b] = s.queued[b] - last.taskStats[i].queued[b];
+			if (queued[b]) maxBin = b;
+		}
+		uint64_t cycles = s.cycles - last.taskStats[i].cycles;
+		TraceEvent("TaskMetrics")
+			.detail("RunLoop", runLoop)
+			.detail("TaskID", s.taskID)
+			.detail("Tasks", tasks)
+			.detail("CPUSeconds", cycles / cyclesPerSecond)
+			.detail("CPUFraction", (double)cycles / std::max<uint64_t>(totalCycles, 1))
+			.detail("QueuedP50", queuedPercentile(queued, tasks, 0.5) / cyclesPerSecond)
+			.detail("QueuedP99", queuedPercentile(queued, tasks, 0.99) / cyclesPerSecond)
+			.detail("QueuedMax", NetworkMetrics::queuedBinStart(maxBin) / cyclesPerSecond);
+	}
+}
 
 SystemStatistics customSystemMonitor(std::string eventName, StatisticsState *statState, bool machineMetrics) {
 	const IPAddress ipAddr = machineState.ip.present() ? machineState.ip.get() : IPAddress();
@@ -57,6 +97,9 @@ SystemStatistics customSystemMonitor(std::string eventName, StatisticsState *sta
 	                                                    &ipAddr, &statState->systemState, true);
 	NetworkData netData;
 	netData.init();
+	std::vector<NetworkMetrics> runLoopMetrics( g_network->getRunLoopCount() );
+	for (int i = 1; i < runLoopMetrics.size(); i++)
+		g_network->getRunLoopMetrics(i, runLoopMetrics[i]);
 	if (!DEBUG_DETERMINISM && currentStats.initialized) {
 		{
 			TraceEvent e(eventName.c_str());
@@ -101,6 +144,8 @@ SystemStatistics customSystemMonitor(std::string eventName, StatisticsState *sta
 				.detail("ConnectionErrors", (netData.countConnClosedWithError - statState->networkState.countConnClosedWithError) / currentStats.elapsed)
 				.trackLatest(eventName.c_str());
 
+			int64_t arenaVectorAbandonedBytes, arenaVectorGrownInPlaceBytes;
+			getArenaVectorStats( arenaVectorAbandonedBytes, arenaVectorGrownInPlaceBytes );
 			TraceEvent("MemoryMetrics")
 				.DETAILALLOCATORMEMUSAGE(16)
 				.DETAILALLOCATORMEMUSAGE(32)
@@ -112,7 +157,28 @@ SystemStatistics customSystemMonitor(std::string eventName, StatisticsState *sta
 				.DETAILALLOCATORMEMUSAGE(2048)
 				.DETAILALLOCATORMEMUSAGE(4096)
 				.DETAILALLOCATORMEMUSAGE(8192)
-				.detail("HugeArenaMemory", g_hugeArenaMemory);
+				.DETAILALLOCATORMEMUSAGE(16384)
+				.DETAILALLOCATORMEMUSAGE(32768)
+				.DETAILALLOCATORMEMUSAGE(65536)
+				.detail("HugeArenaMemory", g_hugeArenaMemory)
+				.detail("ArenaFreePendingBytes", g_arenaFreePendingBytes.load( std::memory_order_relaxed ))
+				.detail("ArenaVectorAbandonedBytes", arenaVectorAbandonedBytes)
+				.detail("ArenaVectorGrownInPlaceBytes", arenaVectorGrownInPlaceBytes);
+
+			TraceEvent("MemoryPoolMetrics")
+				.DETAILALLOCATORPOOLUSAGE(16)
+				.DETAILALLOCATORPOOLUSAGE(32)
+				.DETAILALLOCATORPOOLUSAGE(64)
+				.DETAILALLOCATORPOOLUSAGE(128)
+				.DETAILALLOCATORPOOLUSAGE(256)
+				.DETAILALLOCATORPOOLUSAGE(512)
+				.DETAILALLOCATORPOOLUSAGE(1024)
+				.DETAILALLOCATORPOOLUSAGE(2048)
+				.DETAILALLOCATORPOOLUSAGE(4096)
+				.DETAILALLOCATORPOOLUSAGE(8192)
+				.DETAILALLOCATORPOOLUSAGE(16384)
+				.DETAILALLOCATORPOOLUSAGE(32768)
+				.DETAILALLOCATORPOOLUSAGE(65536);
 
 			TraceEvent n("NetworkMetrics");
 			n
@@ -129,18 +195,34 @@ SystemStatistics customSystemMonitor(std::string eventName, StatisticsState *sta
 				.detail("ASIOEventsProcessed", netData.countASIOEvents - statState->networkState.countASIOEvents)
 				.detail("ReadCalls", netData.countReads - statState->networkState.countReads)
 				.detail("WriteCalls", netData.countWrites - statState->networkState.countWrites)
+				.detail("CoalescedWriteCalls", netData.countCoalescedWrites - statState->networkState.countCoalescedWrites)
+				.detail("CoalescedBytesPerWrite", (netData.coalescedWriteBytes - statState->networkState.coalescedWriteBytes) / std::max<double>(1, netData.countCoalescedWrites - statState->networkState.countCoalescedWrites))
 				.detail("ReadProbes", netData.countReadProbes - statState->networkState.countReadProbes)
 				.detail("WriteProbes", netData.countWriteProbes - statState->networkState.countWriteProbes)
 				.detail("PacketsRead", netData.countPacketsReceived - statState->networkState.countPacketsReceived)
 				.detail("PacketsGenerated", netData.countPacketsGenerated - statState->networkState.countPacketsGenerated)
 				.detail("WouldBlock", netData.countWouldBlock - statState->networkState.countWouldBlock);
 
+			if (FLOW_KNOBS->REACTOR_SPIN_MAX > 0)
+				n.detail("SpinWakeups", g_network->networkMetrics.countSpinWakeups - statState->networkMetricsState.countSpinWakeups)
+					.detail("SpinSeconds", g_network->networkMetrics.secSpinning - statState->networkMetricsState.secSpinning);
+			n.detail("SleepSeconds", g_network->networkMetrics.secSleeping - statState->networkMetricsState.secSleeping);
+
 			for (int i = 0; i<NetworkMetrics::SLOW_EVENT_BINS; i++)
 				if (int c = g_network->networkMetrics.countSlowEvents[i] - statState->networkMetricsState.countSlowEvents[i])
 					n.detail(format("SlowTask%dM", 1 << i).c_str(), c);
 			for (int i = 0; i<NetworkMetrics::PRIORITY_BINS; i++)
 				if (double x = g_network->networkMetrics.secSquaredPriorityBlocked[i] - statState->networkMetricsState.secSquaredPriorityBlocked[i])
 					n.detail(format("S2Pri%d", g_network->networkMetrics.priorityBins[i]).c_str(), x);
+			if (uint64_t c = g_network->networkMetrics.countUntrackedTasks - statState->networkMetricsState.countUntrackedTasks)
+				n.detail("UntrackedTasks", c);
+
+			if (statState->tsc) {
+				double cyclesPerSecond = (__rdtsc() - statState->tsc) / (timer_monotonic() - statState->tscTime);
+				traceTaskMetrics(g_network->networkMetrics, statState->networkMetricsState, 0, cyclesPerSecond);
+				for (int i = 1; i < runLoopMetrics.size() && i < statState->runLoopMetricsState.size(); i++)
+					traceTaskMetrics(runLoopMetrics[i], statState->runLoopMetricsState[i], i, cyclesPerSecond);
+			}
 		}
 
 		if(machineMetrics) {
@@ -263,10 +345,16 @@ SystemStatistics customSystemMonitor(std::string eventName, StatisticsState *sta
 			TRACEALLOCATOR(2048);
 			TRACEALLOCATOR(4096);
 			TRACEALLOCATOR(8192);
+			TRACEALLOCATOR(16384);
+			TRACEALLOCATOR(32768);
+			TRACEALLOCATOR(65536);
 		}
 	}
 #endif
 	statState->networkMetricsState = g_network->networkMetrics;
+	statState->runLoopMetricsState = std::move(runLoopMetrics);
+	statState->tsc = __rdtsc();
+	statState->tscTime = timer_monotonic();
 	statState->networkState = netData;
 	return currentStats;
 }
@@ -52,6 +52,8 @@ struct NetworkData {
 	int64_t countReads;
 	int64_t countWouldBlock;
 	int64_t countWrites;
+	int64_t countCoalescedWrites;
+	int64_t coalescedWriteBytes;
 	int64_t countRunLoop;
 	int64_t countCantSleep;
 	int64_t countWontSleep;
@@ -96,6 +98,8 @@ struct NetworkData {
 		countReads = getValue(LiteralStringRef("Net2.CountReads"));
 		countWouldBlock = getValue(LiteralStringRef("Net2.CountWouldBlock"));
 		countWrites = getValue(LiteralStringRef("Net2.CountWrites"));
+		countCoalescedWrites = getValue(LiteralStringRef("Net2.CountCoalescedWrites"));
+		coalescedWriteBytes = getValue(LiteralStringRef("Net2.CoalescedWriteBytes"));
 		countRunLoop = getValue(LiteralStringRef("Net2.CountRunLoop"));
 		countCantSleep = getValue(LiteralStringRef("Net2.CountCantSleep"));
 		countWontSleep = getValue(LiteralStringRef("Net2.CountWontSleep"));
@@ -128,8 +132,11 @@ struct StatisticsState {
 	SystemStatisticsState *systemState;
 	NetworkData networkState;
 	NetworkMetrics networkMetricsState;
+	std::vector<NetworkMetrics> runLoopMetricsState;  // By run loop, from INetwork::getRunLoopMetrics(); 0 is networkMetricsState
+	int64_t tsc;  // When networkMetricsState was taken, to convert its cycle counts to seconds
+	double tscTime;
 
-	StatisticsState() : systemState(NULL) {}
+	StatisticsState() : systemState(NULL), tsc(0), tscTime(0) {}
 };
 
 void systemMonitor();
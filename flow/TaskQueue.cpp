@@ -0,0 +1,220 @@
+/*
+ * TaskQueue.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/UnitTest.h"
+#include "flow/TaskQueue.h"
+#include <limits>
+#include <map>
+#include <queue>
+#include <tuple>
+
+namespace {
+
+struct TestTask {
+	int64_t priority;
+	int taskID;
+	double at;
+	int* index;  // For TimerWheel
+	double deadline;  // For ReadyQueue::pushByDeadline()
+	TestTask( int64_t priority, int taskID, double at = 0, int* index = nullptr ) : priority(priority), taskID(taskID), at(at), index(index), deadline(0) {}
+	int* wheelIndex() const { return index; }
+	bool operator < (TestTask const& rhs) const { return priority < rhs.priority; }
+};
+
+struct LaterTask {
+	bool operator()( TestTask const& a, TestTask const& b ) const { return a.at > b.at; }
+};
+
+}
+
+TEST_CASE("/flow/TaskQueue/ReadyQueue/ordering") {
+	static const int taskIDs[] = { TaskMaxPriority, TaskWriteSocket, TaskReadSocket, TaskDefaultDelay, TaskDefaultYield, TaskDefaultYield|1, TaskLowPriority, TaskMinPriority };
+	ReadyQueue<TestTask> q;
+	std::priority_queue<TestTask> heap;
+	int64_t seq = 0;
+
+	for(int i = 0; i < 100000; i++) {
+		if (heap.empty() || g_random->random01() < 0.55) {
+			int taskID = taskIDs[ g_random->randomInt(0, sizeof(taskIDs)/sizeof(taskIDs[0])) ];
+			// Occasionally reuse an old sequence number, as an expired timer does
+			int64_t s = (seq && g_random->random01() < 0.1) ? g_random->randomInt64(0, seq) : ++seq;
+			TestTask t( (int64_t(taskID)<<32) - s, taskID );
+			q.push( t );
+			heap.push( t );
+		} else {
+			ASSERT( q.top().priority == heap.top().priority && q.top().taskID == heap.top().taskID );
+			q.pop();
+			heap.pop();
+		}
+		ASSERT( q.size() == heap.size() );
+	}
+	q.clear();
+	ASSERT( q.empty() );
+	q.push( TestTask( int64_t(TaskMinPriority)<<32, TaskMinPriority ) );
+	ASSERT( q.top().taskID == TaskMinPriority );
+	return Void();
+}
+
+TEST_CASE("/flow/TaskQueue/ReadyQueue/deadlines") {
+	// Tasks of TaskIDs in [TaskLowPriority, TaskDefaultYield] go to one band, ordered by deadline and then priority.  Few
+	// distinct deadlines are used, so that many tasks share one.
+	static const int taskIDs[] = { TaskWriteSocket, TaskDefaultYield, TaskDefaultEndpoint, TaskLowPriority, TaskMinPriority };
+	ReadyQueue<TestTask> q;
+	std::priority_queue<std::tuple<int, double, int64_t>> heap;  // (taskID or band, -deadline, priority)
+	int64_t seq = 0;
+
+	for(int i = 0; i < 100000; i++) {
+		if (heap.empty() || g_random->random01() < 0.55) {
+			int taskID = taskIDs[ g_random->randomInt(0, sizeof(taskIDs)/sizeof(taskIDs[0])) ];
+			TestTask t( (int64_t(taskID)<<32) - ++seq, taskID );
+			if (taskID <= TaskDefaultYield && taskID >= TaskLowPriority) {
+				t.deadline = g_random->randomInt(0, 100);
+				q.pushByDeadline( t, TaskDefaultYield );
+				heap.push( std::make_tuple( int(TaskDefaultYield), -t.deadline, t.priority ) );
+			} else {
+				q.push( t );
+				heap.push( std::make_tuple( taskID, 0.0, t.priority ) );
+			}
+		} else {
+			ASSERT( q.topKey() == std::get<0>(heap.top()) && q.top().priority == std::get<2>(heap.top()) );
+			q.pop();
+			heap.pop();
+		}
+		ASSERT( q.size() == heap.size() );
+	}
+	return Void();
+}
+
+TEST_CASE("/flow/TaskQueue/ReadyQueue/deadlineFIFO") {
+	// As in Net2::pushReady, tasks of one taskID made ready in one run loop iteration share a deadline, and must run in
+	// the order of their sequence numbers
+	ReadyQueue<TestTask> q;
+	int64_t seq = 0;
+	for(int i = 0; i < 100; i++) {
+		TestTask t( (int64_t(TaskDefaultYield)<<32) - ++seq, TaskDefaultYield );
+		t.deadline = i < 50 ? 1.0 : 0.5;
+		q.pushByDeadline( t, TaskDefaultYield );
+	}
+	for(int i = 0; i < 100; i++) {
+		ASSERT( q.top().priority == (int64_t(TaskDefaultYield)<<32) - (i < 50 ? 51 + i : i - 49) );
+		q.pop();
+	}
+
+	// Once the band is empty its taskID can be pushed in FIFO order again
+	ASSERT( q.empty() );
+	for(int i = 1; i <= 10; i++)
+		q.push( TestTask( (int64_t(TaskDefaultYield)<<32) - ++seq, TaskDefaultYield ) );
+	for(int i = 1; i <= 10; i++) {
+		ASSERT( q.top().priority == (int64_t(TaskDefaultYield)<<32) - (100 + i) );
+		q.pop();
+	}
+	return Void();
+}
+
+TEST_CASE("/flow/TaskQueue/TimerWheel/expire") {
+	TimerWheel<TestTask> wheel;
+	std::priority_queue<TestTask, std::vector<TestTask>, LaterTask> heap;
+	double now = 1.5e9;
+	int64_t seq = 0;
+	std::vector<int> indices( 100001 );
+
+	wheel.expire( now, [](TestTask const&) { ASSERT(false); } );
+	for(int i = 0; i < 100000; i++) {
+		double r = g_random->random01();
+		if (r < 0.5) {
+			// Mostly short delays, with some that cascade from upper levels or land in the overflow list
+			double d = r < 0.4 ? g_random->random01() * 0.1 : r < 0.49 ? g_random->random01() * 1000 : g_random->random01() * 1e9;
+			++seq;
+			TestTask t( seq, TaskDefaultDelay, now + d, &indices[seq] );
+			wheel.add( t );
+			heap.push( t );
+		} else {
+			now += g_random->random01() < 0.99 ? g_random->random01() * 0.01 : g_random->random01() * 100;
+			std::vector<int64_t> fired;
+			wheel.expire( now, [&fired, now](TestTask const& t) { ASSERT( t.at < now ); fired.push_back(t.priority); } );
+			std::vector<int64_t> expected;
+			while (!heap.empty() && heap.top().at < now) {
+				expected.push_back( heap.top().priority );
+				heap.pop();
+			}
+			std::sort( fired.begin(), fired.end() );
+			std::sort( expected.begin(), expected.end() );
+			ASSERT( fired == expected );
+		}
+		ASSERT( wheel.size() == heap.size() );
+		if (!heap.empty())
+			ASSERT( wheel.nextExpiry() == heap.top().at );
+	}
+	return Void();
+}
+
+TEST_CASE("/flow/TaskQueue/TimerWheel/remove") {
+	TimerWheel<TestTask> wheel;
+	std::map<int64_t, TestTask> live;  // By priority
+	double now = 1.5e9;
+	int64_t seq = 0;
+	std::vector<int> indices( 100001 );
+
+	wheel.expire( now, [](TestTask const&) { ASSERT(false); } );
+	for(int i = 0; i < 100000; i++) {
+		double r = g_random->random01();
+		if (r < 0.45) {
+			double d = r < 0.35 ? g_random->random01() * 0.1 : r < 0.44 ? g_random->random01() * 1000 : g_random->random01() * 1e9;
+			++seq;
+			TestTask t( seq, TaskDefaultDelay, now + d, &indices[seq] );
+			wheel.add( t );
+			live.emplace( seq, t );
+		} else if (r < 0.9) {
+			// Cancel a random live task, most of them before they would expire
+			if (live.empty()) continue;
+			auto t = live.lower_bound( g_random->randomInt64( 1, seq+1 ) );
+			if (t == live.end()) t = live.begin();
+			wheel.remove( t->second );
+			ASSERT( indices[t->first] == -1 );
+			live.erase( t );
+		} else {
+			now += g_random->random01() < 0.99 ? g_random->random01() * 0.01 : g_random->random01() * 100;
+			std::vector<int64_t> fired;
+			wheel.expire( now, [&fired, &indices, now](TestTask const& t) {
+				ASSERT( t.at < now && indices[t.priority] == -1 );
+				fired.push_back(t.priority);
+			} );
+			std::vector<int64_t> expected;
+			for(auto t = live.begin(); t != live.end(); ) {
+				if (t->second.at < now) {
+					expected.push_back( t->first );
+					t = live.erase( t );
+				} else
+					++t;
+			}
+			std::sort( fired.begin(), fired.end() );
+			ASSERT( fired == expected );
+		}
+		ASSERT( wheel.size() == live.size() );
+		double earliest = std::numeric_limits<double>::max();
+		for(auto& t : live) {
+			ASSERT( indices[t.first] >= 0 );
+			earliest = std::min( earliest, t.second.at );
+		}
+		if (!live.empty())
+			ASSERT( wheel.nextExpiry() == earliest );
+	}
+	return Void();
+}
@@ -0,0 +1,459 @@
+/*
+ * TaskQueue.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FLOW_TASKQUEUE_H
+#define FLOW_TASKQUEUE_H
+#pragma once
+
+#include "flow/Error.h"
+#include "flow/Deque.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// ReadyQueue is a replacement for std::priority_queue<T> for run loop tasks, where T has an int taskID and an
+// int64_t priority of the form (int64_t(taskID)<<32) - sequenceNumber.  Tasks are kept in one FIFO per taskID,
+// and a three level bitmap over the taskID space finds the highest non-empty bucket, so push() and pop() are O(1)
+// instead of O(log n).  The ordering is the same as the heap: highest taskID first, then lowest sequence number.
+// Tasks pushed out of sequence order (e.g. expired timers) are placed by priority within their bucket.
+//
+// pushByDeadline() instead files a task in the bucket of the given band, which may hold tasks of several taskIDs and
+// is kept as a binary heap on T's double deadline and then on priority, so a band (see Net2::pushReady) runs its tasks
+// earliest deadline first at the band's place in the taskID order, and tasks with equal deadlines in priority order as
+// push() would.  A band must only receive pushByDeadline() until it is next empty.
+template <class T>
+class ReadyQueue {
+public:
+	enum { TASKID_BITS = 20, MAX_TASKID = (1<<TASKID_BITS)-1 };
+
+	ReadyQueue() : count(0), topBucket(-1), topTaskID(-1), index(INITIAL_INDEX_SIZE, IndexEntry()) {
+		memset(bits0, 0, sizeof(bits0));
+		memset(bits1, 0, sizeof(bits1));
+		bits2 = new uint64_t[ BITS2_WORDS ];
+		memset(bits2, 0, sizeof(uint64_t)*BITS2_WORDS);
+	}
+	~ReadyQueue() { delete[] bits2; }
+
+	bool empty() const { return count == 0; }
+	size_t size() const { return count; }
+
+	T const& top() const { return buckets[topBucket].front(); }
+
+	void push( T const& t ) {
+		ASSERT( t.taskID >= 0 && t.taskID <= MAX_TASKID );
+		int b = bucketFor( t.taskID );
+		ASSERT( !heapOrdered[b] );
+		Deque<T>& q = buckets[b];
+		if (q.empty()) {
+			setBit( t.taskID );
+			q.push_back( t );
+		} else if (q.back().priority > t.priority) {
+			q.push_back( t );
+		} else if (q.front().priority < t.priority) {
+			q.push_front( t );
+		} else {
+			q.push_back( t );
+			for(int i = q.size()-1; i > 0 && q[i-1].priority < q[i].priority; i--)
+				std::swap( q[i-1], q[i] );
+		}
+		++count;
+		if (t.taskID > topTaskID) {
+			topTaskID = t.taskID;
+			topBucket = b;
+		}
+	}
+
+	void pushByDeadline( T const& t, int band ) {
+		ASSERT( band >= 0 && band <= MAX_TASKID );
+		int b = bucketFor( band );
+		Deque<T>& q = buckets[b];
+		heapOrdered[b] = true;
+		if (q.empty()) setBit( band );
+		q.push_back( t );
+		for(int i = q.size()-1; i > 0 && runsBefore( q[i], q[(i-1)/2] ); i = (i-1)/2)
+			std::swap( q[(i-1)/2], q[i] );
+		++count;
+		if (band > topTaskID) {
+			topTaskID = band;
+			topBucket = b;
+		}
+	}
+
+	// The taskID, or band, of top()
+	int topKey() const { return topTaskID; }
+
+	void pop() {
+		Deque<T>& q = buckets[topBucket];
+		if (heapOrdered[topBucket]) {
+			std::swap( q[0], q[q.size()-1] );
+			q.pop_back();
+			for(int i = 0, n = q.size();;) {
+				int c = 2*i+1;
+				if (c >= n) break;
+				if (c+1 < n && runsBefore( q[c+1], q[c] )) c++;
+				if (!runsBefore( q[c], q[i] )) break;
+				std::swap( q[i], q[c] );
+				i = c;
+			}
+		} else
+			q.pop_front();
+		--count;
+		if (q.empty()) {
+			heapOrdered[topBucket] = false;
+			clearBit( topTaskID );
+			findTop();
+		}
+	}
+
+	void clear() {
+		for(auto& e : index) {
+			if (e.taskID >= 0 && !buckets[e.bucket].empty()) {
+				buckets[e.bucket].clear();
+				heapOrdered[e.bucket] = false;
+				clearBit( e.taskID );
+			}
+		}
+		count = 0;
+		topBucket = topTaskID = -1;
+	}
+
+private:
+	enum { INITIAL_INDEX_SIZE = 256, BITS2_WORDS = 1<<(TASKID_BITS-6), BITS1_WORDS = 1<<(TASKID_BITS-12), BITS0_WORDS = 1<<(TASKID_BITS-18) };
+
+	struct IndexEntry {
+		int taskID, bucket;
+		IndexEntry() : taskID(-1), bucket(-1) {}
+	};
+
+	size_t count;
+	int topBucket, topTaskID;
+	std::vector<Deque<T>> buckets;
+	std::vector<bool> heapOrdered;  // Per bucket: a band filled by pushByDeadline()
+	std::vector<IndexEntry> index;  // Open addressed hash from taskID to bucket, never more than half full
+
+	// Bit i is set in the bitmaps when the bucket for taskID MAX_TASKID-i is non-empty, so the lowest set bit
+	// is the highest priority
+	uint64_t bits0[ BITS0_WORDS ];
+	uint64_t bits1[ BITS1_WORDS ];
+	uint64_t* bits2;
+
+	ReadyQueue( ReadyQueue const& );  // not implemented
+	void operator=( ReadyQueue const& );  // not implemented
+
+	static uint32_t hashTaskID( int taskID ) { return uint32_t(taskID) * 2654435761u; }
+
+	// The order of tasks in a band
+	static bool runsBefore( T const& a, T const& b ) {
+		return a.deadline < b.deadline || (a.deadline == b.deadline && a.priority > b.priority);
+	}
+
+	int bucketFor( int taskID ) {
+		size_t mask = index.size() - 1;
+		for(size_t i = hashTaskID(taskID) & mask; ; i = (i+1) & mask) {
+			if (index[i].taskID == taskID) return index[i].bucket;
+			if (index[i].taskID < 0) {
+				index[i].taskID = taskID;
+				index[i].bucket = buckets.size();
+				buckets.emplace_back();
+				heapOrdered.push_back( false );
+				if (buckets.size()*2 > index.size()) growIndex();
+				return buckets.size()-1;
+			}
+		}
+	}
+
+	void growIndex() {
+		std::vector<IndexEntry> old( index.size()*2, IndexEntry() );
+		std::swap( old, index );
+		size_t mask = index.size() - 1;
+		for(auto& e : old) {
+			if (e.taskID < 0) continue;
+			size_t i = hashTaskID(e.taskID) & mask;
+			while (index[i].taskID >= 0) i = (i+1) & mask;
+			index[i] = e;
+		}
+	}
+
+	void setBit( int taskID ) {
+		uint32_t i = MAX_TASKID - taskID;
+		bits2[i>>6] |= uint64_t(1) << (i&63);
+		bits1[i>>12] |= uint64_t(1) << ((i>>6)&63);
+		bits0[i>>18] |= uint64_t(1) << ((i>>12)&63);
+	}
+
+	void clearBit( int taskID ) {
+		uint32_t i = MAX_TASKID - taskID;
+		if (bits2[i>>6] &= ~(uint64_t(1) << (i&63))) return;
+		if (bits1[i>>12] &= ~(uint64_t(1) << ((i>>6)&63))) return;
+		bits0[i>>18] &= ~(uint64_t(1) << ((i>>12)&63));
+	}
+
+	void findTop() {
+		if (!count) {
+			topBucket = topTaskID = -1;
+			return;
+		}
+		int w0 = 0;
+		while (!bits0[w0]) w0++;
+		uint32_t w1 = (w0<<6) + ctzll(bits0[w0]);
+		uint32_t w2 = (w1<<6) + ctzll(bits1[w1]);
+		uint32_t i = (w2<<6) + ctzll(bits2[w2]);
+		topTaskID = MAX_TASKID - i;
+		topBucket = bucketFor( topTaskID );
+	}
+};
+
+// TimerWheel holds tasks with a double `at` field until they expire.  It is a hierarchical timer wheel with LEVELS
+// levels of 64 slots each; a slot at level L covers 64^L ticks of 1/TICKS_PER_SECOND seconds.  A task is filed at the
+// lowest level whose window contains both its expiration tick and the current tick, and is cascaded to lower levels
+// as the current time advances.  Expiration is exact: expire(now) hands out every task with at < now and no others,
+// and nextExpiry() is the exact earliest `at`, so the wheel can be used in place of a heap ordered by `at`.
+//
+// T also has `int* wheelIndex() const`, an int that the wheel keeps as the task's index within its slot while the task
+// is in the wheel, and sets to -1 as it leaves, so that remove() is O(1).  A slot is recomputed from `at` and the
+// current tick, since a task is always in the slot that add() would file it in now.
+//
+// Each slot also keeps the smallest `at` of its tasks, lowered as tasks are added and marked stale when a task with
+// that `at` is removed, so that nextExpiry() only scans a slot again after its earliest task has been cancelled.
+template <class T>
+class TimerWheel {
+public:
+	enum { LEVELS = 6, SLOT_BITS = 6, SLOTS = 1<<SLOT_BITS };
+	static constexpr double TICKS_PER_SECOND = 1024;
+
+	TimerWheel() : currentTick(0), count(0) {
+		memset(occupied, 0, sizeof(occupied));
+		memset(levelCount, 0, sizeof(levelCount));
+		memset(minStale, 0, sizeof(minStale));
+	}
+
+	bool empty() const { return count == 0; }
+	size_t size() const { return count; }
+
+	void add( T const& t ) {
+		place( t, std::max( currentTick, toTick(t.at) ) );
+		++count;
+	}
+
+	// Removes the task with t's `at` and wheelIndex(), which must be in the wheel.  Must not be called from expire().
+	void remove( T const& t ) {
+		int* index = t.wheelIndex();
+		int i = *index;
+		ASSERT( i >= 0 );
+		int level, slot;
+		std::vector<T>& s = locate( std::max( currentTick, toTick(t.at) ), level, slot );
+		if (i != s.size()-1) {
+			s[i] = s.back();
+			*s[i].wheelIndex() = i;
+		}
+		s.pop_back();
+		*index = -1;
+		--count;
+		if (t.at == minAt[level][slot]) minStale[level] |= uint64_t(1) << slot;
+		if (level < LEVELS) {
+			--levelCount[level];
+			if (s.empty()) occupied[level] &= ~(uint64_t(1) << slot);
+		}
+	}
+
+	// Returns the smallest `at` of any task in the wheel; the wheel must not be empty
+	double nextExpiry() const {
+		for(int l = 0; l < LEVELS; l++)
+			if (occupied[l])
+				return slotMin( l, ctzll(occupied[l]) );
+		ASSERT( overflow.size() );
+		return slotMin( LEVELS, 0 );
+	}
+
+	// Calls onExpired(t) and removes t for every task with t.at < now.  onExpired must not add or remove tasks.
+	template <class F>
+	void expire( double now, F&& onExpired ) {
+		int64_t newTick = std::max( currentTick, toTick(now) );
+
+		// Level 0 slots are single ticks, so every slot before newTick has expired entirely
+		if (levelCount[0]) {
+			if ((newTick >> SLOT_BITS) != (currentTick >> SLOT_BITS)) {
+				while (occupied[0])
+					fireSlot( 0, ctzll(occupied[0]), onExpired );
+			} else {
+				for(int i = currentTick & (SLOTS-1); i < (newTick & (SLOTS-1)); i++)
+					if (occupied[0] & (uint64_t(1) << i))
+						fireSlot( 0, i, onExpired );
+				expireSlot( newTick & (SLOTS-1), now, onExpired );
+			}
+		}
+
+		int64_t oldTick = currentTick;
+		currentTick = newTick;
+		if (oldTick == newTick || count == 0) return;
+
+		// Cascade higher levels whose windows have been reached, top down, refiling relative to the new current tick
+		if ((oldTick >> (LEVELS*SLOT_BITS)) != (newTick >> (LEVELS*SLOT_BITS)) && overflow.size()) {
+			std::swap( scratch, overflow );
+			refile( now, onExpired );
+		}
+		for(int l = LEVELS-1; l >= 1; l--) {
+			if (!levelCount[l]) continue;
+			int shift = l*SLOT_BITS;
+			if ((oldTick >> (shift+SLOT_BITS)) != (newTick >> (shift+SLOT_BITS))) {
+				while (occupied[l])
+					takeSlot( l, ctzll(occupied[l]) );
+			} else if ((oldTick >> shift) != (newTick >> shift)) {
+				for(int i = ((oldTick >> shift) & (SLOTS-1)) + 1; i <= ((newTick >> shift) & (SLOTS-1)); i++)
+					if (occupied[l] & (uint64_t(1) << i))
+						takeSlot( l, i );
+			}
+			refile( now, onExpired );
+		}
+	}
+
+	void clear() {
+		for(int l = 0; l < LEVELS; l++) {
+			for(int i = 0; i < SLOTS; i++) {
+				for(auto& t : slots[l][i])
+					*t.wheelIndex() = -1;
+				slots[l][i].clear();
+			}
+			occupied[l] = 0;
+			levelCount[l] = 0;
+		}
+		for(auto& t : overflow)
+			*t.wheelIndex() = -1;
+		overflow.clear();
+		count = 0;
+	}
+
+private:
+	int64_t currentTick;
+	size_t count;
+	uint64_t occupied[LEVELS];
+	size_t levelCount[LEVELS];
+	std::vector<T> slots[LEVELS][SLOTS];
+	std::vector<T> overflow;  // Tasks beyond the window of the top level
+	std::vector<T> scratch;
+
+	// The smallest `at` in each slot, with overflow as slot 0 of level LEVELS, valid unless the slot's bit in
+	// minStale is set
+	mutable double minAt[LEVELS+1][SLOTS];
+	mutable uint64_t minStale[LEVELS+1];
+
+	static int64_t toTick( double t ) { return int64_t( floor( t * TICKS_PER_SECOND ) ); }
+
+	// The slot (or overflow, for level LEVELS) a task for tick is filed in
+	std::vector<T>& locate( int64_t tick, int& level, int& slot ) {
+		for(int l = 0; l < LEVELS; l++) {
+			int shift = l*SLOT_BITS;
+			if ((tick >> (shift+SLOT_BITS)) == (currentTick >> (shift+SLOT_BITS))) {
+				level = l;
+				slot = (tick >> shift) & (SLOTS-1);
+				return slots[l][slot];
+			}
+		}
+		level = LEVELS;
+		slot = 0;
+		return overflow;
+	}
+
+	double slotMin( int l, int i ) const {
+		if (minStale[l] & (uint64_t(1) << i)) {
+			std::vector<T> const& s = l < LEVELS ? slots[l][i] : overflow;
+			double at = s[0].at;
+			for(int j = 1; j < s.size(); j++)
+				at = std::min( at, s[j].at );
+			minAt[l][i] = at;
+			minStale[l] &= ~(uint64_t(1) << i);
+		}
+		return minAt[l][i];
+	}
+
+	void place( T const& t, int64_t tick ) {
+		int l, i;
+		std::vector<T>& s = locate( tick, l, i );
+		*t.wheelIndex() = s.size();
+		if (s.empty()) {
+			minAt[l][i] = t.at;
+			minStale[l] &= ~(uint64_t(1) << i);
+		} else
+			minAt[l][i] = std::min( minAt[l][i], t.at );
+		s.push_back( t );
+		if (l < LEVELS) {
+			occupied[l] |= uint64_t(1) << i;
+			++levelCount[l];
+		}
+	}
+
+	template <class F>
+	void fireSlot( int l, int i, F& onExpired ) {
+		std::vector<T>& s = slots[l][i];
+		count -= s.size();
+		levelCount[l] -= s.size();
+		occupied[l] &= ~(uint64_t(1) << i);
+		for(auto& t : s) {
+			*t.wheelIndex() = -1;
+			onExpired( t );
+		}
+		s.clear();
+	}
+
+	template <class F>
+	void expireSlot( int i, double now, F& onExpired ) {
+		std::vector<T>& s = slots[0][i];
+		int kept = 0;
+		for(int j = 0; j < s.size(); j++) {
+			if (s[j].at < now) {
+				*s[j].wheelIndex() = -1;
+				onExpired( s[j] );
+			} else {
+				*s[j].wheelIndex() = kept;
+				minAt[0][i] = kept ? std::min( minAt[0][i], s[j].at ) : s[j].at;
+				s[kept++] = s[j];
+			}
+		}
+		minStale[0] &= ~(uint64_t(1) << i);
+		count -= s.size() - kept;
+		levelCount[0] -= s.size() - kept;
+		s.erase( s.begin() + kept, s.end() );
+		if (!kept) occupied[0] &= ~(uint64_t(1) << i);
+	}
+
+	void takeSlot( int l, int i ) {
+		std::vector<T>& s = slots[l][i];
+		levelCount[l] -= s.size();
+		occupied[l] &= ~(uint64_t(1) << i);
+		scratch.insert( scratch.end(), s.begin(), s.end() );
+		s.clear();
+	}
+
+	template <class F>
+	void refile( double now, F& onExpired ) {
+		for(auto& t : scratch) {
+			if (t.at < now) {
+				--count;
+				*t.wheelIndex() = -1;
+				onExpired( t );
+			} else
+				place( t, std::max( currentTick, toTick(t.at) ) );
+		}
+		scratch.clear();
+	}
+};
+
+#endif
@@ -589,6 +589,54 @@ template <class F> ThreadFuture< decltype(fake<F>()().getValue()) > onMainThread
 	return ThreadFuture<decltype(fake<F>()().getValue())>( returnValue );
 }
 
+// The result of an f() run by onRunLoop(), written on the run loop that ran it and read on the one that called
+template <class T>
+struct RunLoopHop : ThreadSafeReferenceCounted<RunLoopHop<T>> {
+	ErrorOr<T> result;
+};
+
+ACTOR template <class T, class F> void doOnRunLoop( Future<Void> signal, F f, Promise<Void> back, int returnLoop, int taskID, Reference<RunLoopHop<T>> hop ) {
+	try {
+		wait( signal );
+		T result = wait( f() );
+		hop->result = ErrorOr<T>( result );
+	} catch (Error& e) {
+		hop->result = ErrorOr<T>( e );
+	}
+	g_network->onRunLoop( returnLoop, std::move(back), taskID );
+}
+
+ACTOR template <class T> Future<T> doReturnFromRunLoop( Future<Void> back, Reference<RunLoopHop<T>> hop ) {
+	wait( back );
+	if (hop->result.isError())
+		throw hop->result.getError();
+	return hop->result.get();
+}
+
+// Runs f() on the given run loop, or on whichever run loop takes it first if runLoop is negative, and returns its
+// result on the calling run loop.  Both hops are waited on before the first is posted, as INetwork::onRunLoop()
+// requires.  f (and what it captures) is copied on this run loop and destroyed on the other.
+template <class F> Future< decltype(fake<F>()().getValue()) > onRunLoop( int runLoop, F f, int taskID ) {
+	typedef decltype(fake<F>()().getValue()) T;
+	Reference<RunLoopHop<T>> hop( new RunLoopHop<T> );
+	Promise<Void> signal;
+	Future<T> result;
+	{
+		Promise<Void> back;
+		result = doReturnFromRunLoop<T>( back.getFuture(), hop );
+		doOnRunLoop<T, F>( signal.getFuture(), f, back, g_network->getCurrentRunLoop(), taskID, hop );
+	}
+	if (runLoop < 0)
+		g_network->onAnyRunLoop( std::move(signal), taskID );
+	else
+		g_network->onRunLoop( runLoop, std::move(signal), taskID );
+	return result;
+}
+
+template <class F> Future< decltype(fake<F>()().getValue()) > onAnyRunLoop( F f, int taskID ) {
+	return onRunLoop( -1, f, taskID );
+}
+
 template <class V>
 class ThreadSafeAsyncVar : NonCopyable, public ThreadSafeReferenceCounted<ThreadSafeAsyncVar<V>> {
 public:
@@ -0,0 +1,93 @@
+/*
+ * ThreadSafeQueue.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/UnitTest.h"
+#include "flow/ThreadSafeQueue.h"
+
+TEST_CASE("/flow/ThreadSafeRingQueue/interface") {
+	ThreadSafeRingQueue<int, 4> q;
+	ASSERT( q.canSleep() );
+	ASSERT( q.push( 0 ) );
+	ASSERT( !q.push( 1 ) );
+	ASSERT( !q.canSleep() );
+
+	// Overflows the ring
+	for(int i = 2; i < 10; i++)
+		ASSERT( !q.push( i ) );
+	ASSERT( q.pop().get() == 0 );
+	ASSERT( !q.push( 10 ) );
+	int expected = 1;
+	q.popAll( [&expected](int& i) {
+		ASSERT( i == expected );
+		expected++;
+	} );
+	ASSERT( expected == 11 );
+	ASSERT( !q.pop().present() );
+
+	ASSERT( q.canSleep() );
+	ASSERT( q.push( 11 ) );
+	ASSERT( q.pop().get() == 11 );
+	return Void();
+}
+
+namespace {
+
+enum { PRODUCERS = 4, ITEMS_PER_PRODUCER = 200000 };
+
+struct RingProducer {
+	ThreadSafeRingQueue<int64_t, 64>* q;
+	int id;
+
+	THREAD_FUNC run( void* arg ) {
+		RingProducer* self = (RingProducer*)arg;
+		for(int64_t i = 0; i < ITEMS_PER_PRODUCER; i++)
+			self->q->push( (int64_t(self->id) << 32) + i );
+		THREAD_RETURN;
+	}
+};
+
+}
+
+TEST_CASE("/flow/ThreadSafeRingQueue/threaded") {
+	// A small ring makes the producers overflow often; each producer's items must still arrive in order
+	ThreadSafeRingQueue<int64_t, 64> q;
+	RingProducer producers[PRODUCERS];
+	THREAD_HANDLE threads[PRODUCERS];
+	for(int p = 0; p < PRODUCERS; p++) {
+		producers[p].q = &q;
+		producers[p].id = p;
+		threads[p] = startThread( &RingProducer::run, &producers[p] );
+	}
+
+	int64_t next[PRODUCERS] = {};
+	int64_t received = 0;
+	while (received < PRODUCERS * ITEMS_PER_PRODUCER) {
+		q.popAll( [&](int64_t& item) {
+			int p = item >> 32;
+			ASSERT( p >= 0 && p < PRODUCERS && (item & 0xffffffff) == next[p] );
+			next[p]++;
+			received++;
+		} );
+	}
+	for(int p = 0; p < PRODUCERS; p++)
+		waitThread( threads[p] );
+	ASSERT( !q.pop().present() && q.canSleep() );
+	return Void();
+}
@@ -27,6 +27,8 @@ THIS SOFTWARE IS PROVIDED BY DMITRY VYUKOV "AS IS" AND ANY EXPRESS OR IMPLIED WA
 
 The views and conclusions contained in the software and documentation are those of the authors and should not be interpreted as representing official policies, either expressed or implied, of Dmitry Vyukov.*/
 
+#include <atomic>
+
 template <class T>
 class ThreadSafeQueue : NonCopyable {
 	struct BaseNode {
@@ -121,4 +123,139 @@ public:
 		delete n;
 		return Optional<T>( std::move(data) );
 	}
-};
\ No newline at end of file
+};
+
+// ThreadSafeRingQueue<T> has the same interface and sleep semantics as ThreadSafeQueue<T>, but keeps up to Capacity
+// items in a preallocated ring instead of allocating a node for every push(), and its consumer can drain it in a single
+// pass with popAll().  Producers claim a slot by advancing the enqueue position and publish it through the slot's
+// sequence number, as in Vyukov's bounded queue.  If the ring is full, push() falls back to a ThreadSafeQueue<T>;
+// each overflowed item remembers the enqueue position at the time, so items from any one producer are still popped
+// in the order they were pushed.
+template <class T, int Capacity = 1024>
+class ThreadSafeRingQueue : NonCopyable {
+	static_assert( Capacity > 0 && (Capacity & (Capacity-1)) == 0, "Capacity must be a power of 2" );
+	enum { CACHE_LINE = 64 };
+
+	struct Cell {
+		std::atomic<uint64_t> sequence;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+	};
+
+	struct Overflowed {
+		T data;
+		uint64_t position;  // Ring items at or after this position were pushed after this item
+		Overflowed( T const& data, uint64_t position ) : data(data), position(position) {}
+	};
+
+	// Producer state, consumer state and the sleep flag each get their own cache line
+	alignas(CACHE_LINE) std::atomic<uint64_t> enqueuePos;
+	alignas(CACHE_LINE) std::atomic<int> overflowCount;
+	alignas(CACHE_LINE) std::atomic<bool> sleeping;
+	alignas(CACHE_LINE) uint64_t dequeuePos;
+	Cell* cells;
+	Optional<Overflowed> overflowHead;
+	ThreadSafeQueue<Overflowed> overflow;
+
+	bool wakeIfSleeping() {
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		return sleeping.load( std::memory_order_relaxed ) && sleeping.exchange( false );
+	}
+
+	void clearSleeping() {
+		if (sleeping.load( std::memory_order_relaxed ))
+			sleeping.store( false, std::memory_order_relaxed );
+	}
+
+	template <class F>
+	bool popOne( F& f ) {
+		Cell* cell = &cells[ dequeuePos & (Capacity-1) ];
+		bool published = cell->sequence.load( std::memory_order_acquire ) == dequeuePos + 1;
+
+		// Overflowed items are looked for after the ring slot, so that any pushed before the slot was published are seen
+		if (!overflowHead.present() && overflowCount.load( std::memory_order_acquire )) {
+			overflowHead = overflow.pop();
+			if (!overflowHead.present()) return false;  // An overflowed item is still being pushed
+		}
+		// An overflowed item goes before ring items at or after its position, and after any ring slots claimed before it
+		if (overflowHead.present() && (int64_t(overflowHead.get().position - dequeuePos) <= 0 ||
+		                               (!published && enqueuePos.load( std::memory_order_acquire ) == dequeuePos)))
+			return popOverflowed( f );
+		if (!published) return false;
+
+		T* t = (T*)&cell->data;
+		f( *t );
+		t->~T();
+		cell->sequence.store( dequeuePos + Capacity, std::memory_order_release );
+		dequeuePos++;
+		return true;
+	}
+
+	template <class F>
+	bool popOverflowed( F& f ) {
+		f( overflowHead.get().data );
+		overflowHead = Optional<Overflowed>();
+		overflowCount.fetch_sub( 1, std::memory_order_relaxed );
+		return true;
+	}
+
+public:
+	ThreadSafeRingQueue() : enqueuePos(0), overflowCount(0), sleeping(false), dequeuePos(0) {
+		cells = (Cell*)aligned_alloc( CACHE_LINE, Capacity*sizeof(Cell) );
+		for(int i = 0; i < Capacity; i++)
+			new (&cells[i].sequence) std::atomic<uint64_t>( i );
+	}
+	~ThreadSafeRingQueue() {
+		popAll( [](T&) {} );
+		aligned_free( cells );
+	}
+
+	// If push() returns true, the consumer may be sleeping and should be woken
+	bool push( T const& data ) {
+		uint64_t pos = enqueuePos.load( std::memory_order_relaxed );
+		Cell* cell;
+		while (true) {
+			cell = &cells[ pos & (Capacity-1) ];
+			int64_t dif = int64_t(cell->sequence.load( std::memory_order_acquire ) - pos);
+			if (dif == 0) {
+				if (enqueuePos.compare_exchange_weak( pos, pos+1, std::memory_order_relaxed ))
+					break;
+			} else if (dif < 0) {
+				overflowCount.fetch_add( 1, std::memory_order_relaxed );
+				overflow.push( Overflowed( data, pos ) );
+				return wakeIfSleeping();
+			} else
+				pos = enqueuePos.load( std::memory_order_relaxed );
+		}
+		new (&cell->data) T(data);
+		cell->sequence.store( pos+1, std::memory_order_release );
+		return wakeIfSleeping();
+	}
+
+	///////////// The below functions may only be called by a single, consumer thread //////////////////
+
+	// If canSleep returns true, then the queue is empty and the next push() will return true
+	bool canSleep() {
+		if (overflowHead.present() || enqueuePos.load( std::memory_order_relaxed ) != dequeuePos) return false;
+		sleeping.store( true, std::memory_order_relaxed );
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		if (enqueuePos.load( std::memory_order_relaxed ) == dequeuePos && !overflowCount.load( std::memory_order_relaxed ))
+			return true;
+		sleeping.store( false, std::memory_order_relaxed );
+		return false;
+	}
+
+	Optional<T> pop() {
+		clearSleeping();
+		Optional<T> result;
+		auto f = [&result](T& t) { result = std::move(t); };
+		popOne( f );
+		return result;
+	}
+
+	// Calls f(T&) for each item in the queue, in order, until it is empty
+	template <class F>
+	void popAll( F&& f ) {
+		clearSleeping();
+		while (popOne( f ));
+	}
+};
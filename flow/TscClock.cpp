@@ -0,0 +1,119 @@
+/*
+ * TscClock.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "flow/TscClock.h"
+#include "flow/Knobs.h"
+#include "flow/Trace.h"
+#include "flow/UnitTest.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+bool TscClock::invariantTsc() {
+#if defined(_WIN32)
+	int regs[4];
+	__cpuid(regs, 0x80000000);
+	if ((unsigned)regs[0] < 0x80000007) return false;
+	__cpuid(regs, 0x80000007);
+	return (regs[3] >> 8) & 1;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+	return (edx >> 8) & 1;
+#else
+	return false;
+#endif
+}
+
+// Takes the TSC and timer_monotonic() together, retrying to keep the gap between them small
+void TscClock::sample( int64_t& tsc, double& time ) {
+	int64_t best = std::numeric_limits<int64_t>::max();
+	for (int i = 0; i < 5; i++) {
+		int64_t before = __rdtsc();
+		double t = timer_monotonic();
+		int64_t after = __rdtsc();
+		if (after - before < best) {
+			best = after - before;
+			tsc = before + (after - before) / 2;
+			time = t;
+		}
+	}
+}
+
+TscClock::TscClock() : baseTime(0), secondsPerTick(0), baseTsc(0), nextCalibration(std::numeric_limits<int64_t>::max()) {
+	if (!FLOW_KNOBS->TSC_CLOCK) return;
+	if (!invariantTsc()) {
+		TraceEvent(SevWarnAlways, "TscClockUnavailable").detail("Reason", "NoInvariantTSC");
+		return;
+	}
+
+	// A first rate from a millisecond; recalibrate() refines it over longer intervals
+	sample( calibratedTsc, calibratedTime );
+	int64_t tsc;
+	double t;
+	do {
+		sample( tsc, t );
+	} while (t - calibratedTime < 1e-3);
+	if (tsc <= calibratedTsc) {
+		TraceEvent(SevWarnAlways, "TscClockUnavailable").detail("Reason", "TSCNotAdvancing");
+		return;
+	}
+
+	secondsPerTick = (t - calibratedTime) / (tsc - calibratedTsc);
+	baseTsc = calibratedTsc = tsc;
+	baseTime = calibratedTime = t;
+	nextCalibration = tsc + int64_t(FLOW_KNOBS->TSC_CALIBRATION_INTERVAL / secondsPerTick);
+}
+
+void TscClock::recalibrate() {
+	int64_t tsc;
+	double t;
+	sample( tsc, t );
+	double rate = (t - calibratedTime) / (tsc - calibratedTsc);
+	double clockTime = time( tsc );
+	double interval = FLOW_KNOBS->TSC_CALIBRATION_INTERVAL;
+
+	// Continue from where the clock is, at a rate that meets timer_monotonic() at the next calibration.  A clock more
+	// than an interval ahead (say, after the TSC stopped in a suspend) only waits, at half speed.
+	baseTsc = tsc;
+	baseTime = std::max( clockTime, t - interval );
+	secondsPerTick = std::max( rate * (1 + (t - baseTime) / interval), rate / 2 );
+	calibratedTsc = tsc;
+	calibratedTime = t;
+	nextCalibration = tsc + int64_t(interval / rate);
+}
+
+TEST_CASE("/flow/TscClock/time") {
+	TscClock clock;
+	if (!clock.enabled()) return Void();
+
+	for (int i = 0; i < 100; i++) {
+		double a = clock.now(), b = timer_monotonic(), c = clock.now();
+		ASSERT( a <= c && fabs( b - a ) < 1e-3 );
+	}
+	int64_t start = __rdtsc();
+	double t = timer_monotonic();
+	while (timer_monotonic() - t < 0.01) {}
+	double elapsed = clock.time( __rdtsc() ) - clock.time( start );
+	ASSERT( elapsed > 0.009 && elapsed < 0.011 );
+	return Void();
+}
@@ -0,0 +1,61 @@
+/*
+ * TscClock.h
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef FLOW_TSCCLOCK_H
+#define FLOW_TSCCLOCK_H
+#pragma once
+
+#include "flow/Platform.h"
+
+// Converts TSC readings to timer_monotonic() seconds, so that a run loop can take the time and count cycles with one
+// rdtsc.  The TSC rate is measured against timer_monotonic() at construction and again every TSC_CALIBRATION_INTERVAL
+// seconds, when the clock is also slewed back towards timer_monotonic(); it never steps backwards.  Without an
+// invariant TSC, or with TSC_CLOCK off, the clock is disabled and time() and now() read timer_monotonic().
+class TscClock {
+public:
+	TscClock();
+
+	bool enabled() const { return secondsPerTick > 0; }
+
+	// The time at which __rdtsc() returned tsc
+	double time( int64_t tsc ) const { return enabled() ? baseTime + (tsc - baseTsc) * secondsPerTick : timer_monotonic(); }
+	double now() const { return time( __rdtsc() ); }
+
+	// Called with recent TSC readings, at least once per run loop iteration
+	void maybeRecalibrate( int64_t tsc ) {
+		if (tsc >= nextCalibration) recalibrate();
+	}
+
+	// Whether the TSC runs at a constant rate through frequency changes and deep sleep states
+	static bool invariantTsc();
+
+private:
+	double baseTime, secondsPerTick;
+	int64_t baseTsc;
+	int64_t nextCalibration;
+	double calibratedTime;  // The last reading of timer_monotonic()...
+	int64_t calibratedTsc;  // ...and the TSC at the same moment
+
+	void recalibrate();
+	static void sample( int64_t& tsc, double& time );
+};
+
+#endif
@@ -0,0 +1,625 @@
+/*
+ * VirtualNetwork.actor.cpp
+ *
+ * This source file is part of the FoundationDB open source project
+ *
+ * Copyright 2013-2018 Apple Inc. and the FoundationDB project authors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "flow/flow.h"
+#include "flow/network.h"
+#include "flow/Knobs.h"
+#include "flow/Deque.h"
+#include "flow/DeterministicRandom.h"
+#include "flow/Trace.h"
+#include "flow/UnitTest.h"
+#include "flow/genericactors.actor.h"
+#include "flow/CoalescingWriter.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <queue>
+#include "flow/actorcompiler.h"  // This must be the last #include.
+
+// An INetwork that runs every task on the calling thread in virtual time: when nothing is ready, now() jumps to the
+// next timer instead of sleeping.  Tasks run in order of time, then TaskID, and then in an order drawn from its own
+// DeterministicRandom, so a run is reproducible from the seed (as long as the code it runs is, e.g. uses g_random).
+// Connections are in-memory loopback pairs between listen() and connect() on the same network, with a random
+// latency of about VIRTUAL_NETWORK_LATENCY and at most VIRTUAL_CONNECTION_WINDOW bytes in flight each way.
+//
+// There is no file system (IAsyncFileSystem::filesystem() is NULL) and no reactor.  Every method but onMainThread()
+// must be called on the thread that runs the network.  Signals from other threads are scheduled when run() next
+// looks for a task, so they do not keep a network with nothing else to do from stopping, and their timing is not
+// reproducible.
+
+namespace {
+
+class VirtualNetwork;
+
+class VirtualTask {
+public:
+	virtual ~VirtualTask() {}
+	// Runs the task, which then deletes itself
+	virtual void operator()() = 0;
+	// True if no one is waiting for the task any more, so it can be deleted without running
+	virtual bool cancelled() { return false; }
+};
+
+template <class T>
+struct SendTask : VirtualTask, FastAllocated<SendTask<T>> {
+	Promise<T> promise;
+	ErrorOr<T> value;
+
+	SendTask( Promise<T>&& promise, ErrorOr<T> const& value ) : promise(std::move(promise)), value(value) {}
+
+	virtual void operator()() {
+		if (value.isError())
+			promise.sendError( value.getError() );
+		else
+			promise.send( value.get() );
+		delete this;
+	}
+	virtual bool cancelled() { return !promise.getFutureReferenceCount(); }
+};
+
+struct ScheduledTask {
+	double time;
+	int taskID;
+	uint32_t order;  // Random, to break ties between tasks of the same time and TaskID
+	VirtualTask* task;
+
+	ScheduledTask( double time, int taskID, uint32_t order, VirtualTask* task ) : time(time), taskID(taskID), order(order), task(task) {}
+
+	// The reverse of the order they run in, for std::priority_queue
+	bool operator < ( ScheduledTask const& rhs ) const {
+		if (time != rhs.time) return time > rhs.time;
+		if (taskID != rhs.taskID) return taskID < rhs.taskID;
+		return order > rhs.order;
+	}
+};
+
+class LoopbackListener;
+
+class VirtualNetwork sealed : public INetwork, public INetworkConnections {
+public:
+	explicit VirtualNetwork( uint32_t seed );
+	~VirtualNetwork();
+
+	// INetwork interface
+	virtual double now() { return currentTime; }
+	virtual Future<Void> delay( double seconds, int taskID );
+	virtual Future<Void> yield( int taskID );
+	virtual bool check_yield( int taskID );
+	virtual int getCurrentTask() { return currentTaskID; }
+	virtual void setCurrentTask( int taskID ) { currentTaskID = taskID; }
+	virtual flowGlobalType global( int id ) { return (globals.size() > id) ? globals[id] : NULL; }
+	virtual void setGlobal( size_t id, flowGlobalType v ) { globals.resize( std::max(globals.size(), id+1) ); globals[id] = v; }
+	virtual void stop() { stopped = true; }
+	// It is not the FoundationDB simulator: there are no simulated processes or machines
+	virtual bool isSimulated() const { return false; }
+	virtual void onMainThread( Promise<Void>&& signal, int taskID );
+	virtual THREAD_HANDLE startThread( THREAD_FUNC_RETURN (*func) (void *), void *arg ) { return ::startThread( func, arg ); }
+	virtual void run();
+	virtual void getDiskBytes( std::string const& directory, int64_t& free, int64_t& total ) { ::getDiskBytes( directory, free, total ); }
+	virtual bool isAddressOnThisHost( NetworkAddress const& addr ) { return true; }
+
+	// INetworkConnections interface
+	virtual Future<Reference<IConnection>> connect( NetworkAddress toAddr, std::string host );
+	virtual Future<std::vector<NetworkAddress>> resolveTCPEndpoint( std::string host, std::string service );
+	virtual Reference<IListener> listen( NetworkAddress localAddr );
+
+	template <class T>
+	void schedule( double time, int taskID, Promise<T>&& promise, ErrorOr<T> const& value ) {
+		schedule( time, taskID, new SendTask<T>( std::move(promise), value ) );
+	}
+	void schedule( double time, int taskID, VirtualTask* task ) {
+		tasks.push( ScheduledTask( time, taskID, random.randomUInt32(), task ) );
+	}
+
+	// The one way latency of a new message
+	double latency() { return FLOW_KNOBS->VIRTUAL_NETWORK_LATENCY * (0.5 + random.random01()); }
+
+	std::map<NetworkAddress, LoopbackListener*> listeners;
+
+private:
+	DeterministicRandom random;
+	double currentTime;
+	int currentTaskID;
+	bool stopped;
+	uint16_t nextPort;  // For the peer addresses of accepted connections
+	std::priority_queue<ScheduledTask> tasks;
+	std::vector<flowGlobalType> globals;
+
+	// From onMainThread() on other threads, for run() to schedule
+	Mutex threadSignalsMutex;
+	std::vector<std::pair<Promise<Void>, int>> threadSignals;
+	std::atomic<bool> threadSignalled;
+
+	void scheduleThreadSignals();
+};
+
+// The network whose run() is running on this thread
+thread_local VirtualNetwork* thread_virtual_network = nullptr;
+
+// One end of a loopback connection.  Bytes written to it are copied to its peer, which can read them once they arrive.
+class LoopbackConnection : public IConnection, ReferenceCounted<LoopbackConnection> {
+public:
+	LoopbackConnection( VirtualNetwork* net, NetworkAddress peerAddress )
+	  : net(net), peer(nullptr), peerAddress(peerAddress), debugID(g_random->randomUniqueID()), closed(false),
+	    unread(0), lastArrival(0), peerClosedAt(std::numeric_limits<double>::infinity()), readOffset(0) {}
+	~LoopbackConnection() {
+		close();
+		if (peer) peer->peer = nullptr;
+	}
+
+	static void connect( LoopbackConnection* a, LoopbackConnection* b ) {
+		a->peer = b;
+		b->peer = a;
+	}
+
+	virtual void addref() { ReferenceCounted<LoopbackConnection>::addref(); }
+	virtual void delref() { ReferenceCounted<LoopbackConnection>::delref(); }
+
+	virtual void close() {
+		if (closed) return;
+		closed = true;
+		if (peer) peer->onPeerClosed( arrival() );
+	}
+
+	virtual Future<Void> onWritable() {
+		if (closed || peerClosed()) return connection_failed();
+		if (unread < FLOW_KNOBS->VIRTUAL_CONNECTION_WINDOW) return Void();
+		writable = Promise<Void>();  // Until onRead() or onPeerClosed()
+		return writable.getFuture();
+	}
+
+	virtual Future<Void> onReadable() {
+		if (closed) return connection_failed();
+		if (received.empty() && peerClosed()) return connection_failed();
+		if (!received.empty() && received.front().arrival <= net->now()) return Void();
+
+		Promise<Void> p;
+		Future<Void> f = p.getFuture();
+		if (!received.empty())
+			net->schedule( received.front().arrival, TaskReadSocket, std::move(p), ErrorOr<Void>(Void()) );
+		else if (peerClosedAt < std::numeric_limits<double>::infinity())
+			net->schedule( peerClosedAt, TaskReadSocket, std::move(p), ErrorOr<Void>(connection_failed()) );
+		else
+			readable = std::move(p);  // Until onReceived() or onPeerClosed()
+		return f;
+	}
+
+	virtual int read( uint8_t* begin, uint8_t* end ) {
+		if (closed) throw connection_failed();
+		double now = net->now();
+		int n = 0;
+		while (begin < end && !received.empty() && received.front().arrival <= now) {
+			std::string const& bytes = received.front().bytes;
+			int len = std::min<int64_t>( end - begin, bytes.size() - readOffset );
+			memcpy( begin, bytes.data() + readOffset, len );
+			begin += len;
+			n += len;
+			readOffset += len;
+			if (readOffset == bytes.size()) {
+				received.pop_front();
+				readOffset = 0;
+			}
+		}
+		if (!n && received.empty() && peerClosed()) throw connection_failed();
+		if (n && peer) peer->onRead( n );
+		return n;
+	}
+
+	virtual int write( SendBuffer const* buffer, int limit ) {
+		if (closed || !peer || peerClosed()) throw connection_failed();
+		int n = std::min<int64_t>( limit, FLOW_KNOBS->VIRTUAL_CONNECTION_WINDOW - unread );
+		std::string bytes;
+		for(; buffer && bytes.size() < n; buffer = buffer->next) {
+			int len = std::min<int64_t>( buffer->bytes_written - buffer->bytes_sent, n - bytes.size() );
+			bytes.append( (const char*)buffer->data + buffer->bytes_sent, len );
+		}
+		if (bytes.empty()) return 0;
+		int written = bytes.size();
+		unread += written;
+		peer->onReceived( std::move(bytes), arrival() );
+		return written;
+	}
+
+	virtual NetworkAddress getPeerAddress() { return peerAddress; }
+	virtual UID getDebugID() { return debugID; }
+	virtual int getReceiveBufferSize() { return FLOW_KNOBS->VIRTUAL_CONNECTION_WINDOW; }
+
+private:
+	struct Chunk {
+		double arrival;
+		std::string bytes;
+		Chunk( double arrival, std::string&& bytes ) : arrival(arrival), bytes(std::move(bytes)) {}
+	};
+
+	VirtualNetwork* net;
+	LoopbackConnection* peer;  // Cleared when the peer is destroyed
+	NetworkAddress peerAddress;
+	UID debugID;
+	bool closed;
+	int64_t unread;  // Bytes written that the peer has not read
+	double lastArrival;  // Of the last bytes written, so that they arrive in order
+	double peerClosedAt;  // When the peer's close() arrives, or infinity
+	Deque<Chunk> received;
+	size_t readOffset;  // Into received.front()
+	Promise<Void> readable, writable;
+
+	double arrival() {
+		return lastArrival = std::max( lastArrival, net->now() + net->latency() );
+	}
+
+	bool peerClosed() const { return peerClosedAt <= net->now(); }
+
+	// Whether p was set by onReadable() or onWritable() and is still awaited; scheduling it moves it away
+	static bool waiting( Promise<Void> const& p ) { return p.isValid() && p.getFutureReferenceCount(); }
+
+	void onReceived( std::string&& bytes, double arrival ) {
+		received.push_back( Chunk( arrival, std::move(bytes) ) );
+		if (waiting( readable ))
+			net->schedule( arrival, TaskReadSocket, std::move(readable), ErrorOr<Void>(Void()) );
+	}
+
+	// The peer read n bytes written here, which the window update reports after a latency
+	void onRead( int n ) {
+		unread -= n;
+		if (waiting( writable ))
+			net->schedule( net->now() + net->latency(), TaskWriteSocket, std::move(writable), ErrorOr<Void>(Void()) );
+	}
+
+	void onPeerClosed( double at ) {
+		peerClosedAt = at;
+		if (waiting( readable ))
+			net->schedule( at, TaskReadSocket, std::move(readable), ErrorOr<Void>(connection_failed()) );
+		if (waiting( writable ))
+			net->schedule( at, TaskWriteSocket, std::move(writable), ErrorOr<Void>(connection_failed()) );
+	}
+};
+
+class LoopbackListener : public IListener, ReferenceCounted<LoopbackListener> {
+public:
+	LoopbackListener( VirtualNetwork* net, NetworkAddress listenAddress ) : net(net), listenAddress(listenAddress) {
+		net->listeners[listenAddress] = this;
+	}
+	~LoopbackListener() { net->listeners.erase( listenAddress ); }
+
+	virtual void addref() { ReferenceCounted<LoopbackListener>::addref(); }
+	virtual void delref() { ReferenceCounted<LoopbackListener>::delref(); }
+
+	virtual Future<Reference<IConnection>> accept() {
+		if (!pending.empty()) {
+			Reference<IConnection> conn = pending.front();
+			pending.pop_front();
+			return conn;
+		}
+		accepting = Promise<Reference<IConnection>>();
+		return accepting.getFuture();
+	}
+
+	virtual NetworkAddress getListenAddress() { return listenAddress; }
+
+	// Schedules the arrival of the server end of a new connection
+	void connect( Reference<LoopbackConnection> conn, double at ) {
+		net->schedule( at, TaskReadSocket, new AcceptTask( Reference<LoopbackListener>::addRef(this), conn ) );
+	}
+
+private:
+	struct AcceptTask : VirtualTask, FastAllocated<AcceptTask> {
+		Reference<LoopbackListener> listener;
+		Reference<LoopbackConnection> conn;
+		AcceptTask( Reference<LoopbackListener> listener, Reference<LoopbackConnection> conn ) : listener(listener), conn(conn) {}
+
+		virtual void operator()() {
+			if (listener->accepting.getFutureReferenceCount()) {
+				Promise<Reference<IConnection>> p = listener->accepting;
+				listener->accepting = Promise<Reference<IConnection>>();
+				p.send( Reference<IConnection>(conn) );
+			} else
+				listener->pending.push_back( Reference<IConnection>(conn) );
+			delete this;
+		}
+	};
+
+	VirtualNetwork* net;
+	NetworkAddress listenAddress;
+	Deque<Reference<IConnection>> pending;
+	Promise<Reference<IConnection>> accepting;
+};
+
+VirtualNetwork::VirtualNetwork( uint32_t seed )
+  : random(seed), currentTime(0), currentTaskID(TaskDefaultYield), stopped(false), nextPort(1), threadSignalled(false) {
+	TraceEvent("VirtualNetworkStarting").detail("Seed", seed);
+	setGlobal( INetwork::enNetworkConnections, (flowGlobalType)(INetworkConnections*)this );
+}
+
+VirtualNetwork::~VirtualNetwork() {
+	// Tasks that never ran break their promises
+	while (!tasks.empty()) {
+		delete tasks.top().task;
+		tasks.pop();
+	}
+}
+
+Future<Void> VirtualNetwork::delay( double seconds, int taskID ) {
+	if (seconds >= 4e12)  // As in Net2
+		return Never();
+	Promise<Void> promise;
+	Future<Void> f = promise.getFuture();
+	schedule( currentTime + std::max( seconds, 0.0 ), taskID, std::move(promise), ErrorOr<Void>(Void()) );
+	return f;
+}
+
+bool VirtualNetwork::check_yield( int taskID ) {
+	if (taskID == TaskDefaultYield) taskID = currentTaskID;
+	return !tasks.empty() && tasks.top().time <= currentTime && tasks.top().taskID > taskID;
+}
+
+Future<Void> VirtualNetwork::yield( int taskID ) {
+	if (taskID == TaskDefaultYield) taskID = currentTaskID;
+	if (check_yield( taskID ))
+		return delay( 0, taskID );
+	currentTaskID = taskID;
+	return Void();
+}
+
+void VirtualNetwork::onMainThread( Promise<Void>&& signal, int taskID ) {
+	if (thread_virtual_network != this) {
+		MutexHolder holder( threadSignalsMutex );
+		threadSignals.emplace_back( std::move(signal), taskID );
+		threadSignalled.store( true, std::memory_order_release );
+		return;
+	}
+	if (stopped) return;
+	schedule( currentTime, taskID, std::move(signal), ErrorOr<Void>(Void()) );
+}
+
+void VirtualNetwork::scheduleThreadSignals() {
+	std::vector<std::pair<Promise<Void>, int>> signals;
+	{
+		MutexHolder holder( threadSignalsMutex );
+		signals.swap( threadSignals );
+		threadSignalled.store( false, std::memory_order_relaxed );
+	}
+	for(auto& s : signals)
+		schedule( currentTime, s.second, std::move(s.first), ErrorOr<Void>(Void()) );
+}
+
+void VirtualNetwork::run() {
+	int64_t tasksRun = 0, tasksCancelled = 0;
+	double start = timer_monotonic();
+	bool outerFreeIncrementally = g_arenaFreeIncrementally;
+	g_arenaFreeIncrementally = FLOW_KNOBS->ARENA_FREE_BYTES_PER_TASK > 0;
+	VirtualNetwork* outer = thread_virtual_network;
+	thread_virtual_network = this;
+	resetScratchArena();
+
+	while (!stopped) {
+		if (threadSignalled.load( std::memory_order_acquire ))
+			scheduleThreadSignals();
+		if (tasks.empty()) {
+			// Nothing can ever happen again, where a real network would wait forever
+			TraceEvent(SevWarnAlways, "VirtualNetworkIdle").detail("Time", currentTime);
+			break;
+		}
+		ScheduledTask t = tasks.top();
+		tasks.pop();
+		if (t.task->cancelled()) {
+			// e.g. a timeout() that lost its race; it does not move the clock
+			++tasksCancelled;
+			delete t.task;
+			continue;
+		}
+		currentTime = std::max( currentTime, t.time );
+		currentTaskID = t.taskID;
+		++tasksRun;
+		try {
+			(*t.task)();
+		} catch (Error& e) {
+			TraceEvent(SevError, "TaskError").error(e);
+		} catch (...) {
+			TraceEvent(SevError, "TaskError").error(unknown_error());
+		}
+		resetScratchArena();
+	}
+
+	thread_virtual_network = outer;
+	g_arenaFreeIncrementally = outerFreeIncrementally;
+	TraceEvent("VirtualNetworkStopped").detail("Time", currentTime).detail("Elapsed", timer_monotonic() - start)
+		.detail("TasksRun", tasksRun).detail("TasksCancelled", tasksCancelled);
+}
+
+Future<Reference<IConnection>> VirtualNetwork::connect( NetworkAddress toAddr, std::string host ) {
+	Promise<Reference<IConnection>> promise;
+	Future<Reference<IConnection>> f = promise.getFuture();
+	auto l = listeners.find( toAddr );
+	if (l == listeners.end()) {
+		schedule( currentTime + latency(), TaskDefaultYield, std::move(promise), ErrorOr<Reference<IConnection>>(connection_failed()) );
+		return f;
+	}
+
+	Reference<LoopbackConnection> client( new LoopbackConnection( this, toAddr ) );
+	Reference<LoopbackConnection> server( new LoopbackConnection( this, NetworkAddress( toAddr.ip, nextPort++ ) ) );
+	LoopbackConnection::connect( client.getPtr(), server.getPtr() );
+	// The server end arrives after one latency, and the client's connect() completes after a round trip
+	double at = currentTime + latency();
+	l->second->connect( server, at );
+	schedule( at + latency(), TaskDefaultYield, std::move(promise), ErrorOr<Reference<IConnection>>( Reference<IConnection>(client) ) );
+	return f;
+}
+
+Future<std::vector<NetworkAddress>> VirtualNetwork::resolveTCPEndpoint( std::string host, std::string service ) {
+	try {
+		return std::vector<NetworkAddress>{ NetworkAddress::parse( host + ":" + service ) };
+	} catch (Error& e) {
+		return lookup_failed();
+	}
+}
+
+Reference<IListener> VirtualNetwork::listen( NetworkAddress localAddr ) {
+	if (listeners.count( localAddr )) throw address_in_use();
+	return Reference<IListener>( new LoopbackListener( this, localAddr ) );
+}
+
+} // namespace
+
+INetwork* newVirtualNetwork( uint32_t seed ) {
+	return new VirtualNetwork( seed );
+}
+
+// Runs test() on a new VirtualNetwork until it stops the network, and returns whether test() succeeded
+static bool runVirtualNetwork( uint32_t seed, std::function<Future<Void>()> const& test ) {
+	INetwork* outer = g_network;
+	bool succeeded;
+	{
+		VirtualNetwork net( seed );
+		g_network = &net;
+		Future<Void> done = test();
+		net.run();
+		succeeded = done.isReady() && !done.isError();
+	}
+	g_network = outer;
+	return succeeded;
+}
+
+// Records the order in which delays end, most of which tie with others of the same time and TaskID
+static Future<Void> recordDelays( std::vector<int>* order ) {
+	std::vector<Future<Void>> delays;
+	for(int i = 0; i < 100; i++)
+		delays.push_back( map( delay( (i % 4) * 0.001, i % 8 < 4 ? TaskDefaultDelay : TaskLowPriority ), [order, i](Void) {
+			order->push_back( i );
+			return Void();
+		} ) );
+	return map( waitForAll( delays ), [](Void) {
+		g_network->stop();
+		return Void();
+	} );
+}
+
+static std::vector<int> virtualSchedule( uint32_t seed ) {
+	std::vector<int> order;
+	ASSERT( runVirtualNetwork( seed, [&order]() { return recordDelays( &order ); } ) );
+	return order;
+}
+
+TEST_CASE("/flow/VirtualNetwork/deterministic") {
+	std::vector<int> schedule = virtualSchedule( 1 );
+	ASSERT( schedule.size() == 100 );
+	ASSERT( virtualSchedule( 1 ) == schedule );
+	// The seed only breaks ties, so the delays still end in order of time, and then of TaskID
+	for(int i = 1; i < schedule.size(); i++)
+		ASSERT( schedule[i-1] % 4 < schedule[i] % 4 || (schedule[i-1] % 4 == schedule[i] % 4 && schedule[i-1] % 8 <= schedule[i] % 8) );
+	ASSERT( virtualSchedule( 2 ) != schedule );
+	return Void();
+}
+
+ACTOR static Future<Void> loopbackEcho() {
+	state NetworkAddress addr = NetworkAddress::parse( "127.0.0.1:4500" );
+	state Reference<IListener> listener = INetworkConnections::net()->listen( addr );
+	state Future<Reference<IConnection>> accepted = listener->accept();
+	state Reference<IConnection> client = wait( INetworkConnections::net()->connect( addr ) );
+	state Reference<IConnection> server = wait( accepted );
+	state std::string received( 16, 0 );
+	state double sent = now();
+	ASSERT( client->getPeerAddress() == addr );
+
+	SendBuffer buffer;
+	buffer.data = (uint8_t const*)"hello";
+	buffer.bytes_written = 5;
+	buffer.bytes_sent = 0;
+	buffer.next = nullptr;
+	ASSERT( client->write( &buffer ) == 5 );
+	wait( server->onReadable() );
+	ASSERT( now() > sent );
+	ASSERT( server->read( (uint8_t*)&received[0], (uint8_t*)&received[0] + received.size() ) == 5 && received.compare( 0, 5, "hello" ) == 0 );
+
+	// Closing one end fails reads at the other once the close arrives
+	client->close();
+	try {
+		wait( server->onReadable() );
+		ASSERT( false );
+	} catch (Error& e) {
+		ASSERT( e.code() == error_code_connection_failed );
+	}
+
+	// No one listens here
+	try {
+		Reference<IConnection> refused = wait( INetworkConnections::net()->connect( NetworkAddress::parse( "127.0.0.1:4501" ) ) );
+		ASSERT( false );
+	} catch (Error& e) {
+		ASSERT( e.code() == error_code_connection_failed );
+	}
+	g_network->stop();
+	return Void();
+}
+
+TEST_CASE("/flow/VirtualNetwork/loopback") {
+	ASSERT( runVirtualNetwork( 1, loopbackEcho ) );
+	return Void();
+}
+
+// Queues a message of the given size on writer, and hands it over
+static void queueMessage( CoalescingWriter* writer, int bytes ) {
+	std::string message( bytes, 'x' );
+	PacketWriter packet( writer->unsent.getWriteBuffer(), NULL, AssumeVersion(currentProtocolVersion) );
+	packet.serializeBytes( message.data(), message.size() );
+	writer->unsent.setWriteBuffer( packet.finish() );
+	writer->send();
+}
+
+ACTOR static Future<Void> coalescedLoopback() {
+	state NetworkAddress addr = NetworkAddress::parse( "127.0.0.1:4502" );
+	state Reference<IListener> listener = INetworkConnections::net()->listen( addr );
+	state Future<Reference<IConnection>> accepted = listener->accept();
+	state Reference<IConnection> client = wait( INetworkConnections::net()->connect( addr ) );
+	state Reference<IConnection> server = wait( accepted );
+	state std::unique_ptr<CoalescingWriter> writer( new CoalescingWriter( client ) );
+	state std::string received( 64 << 10, 0 );
+	state int64_t bytesReceived = 0;
+	state int i;
+
+	// Small messages queued together wait out the coalescing delay, and then go out in one write
+	for(i = 0; i < 100; i++)
+		queueMessage( writer.get(), 100 );
+	ASSERT( writer->getWrites() == 0 );
+	wait( delay( 0.001 ) );
+	ASSERT( writer->getWrites() == 1 && writer->getBytesWritten() == 100 * 100 );
+
+	// Once COALESCE_FLUSH_BYTES are queued they are written without waiting, along with the messages before them
+	queueMessage( writer.get(), 100 );
+	ASSERT( writer->getWrites() == 1 );
+	queueMessage( writer.get(), FLOW_KNOBS->COALESCE_FLUSH_BYTES );
+	ASSERT( writer->getWrites() == 2 && writer->getBytesWritten() == 101 * 100 + FLOW_KNOBS->COALESCE_FLUSH_BYTES );
+
+	while (bytesReceived < writer->getBytesWritten()) {
+		wait( server->onReadable() );
+		int n = server->read( (uint8_t*)&received[0], (uint8_t*)&received[0] + received.size() );
+		ASSERT( std::count( received.begin(), received.begin() + n, 'x' ) == n );
+		bytesReceived += n;
+	}
+	ASSERT( bytesReceived == writer->getBytesWritten() );
+
+	writer.reset();
+	client->close();
+	g_network->stop();
+	return Void();
+}
+
+TEST_CASE("/flow/VirtualNetwork/coalescingWriter") {
+	ASSERT( runVirtualNetwork( 1, coalescedLoopback ) );
+	return Void();
+}
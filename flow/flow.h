@@ -385,6 +385,9 @@ public:
 	int getFutureReferenceCount() const { return futures; }
 	int getPromiseReferenceCount() const { return promises; }
 
+	// The callback that will be fired first, such as the ActorCallback of a waiting actor, or NULL if there are none
+	Callback<T>* getFirstCallback() { return Callback<T>::next == this ? NULL : Callback<T>::next; }
+
 	virtual void destroy() { delete this; }
 	virtual void cancel() {}
 
@@ -409,6 +412,15 @@ public:
 		cb->insertChain(this);
 	}
 
+	void reverseCallbacks() {
+		// Callbacks added with addCallbackAndDelFutureRef will fire in the order they were added, rather than most recent first
+		Callback<T>* cb = this;
+		do {
+			std::swap( cb->prev, cb->next );
+			cb = cb->prev;
+		} while (cb != this);
+	}
+
 	virtual void unwait() {
 		delFutureRef();
 	}
@@ -666,6 +678,7 @@ public:
 
 	int getFutureReferenceCount() const { return sav->getFutureReferenceCount(); }
 	int getPromiseReferenceCount() const { return sav->getPromiseReferenceCount(); }
+	Callback<T>* getFirstCallback() const { return sav->getFirstCallback(); }
 
 private:
 	SAV<T> *sav;
@@ -216,3 +216,23 @@ TEST_CASE("/flow/network/ipaddress") {
 
 	return Void();
 }
+
+TEST_CASE("/flow/network/NetworkMetrics/queuedBins") {
+	ASSERT( NetworkMetrics::queuedBin(-5) == 0 );
+	for (int b = 0; b < NetworkMetrics::QUEUED_BINS; b++) {
+		int64_t start = NetworkMetrics::queuedBinStart(b);
+		ASSERT( NetworkMetrics::queuedBin(start) == b );
+		if (b) ASSERT( NetworkMetrics::queuedBin(start-1) == b-1 );
+		ASSERT( b < 4 || NetworkMetrics::queuedBinStart(b+1) - start <= start / 4 );
+	}
+	ASSERT( NetworkMetrics::queuedBin(int64_t(1)<<40) == NetworkMetrics::QUEUED_BINS-1 );
+
+	NetworkMetrics m;
+	for (int taskID = 0; taskID < NetworkMetrics::TASK_STATS_SLOTS + 10; taskID++)
+		m.countTask( taskID, 100, 1000 );
+	m.countTask( 5, 100, 1000 );
+	ASSERT( m.countUntrackedTasks == 10 );
+	for (auto& s : m.taskStats)
+		ASSERT( s.tasks == (s.taskID == 5 ? 2 : 1) && s.cycles == s.tasks * 100 && s.queued[NetworkMetrics::queuedBin(1000)] == s.tasks );
+	return Void();
+}
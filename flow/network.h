@@ -258,6 +258,57 @@ struct NetworkMetrics {
 	double secSquaredSubmit;
 	double secSquaredDiskStall;
 
+	double secSpinning;         // Polling for events instead of sleeping (REACTOR_SPIN_MAX)
+	double secSleeping;
+	uint64_t countSpinWakeups;  // Events that arrived while polling
+
+	// With REACTOR_IO_URING: io_uring_enter() calls, completions reaped, and the ring eventfd reads (each after an
+	// epoll wakeup) that some of those completions took to be noticed
+	uint64_t countRingEnters;
+	uint64_t countRingCompletions;
+	uint64_t countRingEventFDReads;
+
+	// Per TaskID, the tasks the run loop ran, the TSC cycles they took, and a histogram of the cycles they waited in the
+	// ready queue.  TaskIDs take the slots as they are first run; once all are taken, tasks of other TaskIDs are only
+	// counted in countUntrackedTasks.
+	enum { TASK_STATS_SLOTS = 64, QUEUED_BINS = 80 };
+	struct TaskStats {
+		int taskID;
+		uint64_t tasks;
+		uint64_t cycles;
+		uint32_t queued[QUEUED_BINS];
+	};
+	TaskStats taskStats[TASK_STATS_SLOTS];
+	uint64_t countUntrackedTasks;
+
+	void countTask( int taskID, int64_t cycles, int64_t queuedCycles ) {
+		for(uint32_t i = uint32_t(taskID) * 2654435761u, n = 0; n < TASK_STATS_SLOTS; i++, n++) {
+			TaskStats& s = taskStats[ i % TASK_STATS_SLOTS ];
+			if (s.taskID != taskID) {
+				if (s.tasks) continue;
+				s.taskID = taskID;
+			}
+			++s.tasks;
+			s.cycles += cycles;
+			++s.queued[ queuedBin(queuedCycles) ];
+			return;
+		}
+		++countUntrackedTasks;
+	}
+
+	// Log-linear bins of 256 cycle units: bins 0-3 hold 0-3 units, and each later group of four bins splits an octave
+	// of units in four, up to the last bin, which also holds everything beyond it (2^29 cycles)
+	static int queuedBin( int64_t cycles ) {
+		uint64_t v = std::max<int64_t>( cycles, 0 ) >> 8;
+		if (v < 4) return v;
+		int e = 63 - clzll(v);
+		return std::min<int>( QUEUED_BINS-1, 4*(e-1) + ((v >> (e-2)) & 3) );
+	}
+	static int64_t queuedBinStart( int bin ) {
+		if (bin < 4) return int64_t(bin) << 8;
+		return int64_t(4 + (bin&3)) << (bin/4 - 1 + 8);
+	}
+
 	NetworkMetrics() { memset(this, 0, sizeof(*this)); }
 };
 
@@ -301,6 +352,9 @@ public:
 	virtual NetworkAddress getPeerAddress() = 0;
 
 	virtual UID getDebugID() = 0;
+
+	// Returns the size of the socket's receive buffer (its receive window), or 0 if the connection doesn't know it
+	virtual int getReceiveBufferSize() { return 0; }
 };
 
 class IListener {
@@ -321,6 +375,8 @@ typedef NetworkAddressList (*NetworkAddressesFuncPtr)();
 class INetwork;
 extern INetwork* g_network;
 extern INetwork* newNet2(bool useThreadPool = false, bool useMetrics = false);
+// A single threaded network in virtual time, with loopback connections, that runs tasks deterministically from seed
+extern INetwork* newVirtualNetwork(uint32_t seed);
 
 class INetwork {
 public:
@@ -331,7 +387,7 @@ public:
 	enum enumGlobal {
 		enFailureMonitor = 0, enFlowTransport = 1, enTDMetrics = 2, enNetworkConnections = 3,
 		enNetworkAddressFunc = 4, enFileSystem = 5, enASIOService = 6, enEventFD = 7, enRunCycleFunc = 8, enASIOTimedOut = 9, enBlobCredentialFiles = 10,
-		enNetworkAddressesFunc = 11
+		enNetworkAddressesFunc = 11, enIoUring = 12
 	};
 
 	virtual void longTaskCheck( const char* name ) {}
@@ -367,6 +423,27 @@ public:
 	virtual void onMainThread( Promise<Void>&& signal, int taskID ) = 0;
 	// Executes signal.send(Void()) on a/the thread belonging to this network
 
+	virtual int getRunLoopCount() { return 1; }
+	// Returns the number of run loops (threads executing tasks) in this network; see FLOW_KNOBS->RUN_LOOPS
+
+	virtual int getCurrentRunLoop() { return 0; }
+	// Returns the index of the run loop on the calling thread, or 0 (the main thread) if it is not a run loop
+
+	virtual void onRunLoop( int runLoop, Promise<Void>&& signal, int taskID ) { onMainThread( std::move(signal), taskID ); }
+	// Executes signal.send(Void()) on the given run loop.  That loop may send and release signal before this returns,
+	// and SAVs are not thread safe, so every wait on signal must already have started before it is posted here:
+	// "wait( signal.getFuture() )" after this call is a data race.  Use onRunLoop(runLoop, f, taskID) from
+	// ThreadHelper.actor.h, which does this for both the hop there and the hop back.
+
+	virtual void onAnyRunLoop( Promise<Void>&& signal, int taskID ) { onMainThread( std::move(signal), taskID ); }
+	// Executes signal.send(Void()) on whichever run loop gets to it first; idle run loops steal these tasks from busy ones.
+	// Whatever waits on signal must therefore be safe to continue on any run loop thread, and must have started waiting
+	// before signal is posted, as for onRunLoop().  See onAnyRunLoop(f, taskID) in ThreadHelper.actor.h.
+
+	virtual bool getRunLoopMetrics( int runLoop, NetworkMetrics& metrics ) { if (runLoop) return false; metrics = networkMetrics; return true; }
+	// Copies the networkMetrics of the given run loop.  Those of run loops other than 0 are as of up to
+	// FLOW_KNOBS->RUN_LOOP_METRICS_INTERVAL ago.  Call from run loop 0.
+
 	virtual THREAD_HANDLE startThread( THREAD_FUNC_RETURN (*func) (void *), void *arg) = 0;
 	// Starts a thread and returns a handle to it
 
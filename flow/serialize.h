@@ -523,6 +523,9 @@ public:
 
 	bool empty() const { return begin == end; }
 
+	// The input not yet read
+	StringRef remaining() const { return StringRef( (const uint8_t*)begin, end-begin ); }
+
 	void checkpoint() {
 		check = begin;
 	}
@@ -620,11 +623,13 @@ struct SendBuffer {
 	int bytes_written, bytes_sent;
 	uint8_t const* data;
 	SendBuffer* next;
+	bool external = false;  // If true, this is a PacketBuffer whose data is owned by its arena (see PacketWriter::serializeBytesZeroCopy())
 };
 
 struct PacketBuffer : SendBuffer, FastAllocated<PacketBuffer> {
 	int reference_count;
-	enum { DATA_SIZE = 4096 - 28 }; //28 is the size of the PacketBuffer fields
+	Arena arena;  // For an external buffer, keeps the memory data points to alive
+	enum { DATA_SIZE = 4096 - 40 }; //40 is the size of the PacketBuffer fields
 	uint8_t data[ DATA_SIZE ];
 
 	PacketBuffer() : reference_count(1) {
@@ -633,10 +638,18 @@ struct PacketBuffer : SendBuffer, FastAllocated<PacketBuffer> {
 		((SendBuffer*)this)->data = data;
 		static_assert( sizeof(PacketBuffer) == 4096, "PacketBuffer size mismatch" );
 	}
+	// An external buffer, which refers to bytes owned by arena instead of holding a copy of them
+	PacketBuffer( StringRef bytes, Arena const& arena ) : reference_count(1), arena(arena) {
+		next = 0;
+		bytes_written = bytes.size();
+		bytes_sent = 0;
+		((SendBuffer*)this)->data = bytes.begin();
+		external = true;
+	}
 	PacketBuffer* nextPacketBuffer() { return (PacketBuffer*)next; }
 	void addref() { ++reference_count; }
 	void delref() { if (!--reference_count) delete this; }
-	int bytes_unwritten() const { return DATA_SIZE-bytes_written; }
+	int bytes_unwritten() const { return external ? 0 : DATA_SIZE-bytes_written; }
 };
 
 struct PacketWriter {
@@ -662,6 +675,9 @@ struct PacketWriter {
 		}
 	}
 	void serializeBytesAcrossBoundary(const void* data, int bytes);
+	// Like serializeBytes(), but if there are at least FLOW_KNOBS->ZERO_COPY_MIN_BYTES the packet refers to the bytes in
+	// place, and holds arena, which must own them, until they have been sent
+	void serializeBytesZeroCopy( StringRef bytes, Arena const& arena );
 	void writeAhead( int bytes, struct SplitBuffer* );
 	void nextBuffer();
 	PacketBuffer* finish();
@@ -711,6 +727,17 @@ struct SerializeBoolAnd : MakeSerializeSource<SerializeBoolAnd<T>> {
 	template <class Ar> void serialize(Ar& ar) const { ar << b << value; }
 };
 
+// Serializes value as save() does a StringRef, but without copying it into the packet if it is large
+struct SerializeSourceZeroCopy : ISerializeSource {
+	Standalone<StringRef> value;
+	SerializeSourceZeroCopy( Standalone<StringRef> const& value ) : value(value) {}
+	virtual void serializePacketWriter( PacketWriter& w ) const {
+		w << (uint32_t)value.size();
+		w.serializeBytesZeroCopy( value, value.arena() );
+	}
+	virtual void serializeBinaryWriter( BinaryWriter& w ) const { w << (StringRef const&)value; }
+};
+
 struct SerializeSourceRaw : MakeSerializeSource<SerializeSourceRaw> {
 	StringRef data;
 	SerializeSourceRaw(StringRef data) : data(data) {}